@@ -0,0 +1,316 @@
+#include <stddef.h>
+#include <time.h>
+#include "backup.h"
+#include "crc32c.h"
+#include "dirindex.h"
+
+static Checkpoint* checkpoints(BootSector *sysInfo) {
+  return (Checkpoint*)checkpointTable(sysInfo);
+}
+
+u_int32_t trackedSectors(BootSector *sysInfo) {
+  return sysInfo->ReservedSectors + sysInfo->FATCopies * fatCopySectors(sysInfo) + sysInfo->SectorsPerChecksum
+         + sysInfo->SectorsPerRefcount + sysInfo->SectorsPerSnapshotTable;
+}
+
+static u_int32_t headerSectors(BootSector *sysInfo) {
+  u_int32_t bps = sysInfo->BytesPerSector;
+  return (MAX_CHECKPOINTS * sizeof(Checkpoint) + bps - 1) / bps;
+}
+
+/*
+ * Size of the checkpoint table for a volume of at most clusters physical
+ * clusters. The tables in front of it must be sized already.
+ */
+u_int32_t checkpointTableSectors(BootSector *sysInfo, u_int32_t clusters) {
+  u_int32_t bps = sysInfo->BytesPerSector;
+  u_int32_t bits = trackedSectors(sysInfo) + clusters;
+  return headerSectors(sysInfo) + MAX_CHECKPOINTS * (((bits + 7) / 8 + bps - 1) / bps);
+}
+
+static u_int8_t* bitmap(BootSector *sysInfo, int i) {
+  u_int32_t sectors = (sysInfo->SectorsPerCheckpointTable - headerSectors(sysInfo)) / MAX_CHECKPOINTS;
+  return checkpointTable(sysInfo) + (headerSectors(sysInfo) + i * sectors) * sysInfo->BytesPerSector;
+}
+
+static int isDirty(u_int8_t *map, u_int32_t bit) {
+  return map[bit / 8] >> bit % 8 & 1;
+}
+
+//Set bit in the bitmap of every checkpoint.
+static void markBit(BootSector *sysInfo, u_int32_t bit) {
+  Checkpoint *table = checkpoints(sysInfo);
+  for (int i = 0; i < MAX_CHECKPOINTS; ++i) {
+    if (table[i].Name[0] != '\0')
+      bitmap(sysInfo, i)[bit / 8] |= 1 << bit % 8;
+  }
+}
+
+void markDirtyCluster(u_int16_t P, BootSector *sysInfo) {
+  if (sysInfo->SectorsPerCheckpointTable == 0 || P < 2)
+    return;
+  markBit(sysInfo, trackedSectors(sysInfo) + P - 2);
+}
+
+void metadataModified(void *addr, u_int32_t len, BootSector *sysInfo) {
+  if (sysInfo->SectorsPerCheckpointTable == 0 || len == 0)
+    return;
+  u_int32_t offset = (u_int8_t*)addr - (u_int8_t*)sysInfo;
+  for (u_int32_t s = offset / sysInfo->BytesPerSector; s <= (offset + len - 1) / sysInfo->BytesPerSector; ++s)
+    markBit(sysInfo, s);
+}
+
+static Checkpoint* findCheckpoint(char *name, BootSector *sysInfo) {
+  if (sysInfo->SectorsPerCheckpointTable == 0)
+    return NULL;
+  Checkpoint *table = checkpoints(sysInfo);
+  for (int i = 0; i < MAX_CHECKPOINTS; ++i) {
+    if (table[i].Name[0] != '\0' && strcmp(table[i].Name, name) == 0)
+      return &table[i];
+  }
+  return NULL;
+}
+
+//Number of sectors and clusters dirty in the bitmap of checkpoint i.
+static void countDirty(int i, BootSector *sysInfo, u_int32_t *sectors, u_int32_t *clusters) {
+  u_int8_t *map = bitmap(sysInfo, i);
+  u_int32_t tracked = trackedSectors(sysInfo);
+  *sectors = *clusters = 0;
+  for (u_int32_t bit = 0; bit < tracked + sysInfo->ClusterCount; ++bit) {
+    if (isDirty(map, bit))
+      ++*(bit < tracked ? sectors : clusters);
+  }
+}
+
+// "checkpoint create <name>": Start tracking changes from now on. An
+// existing checkpoint of that name starts over, as after taking a backup.
+void checkpointCreate(char *name, BootSector *sysInfo) {
+  if (sysInfo->SectorsPerCheckpointTable == 0) {
+    printf("checkpoint: volume has no checkpoint table.\n");
+    return;
+  }
+  if (strlen(name) == 0 || strlen(name) > MAX_CHECKPOINT_NAME) {
+    printf("checkpoint: name must be 1 to %d characters long.\n", MAX_CHECKPOINT_NAME);
+    return;
+  }
+  Checkpoint *table = checkpoints(sysInfo), *c = findCheckpoint(name, sysInfo);
+  for (int i = 0; i < MAX_CHECKPOINTS && c == NULL; ++i) {
+    if (table[i].Name[0] == '\0')
+      c = &table[i];
+  }
+  if (c == NULL) {
+    printf("checkpoint: all %d checkpoint slots are in use.\n", MAX_CHECKPOINTS);
+    return;
+  }
+  u_int32_t sectors = (sysInfo->SectorsPerCheckpointTable - headerSectors(sysInfo)) / MAX_CHECKPOINTS;
+  memset(bitmap(sysInfo, c - table), 0, sectors * sysInfo->BytesPerSector);
+  memset(c, 0, sizeof(Checkpoint));
+  strcpy(c->Name, name);
+  c->Created = time(NULL);
+}
+
+// "checkpoint list": Print every checkpoint with its creation time and how
+// much has changed since.
+void checkpointList(BootSector *sysInfo) {
+  if (sysInfo->SectorsPerCheckpointTable == 0)
+    return;
+  Checkpoint *table = checkpoints(sysInfo);
+  for (int i = 0; i < MAX_CHECKPOINTS; ++i) {
+    Checkpoint *c = &table[i];
+    if (c->Name[0] == '\0')
+      continue;
+    u_int32_t sectors, clusters;
+    countDirty(i, sysInfo, &sectors, &clusters);
+    time_t created = c->Created;
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&created));
+    printf("%s\t%s\t%u sectors and %u clusters changed\n", c->Name, when, sectors, clusters);
+  }
+}
+
+// "checkpoint delete <name>"
+void checkpointDelete(char *name, BootSector *sysInfo) {
+  Checkpoint *c = findCheckpoint(name, sysInfo);
+  if (c == NULL) {
+    printf("checkpoint: %s does not exist.\n", name);
+    return;
+  }
+  memset(c, 0, sizeof(Checkpoint));
+}
+
+static void fillHeader(DeltaHeader *h, BootSector *sysInfo) {
+  memset(h, 0, sizeof(DeltaHeader));
+  memcpy(h->Magic, DELTA_MAGIC, sizeof(h->Magic));
+  h->VolumeSerialNumber = sysInfo->VolumeSerialNumber;
+  h->Sectors = volumeSectors(sysInfo);
+  h->BytesPerSector = sysInfo->BytesPerSector;
+  h->ClusterCount = sysInfo->ClusterCount;
+  h->StripeImages = sysInfo->StripeImages;
+  h->SectorsPerCluster = sysInfo->SectorsPerCluster;
+}
+
+static void writeDelta(FILE *fp, const void *buf, size_t len, u_int32_t *crc) {
+  fwrite(buf, 1, len, fp);
+  *crc = crc32c(*crc, buf, len);
+}
+
+/*
+ * "backup-delta <checkpoint> <file>": Write everything that changed since
+ * checkpoint to file. Dirty bits are gathered into runs of consecutive
+ * sectors or clusters, so the delta stays small and the walk over the
+ * bitmap is the only part that depends on the size of the volume.
+ */
+void backupDelta(char *name, char *file, u_int8_t *data, BootSector *sysInfo) {
+  Checkpoint *c = findCheckpoint(name, sysInfo);
+  if (c == NULL) {
+    printf("backup-delta: checkpoint %s does not exist.\n", name);
+    return;
+  }
+  FILE *fp = fopen(file, "wb");
+  if (fp == NULL) {
+    printf("backup-delta: %s: %s\n", file, strerror(errno));
+    return;
+  }
+  u_int8_t *map = bitmap(sysInfo, c - checkpoints(sysInfo));
+  u_int32_t tracked = trackedSectors(sysInfo);
+  u_int32_t bits = tracked + sysInfo->ClusterCount;
+  u_int32_t bps = sysInfo->BytesPerSector, size = clusterSize(sysInfo);
+
+  DeltaHeader h;
+  fillHeader(&h, sysInfo);
+  strcpy(h.Checkpoint, c->Name);
+  h.Created = c->Created;
+  for (u_int32_t bit = 0; bit < bits; ++bit) {
+    if (isDirty(map, bit) && (bit == 0 || bit == tracked || !isDirty(map, bit - 1)))
+      ++h.Runs;
+  }
+  u_int32_t crc = 0, sectors = 0, clusters = 0;
+  writeDelta(fp, &h, sizeof(h), &crc);
+
+  for (u_int32_t bit = 0; bit < bits; ) {
+    if (!isDirty(map, bit)) {
+      ++bit;
+      continue;
+    }
+    u_int32_t end = bit < tracked ? tracked : bits;
+    u_int32_t last = bit + 1;
+    while (last < end && isDirty(map, last))
+      ++last;
+    DeltaRun run = { bit < tracked ? DELTA_SECTORS : DELTA_CLUSTERS, bit < tracked ? bit : bit - tracked + 2,
+                     last - bit };
+    writeDelta(fp, &run, sizeof(run), &crc);
+    if (run.Kind == DELTA_SECTORS) {
+      writeDelta(fp, (u_int8_t*)sysInfo + run.First * bps, run.Count * bps, &crc);
+      sectors += run.Count;
+    }
+    else {
+      for (u_int32_t P = run.First; P != run.First + run.Count; ++P)
+        writeDelta(fp, physicalAddr(P, data, sysInfo), size, &crc);
+      clusters += run.Count;
+    }
+    bit = last;
+  }
+  fwrite(&crc, sizeof(crc), 1, fp);
+  long written = ftell(fp);
+  if (fclose(fp) != 0) {
+    printf("backup-delta: %s: %s\n", file, strerror(errno));
+    return;
+  }
+  printf("backup-delta: %u sectors and %u clusters, %ld bytes\n", sectors, clusters, written);
+}
+
+/*
+ * Check that the runs of a delta of len bytes, the trailer excluded, stay
+ * inside the volume and add up to exactly len bytes.
+ */
+static int checkRuns(u_int8_t *buf, size_t len, BootSector *sysInfo) {
+  DeltaHeader *h = (DeltaHeader*)buf;
+  size_t at = sizeof(DeltaHeader);
+  for (u_int32_t i = 0; i < h->Runs; ++i) {
+    if (len - at < sizeof(DeltaRun))
+      return -1;
+    DeltaRun *run = (DeltaRun*)(buf + at);
+    at += sizeof(DeltaRun);
+    u_int64_t end = (u_int64_t)run->First + run->Count, bytes;
+    if (run->Kind == DELTA_SECTORS && run->First >= sysInfo->ReservedSectors && end <= trackedSectors(sysInfo))
+      bytes = (u_int64_t)run->Count * sysInfo->BytesPerSector;
+    else if (run->Kind == DELTA_CLUSTERS && run->First >= 2 && end <= sysInfo->ClusterCount + 2u)
+      bytes = (u_int64_t)run->Count * clusterSize(sysInfo);
+    else
+      return -1;
+    if (len - at < bytes)
+      return -1;
+    at += bytes;
+  }
+  return at == len ? 0 : -1;
+}
+
+/*
+ * "apply-delta <file>": Bring this volume, a copy of the one the delta was
+ * taken from as it was at the delta's checkpoint, up to date. The whole
+ * delta is read and checked before anything is written.
+ * Return 0 on success, -1 otherwise.
+ */
+int applyDelta(char *file, u_int8_t *data, BootSector *sysInfo) {
+  FILE *fp = fopen(file, "rb");
+  if (fp == NULL) {
+    printf("apply-delta: %s: %s\n", file, strerror(errno));
+    return -1;
+  }
+  fseek(fp, 0, SEEK_END);
+  long len = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  u_int8_t *buf = malloc(len > 0 ? len : 1);
+  size_t got = len > 0 ? fread(buf, 1, len, fp) : 0;
+  fclose(fp);
+
+  DeltaHeader expected;
+  fillHeader(&expected, sysInfo);
+  DeltaHeader *h = (DeltaHeader*)buf;
+  u_int32_t crc;
+  if (len < (long)(sizeof(DeltaHeader) + sizeof(crc)) || got != (size_t)len
+      || memcmp(h->Magic, DELTA_MAGIC, sizeof(h->Magic)) != 0) {
+    printf("apply-delta: %s is not a delta.\n", file);
+    free(buf);
+    return -1;
+  }
+  memcpy(&crc, buf + len - sizeof(crc), sizeof(crc));
+  if (crc32c(0, buf, len - sizeof(crc)) != crc || checkRuns(buf, len - sizeof(crc), sysInfo) != 0) {
+    printf("apply-delta: %s is damaged.\n", file);
+    free(buf);
+    return -1;
+  }
+  if (memcmp(h, &expected, offsetof(DeltaHeader, Checkpoint)) != 0) {
+    printf("apply-delta: %s was taken from another volume.\n", file);
+    free(buf);
+    return -1;
+  }
+
+  u_int32_t bps = sysInfo->BytesPerSector, size = clusterSize(sysInfo);
+  size_t at = sizeof(DeltaHeader);
+  for (u_int32_t i = 0; i < h->Runs; ++i) {
+    DeltaRun *run = (DeltaRun*)(buf + at);
+    at += sizeof(DeltaRun);
+    if (run->Kind == DELTA_SECTORS) {
+      u_int8_t *dest = (u_int8_t*)sysInfo + run->First * bps;
+      memcpy(dest, buf + at, run->Count * bps);
+      metadataModified(dest, run->Count * bps, sysInfo);
+      at += run->Count * bps;
+      continue;
+    }
+    for (u_int32_t P = run->First; P != run->First + run->Count; ++P, at += size) {
+      memcpy(physicalAddr(P, data, sysInfo), buf + at, size);
+      markDirtyCluster(P, sysInfo);
+    }
+  }
+  printf("apply-delta: applied the changes since checkpoint %s\n", h->Checkpoint);
+  free(buf);
+
+  FILE_t root;
+  rootEntry(&root, sysInfo);
+  dirIndexInit(fatEntries(sysInfo));
+  buildDedupIndex(&root, fatCopy(sysInfo, 0), data, sysInfo);
+  countClusters(fatCopy(sysInfo, 0), sysInfo);
+  sumDirectory(&root, 0, fatCopy(sysInfo, 0), data, sysInfo);
+  return 0;
+}
@@ -0,0 +1,76 @@
+#ifndef BACKUP_H
+#define BACKUP_H
+
+#include <sys/types.h>
+#include "structs.h"
+
+/*
+ * Incremental backups.
+ *
+ * A checkpoint names a point in the volume's history. From then on every
+ * write to the volume sets a bit in the checkpoint's dirty bitmap: one bit
+ * per sector in front of the checkpoint table (boot sector, FAT copies,
+ * checksums, reference counts, snapshots), then one per physical cluster.
+ * A delta holds the current contents of everything dirty, so it takes
+ * time and space in proportion to what changed, not to the volume.
+ * Applied to a copy of the volume taken at the checkpoint, it makes the
+ * copy identical to the volume again.
+ *
+ * The checkpoint table follows the snapshot table: MAX_CHECKPOINTS
+ * Checkpoint entries padded to a sector, then one bitmap per entry, each
+ * a whole number of sectors. Its own sectors are never tracked.
+ */
+#define MAX_CHECKPOINTS 4
+#define MAX_CHECKPOINT_NAME 15
+
+typedef struct Checkpoint {
+  char Name[MAX_CHECKPOINT_NAME + 1]; // empty if the slot is free
+  u_int32_t Created; // seconds since the epoch
+  u_int32_t Reserved;
+} Checkpoint;
+
+/*
+ * A delta file is a DeltaHeader, then Runs runs, each a DeltaRun followed
+ * by the contents of its Count sectors or clusters, then the CRC32C of
+ * everything before it.
+ */
+#define DELTA_MAGIC "SFDELTA1"
+#define DELTA_SECTORS  0
+#define DELTA_CLUSTERS 1
+
+typedef struct DeltaHeader {
+  u_int8_t Magic[8]; // DELTA_MAGIC
+  u_int32_t VolumeSerialNumber;
+  u_int32_t Sectors; // of the metadata image
+  u_int16_t BytesPerSector;
+  u_int16_t ClusterCount;
+  u_int16_t StripeImages;
+  u_int8_t SectorsPerCluster;
+  u_int8_t Reserved;
+  char Checkpoint[MAX_CHECKPOINT_NAME + 1]; // the delta starts from
+  u_int32_t Created; // of that checkpoint
+  u_int32_t Runs;
+} DeltaHeader;
+
+typedef struct DeltaRun {
+  u_int32_t Kind;  // DELTA_SECTORS or DELTA_CLUSTERS
+  u_int32_t First; // metadata sector, or physical cluster
+  u_int32_t Count;
+} DeltaRun;
+
+//Sectors in front of the checkpoint table, which the bitmaps track.
+u_int32_t trackedSectors(BootSector *sysInfo);
+u_int32_t checkpointTableSectors(BootSector *sysInfo, u_int32_t clusters);
+
+//Record that physical cluster P has been written.
+void markDirtyCluster(u_int16_t P, BootSector *sysInfo);
+//Record that len bytes of metadata at addr, in front of the checkpoint table, have been written.
+void metadataModified(void *addr, u_int32_t len, BootSector *sysInfo);
+
+void checkpointCreate(char *name, BootSector *sysInfo);
+void checkpointList(BootSector *sysInfo);
+void checkpointDelete(char *name, BootSector *sysInfo);
+void backupDelta(char *name, char *file, u_int8_t *data, BootSector *sysInfo);
+int applyDelta(char *file, u_int8_t *data, BootSector *sysInfo);
+
+#endif
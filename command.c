@@ -0,0 +1,939 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <pthread.h>
+#include "structs.h"
+#include "command.h"
+#include "crc32c.h"
+#include "dirindex.h"
+#include "snapshot.h"
+#include "walk.h"
+#include "handle.h"
+#include "backup.h"
+
+#define Kilo  1024
+#define Mega (Kilo*Kilo)
+#define MAX_FAT_SIZE (32 * Kilo)
+#define MAX_PATH_DEPTH 64
+#define STRIPE_CLUSTERS 8
+
+//The mapped volume: the metadata image, then its stripe images
+int images = 0;
+int fds[MAX_STRIPES];
+void *maps[MAX_STRIPES];
+size_t mapSizes[MAX_STRIPES];
+
+BootSector *sysInfo = NULL;
+u_int16_t *FAT = NULL;
+u_int8_t *data = NULL;
+//TODO: parse file name into two parts, and show as xxx.xxx
+FILE_t *working_dir = NULL;
+FILE_t *root_dir = NULL;
+FILE_t liveRoot; // stands for the root directory, which has no entry of its own
+//path[0] is the root directory and path[depth] the working directory
+FILE_t *path[MAX_PATH_DEPTH];
+int depth = 0;
+
+//A mounted snapshot replaces FAT, root_dir and the path until it is unmounted.
+SnapshotView mounted;
+FILE_t *livePath[MAX_PATH_DEPTH];
+int liveDepth = 0;
+
+/*
+ * Create stripe image index of the volume described by sysInfo in file.
+ * Returns 0 on success, -1 otherwise.
+ */
+static int initializeStripe(char *file, int index, BootSector *sysInfo) {
+  u_int32_t unit = sysInfo->StripeClusters * clusterSize(sysInfo);
+  u_int8_t *header = calloc(1, unit);
+  StripeHeader *h = (StripeHeader*)header;
+  memcpy(h->Magic, STRIPE_MAGIC, sizeof(h->Magic));
+  h->VolumeSerialNumber = sysInfo->VolumeSerialNumber;
+  h->Index = index;
+  h->Count = sysInfo->StripeImages;
+
+  int err = 0;
+  FILE *fp = fopen(file, "wb");
+  if (fp == NULL)
+    err = -1;
+  else {
+    if (fwrite(header, 1, unit, fp) != unit)
+      err = -1;
+    if (fclose(fp) != 0)
+      err = -1;
+    if (err == 0 && truncate(file, (off_t)(stripeUnits(index, sysInfo) + 1) * unit) != 0)
+      err = -1;
+  }
+  if (err != 0)
+    fprintf(stderr, "%s: %s\n", file, strerror(errno));
+  free(header);
+  return err;
+}
+
+//Remove the first count images of a volume that could not be created.
+static void removeImages(char **files, int count) {
+  for (int i = 0; i < count; ++i)
+    unlink(files[i]);
+}
+
+/*
+ * Create a volume of volumeSize bytes in files[0]. With stripes > 1 its
+ * data region is striped over that many images, files[0] being the first
+ * one, which then only holds the metadata and its share of the units.
+ * The stripe images are made first, so a volume that names them is only
+ * written once they all exist.
+ * Returns 0 on success, -1 otherwise, leaving none of the images behind.
+ */
+int initializeFileSystem(int volumeSize, char **files, int stripes) {
+  void *map = calloc(1, volumeSize);
+  BootSector *sysInfo = (BootSector*)map;
+  sysInfo->BytesPerSector = 512;
+  sysInfo->SectorsPerCluster = 1; //cluster size = 4KB
+  sysInfo->ReservedSectors = 1;
+  sysInfo->FATCopies = FAT_COPIES;
+  sysInfo->MaxRootEntries = 0; // the root is a cluster chain
+  sysInfo->RootCluster = 2;
+  sysInfo->TotalSectors = volumeSize / sysInfo->BytesPerSector;
+  sysInfo->SectorsPerFAT = MAX_FAT_SIZE / sysInfo->BytesPerSector;
+  sysInfo->SectorsPerRemap = sysInfo->SectorsPerFAT;
+  sysInfo->SectorsPerFill = sysInfo->SectorsPerFAT;
+  memcpy(sysInfo->FileSystemType, "FAT16", 6);
+  sysInfo->VolumeSerialNumber = (u_int32_t)time(NULL);
+  if (stripes > 1) {
+    sysInfo->StripeImages = stripes;
+    sysInfo->StripeClusters = STRIPE_CLUSTERS;
+  }
+
+  //one checksum and reference count per sector bound the tables for any cluster count
+  sizeTables(sysInfo, sysInfo->TotalSectors);
+  u_int8_t *data = dataRegion(sysInfo);
+  sysInfo->ClusterCount = ((u_int8_t*)map + volumeSize - data) / clusterSize(sysInfo);
+  //the first image only keeps its share of the units of a striped volume
+  int imageSize = volumeSize;
+  if (stripes > 1) {
+    sysInfo->TotalSectors = (data - (u_int8_t*)map) / sysInfo->BytesPerSector
+                            + stripeUnits(0, sysInfo) * sysInfo->StripeClusters * sysInfo->SectorsPerCluster;
+    imageSize = sysInfo->TotalSectors * sysInfo->BytesPerSector;
+  }
+
+  //initialize FAT
+  for (int i = 0; i < sysInfo->FATCopies; ++i)
+  {
+    u_int16_t *FAT = fatCopy(sysInfo, i);
+    FAT[0] = RESERVED_CLUSTER; // FAT[0] reserved
+    FAT[1] = RESERVED_CLUSTER; // FAT[1] reserved
+    FAT[DELETED_END_OF_FILE] = RESERVED_CLUSTER; // would read as a deleted end of chain
+  }
+
+  //initialize data region
+  for (u_int8_t *begin = data, *end = map + imageSize; begin != end; begin += FILE_ENTRY_SIZE) {
+    FILE_t *f = (FILE_t*)begin;
+    f->Filename[0] = DIRECTORY_NOT_USED;
+  }
+
+  //the root directory starts as a single cluster, like any new directory
+  for (int i = 0; i < sysInfo->FATCopies; ++i)
+  {
+    u_int16_t *FAT = fatCopy(sysInfo, i);
+    FAT[sysInfo->RootCluster] = END_OF_FILE;
+    remapTable(FAT, sysInfo)[sysInfo->RootCluster] = sysInfo->RootCluster;
+  }
+  refcountTable(sysInfo)[sysInfo->RootCluster - 2] = 1;
+  u_int8_t *root = physicalAddr(sysInfo->RootCluster, data, sysInfo);
+  memset(root, 0, RESERVED_DIRECTORY_REGION_SIZE);
+  strcpy(((SoftLink*)root)->Filename, ".");
+  strcpy(((SoftLink*)(root + FILE_ENTRY_SIZE))->Filename, "..");
+  physicalModified(sysInfo->RootCluster, data, sysInfo);
+  refreshFATChecksums(sysInfo);
+
+  for (int i = 1; i < stripes; ++i) {
+    if (initializeStripe(files[i], i, sysInfo) != 0) {
+      removeImages(files + 1, i);
+      free(map);
+      return -1;
+    }
+  }
+  int err = 0;
+  FILE *fp = fopen(files[0], "wb");
+  if (fp == NULL)
+    err = -1;
+  else {
+    if (fwrite(map, sizeof(u_int8_t), imageSize, fp) != (size_t)imageSize)
+      err = -1;
+    if (fclose(fp) != 0)
+      err = -1;
+  }
+  free(map);
+  if (err != 0) {
+    fprintf(stderr, "%s: %s\n", files[0], strerror(errno));
+    removeImages(files, stripes);
+  }
+  return err;
+}
+
+void verifyFileSystem(u_int8_t *map) {
+  scandisk(root_dir, FAT, data, sysInfo);
+}
+
+/*
+ * treeUsage() - Returns the usage of everything below dir. The running
+ * totals only follow the live volume, so a mounted snapshot is walked.
+ */
+void treeUsage(FILE_t *dir, u_int64_t *bytes, u_int32_t *clusters)
+{
+	if (mounted.FAT != NULL)
+	{
+		UsageInfo info;
+		fileUsage(dir, FAT, data, sysInfo, &info);
+		*bytes = info.logical;
+		*clusters = info.clusters;
+		return;
+	}
+	DirUsage *u = directoryUsage(dir->FirstClusterNo);
+	*bytes = u->bytes;
+	*clusters = u->clusters;
+}
+
+/*
+ * usage() - Prints cluster counts and the usage of the whole tree from the
+ * running totals. With dedupStats set, also walks the tree to count the
+ * physical clusters behind it.
+ */
+void usage(u_int8_t *map, u_int8_t *data, int dedupStats) {
+  printf("%lu bytes have been used by system\n", data - map);
+  const ClusterCounts *counts = clusterCounts();
+  printf("%u clusters in use, %u held by deleted files, %u free\n",
+         counts->used, counts->deleted, sysInfo->ClusterCount - counts->physical - counts->reserved);
+  u_int64_t bytes;
+  u_int32_t clusters;
+  treeUsage(root_dir, &bytes, &clusters);
+  printf("%lu bytes of file data in %u bytes of allocated clusters\n", bytes, clusters * clusterSize(sysInfo));
+  if (!dedupStats)
+    return;
+  UsageInfo info;
+  fileUsage(root_dir, FAT, data, sysInfo, &info);
+  printf("%lu bytes of file data stored in %u bytes on disk\n", info.logical, info.physical * clusterSize(sysInfo));
+  printf("dedup ratio %.2f (%u clusters in %u physical clusters)\n",
+         info.physical ? (double)info.clusters / info.physical : 1.0, info.clusters, info.physical);
+}
+
+void duVisit(FILE_t *f, WalkTask *task, void *ctx)
+{
+	task->sums[1] += allocatedSize(f, FAT, sysInfo) / clusterSize(sysInfo);
+	if (!(f->Attr & ATTR_DIRECTORY))
+		task->sums[0] += f->FileSize;
+}
+
+void duLeave(WalkTask *task, void *ctx)
+{
+	printf("%10lu %10lu %s\n", task->sums[0], task->sums[1] * clusterSize(sysInfo), task->path);
+	if (task->parent != NULL)
+	{
+		task->parent->sums[0] += task->sums[0];
+		task->parent->sums[1] += task->sums[1];
+	}
+}
+
+/*
+ * du() - "du [-r] [dir]": Prints the usage of dir, or of the working
+ * directory. With -r, walks it and prints the usage of every directory
+ * below it first, each after the directories below it.
+ */
+void du(char *name)
+{
+	int recursive = !strncmp(name, "-r", 2) && (name[2] == '\0' || name[2] == ' ');
+	if (recursive)
+		name += name[2] ? 3 : 2;
+	FILE_t *dir = working_dir;
+	if (*name != '\0' && strcmp(name, "."))
+	{
+		dir = searchFile(working_dir, FAT, data, sysInfo, name);
+		if (dir->Filename[0] == DIRECTORY_NOT_USED || dir->Attr & ATTR_DELETED || !(dir->Attr & ATTR_DIRECTORY))
+		{
+			printf("du: %s is not a directory\n", name);
+			return;
+		}
+	}
+	if (recursive)
+	{
+		TreeWalk walk = { FAT, data, sysInfo, NULL, duVisit, duLeave, NULL };
+		printf("%10s %10s %s\n", "bytes", "allocated", "directory");
+		treeWalk(dir, *name ? name : ".", &walk);
+		return;
+	}
+	u_int64_t bytes;
+	u_int32_t clusters;
+	treeUsage(dir, &bytes, &clusters);
+	printf("%lu bytes of file data in %u bytes of allocated clusters\n", bytes, clusters * clusterSize(sysInfo));
+}
+
+/*
+ * isMutating() - Returns 1 if a command changes the volume.
+ */
+int isMutating(char *command)
+{
+	const char *mutating[] = { "mkdir ", "write ", "writeat ", "truncate ", "remove ", "compress ",
+	                           "uncompress ", "append ", "rmdir ", "rm ", "dedup", "undelete " };
+	for (size_t i = 0; i < sizeof(mutating) / sizeof(mutating[0]); ++i)
+	{
+		if (!strncmp(command, mutating[i], strlen(mutating[i])))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * keepsAppends() - Returns 1 if a command may run while appends are still
+ * buffered, because it neither looks at nor changes any file.
+ */
+int keepsAppends(char *command)
+{
+	return !strncmp(command, "append ", 7) || !strcmp(command, "pwd") || !strncmp(command, "cd ", 3);
+}
+
+/*
+ * isHandleCommand() - Returns 1 if a command works on open file handles,
+ * which only the live volume has.
+ */
+int isHandleCommand(char *command)
+{
+	const char *handleCommands[] = { "open ", "read ", "fdwrite ", "seek " };
+	for (size_t i = 0; i < sizeof(handleCommands) / sizeof(handleCommands[0]); ++i)
+	{
+		if (!strncmp(command, handleCommands[i], strlen(handleCommands[i])))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * snapshotCommand() - Runs "snapshot create|list|delete|rollback|mount|unmount".
+ * Snapshots always operate on the live volume, even while one is mounted.
+ */
+void snapshotCommand(char *args)
+{
+	char *name = strchr(args, ' ');
+	if (name != NULL)
+		*name++ = '\0';
+	else
+		name = "";
+
+	if (!strcmp(args, "create"))
+	{
+		snapshotCreate(name, sysInfo);
+	}
+	else if (!strcmp(args, "list"))
+	{
+		snapshotList(sysInfo);
+	}
+	else if (!strcmp(args, "delete") || !strcmp(args, "rollback"))
+	{
+		if (mounted.FAT != NULL)
+		{
+			printf("snapshot: a snapshot is mounted, unmount it first\n");
+		}
+		else if (!strcmp(args, "delete"))
+		{
+			snapshotDelete(name, sysInfo);
+		}
+		else if (snapshotRollback(name, sysInfo) == 0)
+		{
+			working_dir = path[0] = root_dir;
+			depth = 0;
+			handlesChanged(FAT, data, sysInfo);
+		}
+	}
+	else if (!strcmp(args, "mount"))
+	{
+		if (mounted.FAT != NULL)
+		{
+			printf("snapshot: a snapshot is already mounted\n");
+		}
+		else if (snapshotMount(name, sysInfo, &mounted) == 0)
+		{
+			memcpy(livePath, path, sizeof(path));
+			liveDepth = depth;
+			FAT = mounted.FAT;
+			working_dir = root_dir = path[0] = &mounted.root;
+			depth = 0;
+		}
+	}
+	else if (!strcmp(args, "unmount"))
+	{
+		if (mounted.FAT == NULL)
+			return;
+		snapshotUnmount(&mounted);
+		FAT = fatCopy(sysInfo, 0);
+		root_dir = &liveRoot;
+		memcpy(path, livePath, sizeof(path));
+		depth = liveDepth;
+		working_dir = path[depth];
+	}
+	else
+	{
+		printf("snapshot: unknown command %s\n", args);
+	}
+}
+
+/*
+ * checkpointCommand() - Runs "checkpoint create|list|delete".
+ */
+void checkpointCommand(char *args)
+{
+	char *name = strchr(args, ' ');
+	if (name != NULL)
+		*name++ = '\0';
+	else
+		name = "";
+
+	if (!strcmp(args, "create"))
+		checkpointCreate(name, sysInfo);
+	else if (!strcmp(args, "list"))
+		checkpointList(sysInfo);
+	else if (!strcmp(args, "delete"))
+		checkpointDelete(name, sysInfo);
+	else
+		printf("checkpoint: unknown command %s\n", args);
+}
+
+/*
+ * mapStripes() - maps the stripe images of the volume
+ * Returns 0 on success, -1 if one is missing or belongs to another volume.
+ */
+int mapStripes(char **files)
+{
+  u_int8_t *stripeData[MAX_STRIPES];
+  u_int32_t unit = sysInfo->StripeClusters * clusterSize(sysInfo);
+  for (images = 1; images < sysInfo->StripeImages; ++images)
+  {
+    char *file = files[images];
+    fds[images] = open(file, O_RDWR, (mode_t)0600);
+    if (fds[images] < 0)
+    {
+      fprintf(stderr, "%s: %s\n", file, strerror(errno));
+      return -1;
+    }
+    mapSizes[images] = (size_t)(stripeUnits(images, sysInfo) + 1) * unit;
+    maps[images] = mmap(0, mapSizes[images], PROT_READ | PROT_WRITE, MAP_SHARED, fds[images], 0);
+    if (maps[images] == MAP_FAILED || lseek(fds[images], 0, SEEK_END) < (off_t)mapSizes[images])
+    {
+      if (maps[images] != MAP_FAILED)
+        munmap(maps[images], mapSizes[images]);
+      close(fds[images]);
+      fprintf(stderr, "%s: not a stripe image of this volume\n", file);
+      return -1;
+    }
+    StripeHeader *h = (StripeHeader*)maps[images];
+    if (memcmp(h->Magic, STRIPE_MAGIC, sizeof(h->Magic)) != 0
+        || h->VolumeSerialNumber != sysInfo->VolumeSerialNumber
+        || h->Index != images || h->Count != sysInfo->StripeImages)
+    {
+      munmap(maps[images], mapSizes[images]);
+      close(fds[images]);
+      fprintf(stderr, "%s: not stripe image %d of this volume\n", file, images);
+      return -1;
+    }
+    stripeData[images] = (u_int8_t*)maps[images] + unit;
+  }
+  setStripes(stripeData, images);
+  return 0;
+}
+
+/*
+ * openVolume() - maps files as the volume, creating it if it does not
+ * exist. A volume created from several files is striped over them.
+ * Returns 0 on success, -1 otherwise.
+ */
+int openVolume(char **files, int count)
+{
+  FILE *fp;
+  crc32cInit();
+  if (count > MAX_STRIPES)
+  {
+    fprintf(stderr, "At most %d images can be striped.\n", MAX_STRIPES);
+    return -1;
+  }
+  fp = fopen(files[0],"rb");  // w for write, b for binary
+  if (fp == NULL) {
+    if (initializeFileSystem(4*Mega, files, count) != 0)
+      return -1;
+  }
+  else {
+    fclose(fp);
+  }
+
+  fds[0] = open(files[0], O_RDWR, (mode_t)0600);
+  BootSector boot;
+  if (fds[0] < 0 || read(fds[0], &boot, sizeof(boot)) != sizeof(boot))
+  {
+    fprintf(stderr, "%s: not a volume image\n", files[0]);
+    if (fds[0] >= 0)
+      close(fds[0]);
+    return -1;
+  }
+  if (memcmp(&boot, STRIPE_MAGIC, strlen(STRIPE_MAGIC)) == 0)
+  {
+    fprintf(stderr, "%s: a stripe image, not the first image of a volume\n", files[0]);
+    close(fds[0]);
+    return -1;
+  }
+  // the tables are only looked at once they are known to lie in the image
+  if (memcmp(boot.FileSystemType, "FAT16", 6) != 0 || checkGeometry(&boot) != 0)
+  {
+    fprintf(stderr, "%s: not a volume image\n", files[0]);
+    close(fds[0]);
+    return -1;
+  }
+  mapSizes[0] = (size_t)volumeSectors(&boot) * boot.BytesPerSector;
+  if (lseek(fds[0], 0, SEEK_END) < (off_t)mapSizes[0])
+  {
+    fprintf(stderr, "%s: image is shorter than its volume\n", files[0]);
+    close(fds[0]);
+    return -1;
+  }
+  maps[0] = mmap(0, mapSizes[0], PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+  if (maps[0] == MAP_FAILED)
+  {
+    fprintf(stderr, "%s: %s\n", files[0], strerror(errno));
+    close(fds[0]);
+    return -1;
+  }
+  images = 1;
+  sysInfo = (BootSector*)maps[0];
+  int stripes = sysInfo->StripeImages > 1 ? sysInfo->StripeImages : 1;
+  if (count != stripes)
+  {
+    fprintf(stderr, "%s: the volume is striped over %d images, %d given\n", files[0], stripes, count);
+    closeVolume();
+    return -1;
+  }
+  if (stripes > 1 && mapStripes(files) != 0)
+  {
+    closeVolume();
+    return -1;
+  }
+
+  FAT = fatCopy(sysInfo, 0);
+  rootEntry(&liveRoot, sysInfo);
+  root_dir = &liveRoot;
+  data = dataRegion(sysInfo);
+  working_dir = path[0] = root_dir;
+  dirIndexInit(fatEntries(sysInfo));
+  buildDedupIndex(root_dir, FAT, data, sysInfo);
+  countClusters(FAT, sysInfo);
+  sumDirectory(root_dir, 0, FAT, data, sysInfo);
+  /*
+   * Useful calculations
+   *
+   * // N : cluster number or sector number ( if sysInfo->SectorsPerCluster == 1)
+   * FirstSectorOfCluster = DataStartSector + (N - 2) * sysInfo->SectorsPerCluster;
+   *
+   * FATEntryOfNSector = FAT + (N-2);
+   *
+   *
+   *
+   */
+  return 0;
+}
+
+void* syncImage(void *arg)
+{
+	long i = (long)arg;
+	msync(maps[i], mapSizes[i], MS_SYNC);
+	return NULL;
+}
+
+/*
+ * closeVolume() - unmaps the volume, writing its images back to their
+ * files in parallel
+ */
+void closeVolume(void)
+{
+	if (mounted.FAT != NULL)
+		snapshotUnmount(&mounted);
+	flushAppends(fatCopy(sysInfo, 0), data, sysInfo);
+	closeAllHandles();
+	pthread_t tids[MAX_STRIPES];
+	for (long i = 1; i < images; ++i)
+		pthread_create(&tids[i], NULL, syncImage, (void*)i);
+	syncImage((void*)0);
+	for (long i = 1; i < images; ++i)
+		pthread_join(tids[i], NULL);
+	for (int i = 0; i < images; ++i)
+	{
+		munmap(maps[i], mapSizes[i]);
+		close(fds[i]);
+	}
+	images = 0;
+}
+
+/*
+ * dispatch() - runs one command line, which may be modified
+ * Returns 1 if the command was "quit", 0 otherwise.
+ */
+int dispatch(char *buffer)
+{
+	if(!strcmp(buffer, "quit"))
+	{
+		return 1;
+	}
+	else if(isMutating(buffer) && mounted.FAT != NULL)
+	{
+		printf("%s: a snapshot is mounted read-only, unmount it first\n", buffer);
+	}
+	else if(isMutating(buffer) && privatizeDirectory(working_dir, 0, FAT, data, sysInfo) != 0)
+	{
+		printf("%s: no space left on device\n", buffer);
+	}
+	else if(isHandleCommand(buffer) && mounted.FAT != NULL)
+	{
+		printf("%s: handles are for the live volume, unmount the snapshot first\n", buffer);
+	}
+	else if(!strncmp(buffer, "snapshot ", 9))
+	{
+		snapshotCommand(buffer + 9);
+	}
+	else if(!strncmp(buffer, "checkpoint ", 11))
+	{
+		checkpointCommand(buffer + 11);
+	}
+	else if(!strncmp(buffer, "backup-delta ", 13))
+	{
+		char *file = strchr(buffer + 13, ' ');
+		if (file == NULL)
+		{
+			printf("backup-delta: usage: backup-delta <checkpoint> <file>\n");
+		}
+		else
+		{
+			*file++ = '\0';
+			backupDelta(buffer + 13, file, data, sysInfo);
+		}
+	}
+	else if(!strncmp(buffer, "apply-delta ", 12))
+	{
+		if (mounted.FAT != NULL)
+		{
+			printf("apply-delta: a snapshot is mounted, unmount it first\n");
+		}
+		else if (applyDelta(buffer + 12, data, sysInfo) == 0)
+		{
+			working_dir = path[0] = root_dir;
+			depth = 0;
+			handlesChanged(FAT, data, sysInfo);
+		}
+	}
+	else if(!strncmp(buffer, "dump ", 5))
+	{
+		if(isdigit(buffer[5]))
+		{
+			dump(atoi(buffer + 5), FAT, data, sysInfo);
+		}
+		else
+		{
+			char *filename = buffer + 5;
+			char *space = strstr(buffer+5, " ");
+			*space = '\0';
+			//open and validate filename
+			dumpBinary(atoi(space + 1), filename, FAT, data, sysInfo);
+		}
+	}
+	else if(!strcmp(buffer, "du") || !strncmp(buffer, "du ", 3))
+	{
+		du(buffer + (buffer[2] ? 3 : 2));
+	}
+	else if(!strncmp(buffer, "usage", 5))
+	{
+		usage(maps[0], data, !strcmp(buffer + 5, " -d"));
+	}
+	else if(!strncmp(buffer, "pwd", 3))
+	{
+          pwd(path, depth);
+          printf("\n");
+	}
+	else if(!strncmp(buffer, "cd ", 3))
+	{
+          if (!strcmp(buffer+3, ".."))
+          {
+            if (depth > 0)
+              working_dir = path[--depth];
+          }
+          else
+          {
+            FILE_t *dir = cd(working_dir, FAT, data, sysInfo, buffer+3);
+            if (dir != NULL && dir != working_dir)
+            {
+              if (depth + 1 < MAX_PATH_DEPTH)
+                working_dir = path[++depth] = dir;
+              else
+                printf("cd: %s: path too deep\n", buffer+3);
+            }
+          }
+	}
+	else if(!strncmp(buffer, "ls -l", 5))
+	{
+          ls(working_dir, 1, FAT, data, sysInfo);
+	}
+	else if(!strncmp(buffer, "ls", 2))
+	{
+          ls(working_dir, 0, FAT, data, sysInfo);
+          printf("\n");
+	}
+	else if(!strncmp(buffer, "mkdir ", 6))
+	{
+          createFile(working_dir, FAT, data, sysInfo, buffer + 6, 1);
+	}
+	else if(!strncmp(buffer, "cat ", 4))
+	{
+		cat(buffer + 4, working_dir, FAT, data, sysInfo);
+	}
+	else if(!strncmp(buffer, "write ", 6))
+	{
+		char *filename = buffer + 6;
+		char *space = strstr(buffer+6, " ");
+		*space = '\0';
+		size_t amt = atoi(space + 1);
+		space = strstr(space+1, " ");
+
+		//char *data = generateData(space+1, amt<<1);
+		writeFile(filename, amt, space+1, working_dir, FAT, data, sysInfo);
+		//free(data);
+	}
+	else if(!strncmp(buffer, "writeat ", 8))
+	{
+		char *filename = buffer + 8;
+		char *space = strstr(buffer+8, " ");
+		*space = '\0';
+		size_t offset = atoi(space + 1);
+		space = strstr(space+1, " ");
+		size_t amt = atoi(space + 1);
+		space = strstr(space+1, " ");
+
+		writeAt(filename, offset, amt, space+1, working_dir, FAT, data, sysInfo);
+	}
+	else if(!strncmp(buffer, "truncate ", 9))
+	{
+		char *filename = buffer + 9;
+		char *space = strstr(buffer+9, " ");
+		*space = '\0';
+		truncateFile(filename, atoi(space + 1), working_dir, FAT, data, sysInfo);
+	}
+	else if(!strncmp(buffer, "remove ", 7)){
+		char *filename = buffer+7;
+		char *space = strstr(buffer+7, " ");
+		*space = '\0';
+		int start = atoi(space+1);
+		space = strstr(space+1, " ");
+		int end = atoi(space+1);
+
+		removeRange(filename, start, end, working_dir, FAT, data, sysInfo);
+	}
+	else if(!strncmp(buffer, "compress ", 9))
+	{
+		compressFile(buffer + 9, 1, working_dir, FAT, data, sysInfo);
+	}
+	else if(!strncmp(buffer, "uncompress ", 11))
+	{
+		compressFile(buffer + 11, 0, working_dir, FAT, data, sysInfo);
+	}
+	else if(!strncmp(buffer, "append ", 7))
+	{
+		char *filename = buffer + 7;
+		char *space = strstr(buffer+7, " ");
+		*space = '\0';
+		size_t amt = atoi(space + 1);
+		space = strstr(space+1, " ");
+
+		//char *data = generateData(space+1, amt<<1);
+		bufferAppend(filename, amt, space+1, working_dir, FAT, data, sysInfo);
+		//free(data);
+	}
+	else if(!strncmp(buffer, "getpages ", 9))
+	{
+            FILE_t *f = searchFile(working_dir, FAT, data, sysInfo, buffer+9);
+            if (f->Filename[0] == DIRECTORY_NOT_USED || f->Attr & ATTR_DELETED)
+              printf("%s: No such file\n", buffer+9);
+            else
+              getPages(f, FAT, data, sysInfo);
+	}
+	else if(!strncmp(buffer, "find ", 5))
+	{
+		char *dirname = buffer + 5;
+		char *space = strstr(dirname, " ");
+		if (space == NULL)
+		{
+			printf("find: usage: find <dir> <pattern>\n");
+			return 0;
+		}
+		*space = '\0';
+		FILE_t *dir = working_dir;
+		if (strcmp(dirname, "."))
+		{
+			dir = searchFile(working_dir, FAT, data, sysInfo, dirname);
+			if (dir->Filename[0] == DIRECTORY_NOT_USED || dir->Attr & ATTR_DELETED || !(dir->Attr & ATTR_DIRECTORY))
+			{
+				printf("find: %s is not a directory\n", dirname);
+				return 0;
+			}
+		}
+		find(dir, dirname, space + 1, FAT, data, sysInfo);
+	}
+	else if(!strncmp(buffer, "get ", 4))
+	{
+		char *filename = buffer + 4;
+		char *space = strstr(buffer+4, " ");
+		*space = '\0';
+		size_t start = atoi(space + 1);
+		space = strstr(space+1, " ");
+		size_t end = atoi(space + 1);
+		get(filename, start, end, working_dir, FAT, data, sysInfo);
+	}
+	else if(!strncmp(buffer, "rmdir ", 6))
+	{
+		rm_dir(working_dir, FAT, data, sysInfo, buffer+6);
+	}
+	else if(!strncmp(buffer, "rm -rf ", 7))
+	{
+            FILE_t *dir = searchFile(working_dir, FAT, data, sysInfo, buffer+7);
+            if (dir->Filename[0] == DIRECTORY_NOT_USED || dir->Attr & ATTR_DELETED)
+              printf("%s: No such file or directory\n", buffer+7);
+            else if ((dir->Attr & ATTR_DIRECTORY) && privatizeDirectory(dir, 1, FAT, data, sysInfo) != 0)
+              printf("rm: no space left on device\n");
+            else
+		  rm_rf(dir, FAT, data, sysInfo);
+	}
+	else if(!strncmp(buffer, "rm ", 3))
+	{
+		rm(buffer + 3, working_dir, FAT, data, sysInfo);
+
+	}
+	else if(!strncmp(buffer, "dedup", 5))
+	{
+		dedup(root_dir, FAT, data, sysInfo);
+	}
+	else if(!strncmp(buffer, "scrub", 5))
+	{
+		scrub(fatCopy(sysInfo, 0), data, sysInfo);
+	}
+	else if(!strncmp(buffer, "scandisk", 8))
+	{
+		scandisk(root_dir, FAT, data, sysInfo);
+	}
+	else if(!strncmp(buffer, "undelete ", 9))
+	{
+          undeleteFile(working_dir, FAT, data, sysInfo, buffer+9);
+	}
+	else if(!strncmp(buffer, "open ", 5))
+	{
+		openHandle(buffer + 5, working_dir, FAT, data, sysInfo);
+	}
+	else if(!strncmp(buffer, "read ", 5))
+	{
+		char *space = strstr(buffer+5, " ");
+		if (space == NULL)
+		{
+			printf("read: usage: read <fd> <amt>\n");
+			return 0;
+		}
+		readHandle(atoi(buffer + 5), atoi(space + 1), FAT, data, sysInfo);
+	}
+	else if(!strncmp(buffer, "fdwrite ", 8))
+	{
+		char *amt = strstr(buffer+8, " ");
+		char *space = amt != NULL ? strstr(amt+1, " ") : NULL;
+		if (space == NULL)
+		{
+			printf("fdwrite: usage: fdwrite <fd> <amt> <data>\n");
+			return 0;
+		}
+		writeHandle(atoi(buffer + 8), atoi(amt + 1), space+1, FAT, data, sysInfo);
+	}
+	else if(!strncmp(buffer, "seek ", 5))
+	{
+		char *space = strstr(buffer+5, " ");
+		if (space == NULL)
+		{
+			printf("seek: usage: seek <fd> <offset>|end\n");
+			return 0;
+		}
+		seekHandle(atoi(buffer + 5), space + 1, FAT, data, sysInfo);
+	}
+	else if(!strncmp(buffer, "close ", 6))
+	{
+		closeHandle(atoi(buffer + 6));
+	}
+	return 0;
+}
+
+/*
+ * commandTarget() - Copies the name of the entry a mutating command works
+ * on into name, or an empty string if it names none.
+ */
+void commandTarget(char *command, char *name, size_t size)
+{
+	char *begin = strchr(command, ' ');
+	name[0] = '\0';
+	if (begin == NULL)
+		return;
+	++begin;
+	if (!strncmp(begin, "-rf ", 4))
+		begin += 4;
+	size_t len = strcspn(begin, " ");
+	if (len >= size)
+		len = size - 1;
+	memcpy(name, begin, len);
+	name[len] = '\0';
+}
+
+/*
+ * runCommand() - runs one command line, which may be modified
+ * A mutating command changes at most the entry it names and the clusters
+ * of the working directory, so the running directory totals are updated
+ * from their usage before and after it. Appends are buffered and account
+ * for themselves once placed, which happens before any command that could
+ * see them.
+ * Returns 1 if the command was "quit", 0 otherwise.
+ */
+int runCommand(char *buffer)
+{
+	flushExpiredAppends(FAT, data, sysInfo);
+	if (!keepsAppends(buffer))
+		flushAppends(FAT, data, sysInfo);
+	if (!isMutating(buffer) || mounted.FAT != NULL || !strncmp(buffer, "append ", 7))
+		return dispatch(buffer);
+
+	char name[MAX_LEN_OF_LFN + 1];
+	commandTarget(buffer, name, sizeof(name));
+	u_int16_t dir = working_dir->FirstClusterNo;
+	u_int32_t ownBefore = chainLength(dir, FAT);
+	u_int64_t bytesBefore = 0, bytesAfter;
+	u_int32_t clustersBefore = 0, clustersAfter;
+	int wasLive = 0;
+	if (name[0] != '\0')
+	{
+		FILE_t *f = searchFile(working_dir, FAT, data, sysInfo, name);
+		wasLive = f->Filename[0] != DIRECTORY_NOT_USED && !(f->Attr & ATTR_DELETED);
+		entryUsage(f, FAT, sysInfo, &bytesBefore, &clustersBefore);
+	}
+
+	int result = dispatch(buffer);
+	handlesChanged(FAT, data, sysInfo);
+
+	if (name[0] != '\0')
+	{
+		FILE_t *f = searchFile(working_dir, FAT, data, sysInfo, name);
+		if (!wasLive && f->Filename[0] != DIRECTORY_NOT_USED && !(f->Attr & ATTR_DELETED)
+		    && f->Attr & ATTR_DIRECTORY)
+			sumDirectory(f, dir, FAT, data, sysInfo);
+		entryUsage(f, FAT, sysInfo, &bytesAfter, &clustersAfter);
+		addDirUsage(dir, (int64_t)bytesAfter - bytesBefore, (int64_t)clustersAfter - clustersBefore);
+	}
+	addDirUsage(directoryUsage(dir)->parent, 0, (int64_t)chainLength(dir, FAT) - ownBefore);
+	return result;
+}
@@ -0,0 +1,21 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+/*
+ * The volume commands run against and the command dispatcher, shared by
+ * the interactive filesystem loop and simplefat_replay.
+ */
+
+//Map files as the volume, creating it if it does not exist. A volume made
+//of several files is striped over them; files[0] holds its metadata.
+//Return 0 on success, -1 otherwise.
+int openVolume(char **files, int count);
+
+//Unmap the volume, writing it back to its files.
+void closeVolume(void);
+
+//Run one command line. buffer is modified.
+//Return 1 if the command was "quit", 0 otherwise.
+int runCommand(char *buffer);
+
+#endif
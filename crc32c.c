@@ -0,0 +1,95 @@
+#include <string.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_INSN 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78
+
+static u_int32_t table[8][256];
+static int useHardware = 0;
+
+static u_int32_t crc32cSoftware(u_int32_t crc, const u_int8_t *p, size_t len)
+{
+  while (len && ((size_t)p & 7)) {
+    crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    --len;
+  }
+  while (len >= 8) {
+    u_int64_t word;
+    memcpy(&word, p, 8);
+    word ^= crc;
+    crc = table[7][word & 0xFF] ^ table[6][(word >> 8) & 0xFF]
+        ^ table[5][(word >> 16) & 0xFF] ^ table[4][(word >> 24) & 0xFF]
+        ^ table[3][(word >> 32) & 0xFF] ^ table[2][(word >> 40) & 0xFF]
+        ^ table[1][(word >> 48) & 0xFF] ^ table[0][word >> 56];
+    p += 8;
+    len -= 8;
+  }
+  while (len--)
+    crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return crc;
+}
+
+#ifdef HAVE_CRC32C_INSN
+__attribute__((target("sse4.2")))
+static u_int32_t crc32cHardware(u_int32_t crc, const u_int8_t *p, size_t len)
+{
+  while (len && ((size_t)p & 7)) {
+    crc = _mm_crc32_u8(crc, *p++);
+    --len;
+  }
+#ifdef __x86_64__
+  while (len >= 8) {
+    u_int64_t word;
+    memcpy(&word, p, 8);
+    crc = (u_int32_t)_mm_crc32_u64(crc, word);
+    p += 8;
+    len -= 8;
+  }
+#endif
+  while (len >= 4) {
+    u_int32_t word;
+    memcpy(&word, p, 4);
+    crc = _mm_crc32_u32(crc, word);
+    p += 4;
+    len -= 4;
+  }
+  while (len--)
+    crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+#endif
+
+void crc32cInit(void)
+{
+  for (u_int32_t i = 0; i < 256; ++i) {
+    u_int32_t crc = i;
+    for (int k = 0; k < 8; ++k)
+      crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    table[0][i] = crc;
+  }
+  for (u_int32_t i = 0; i < 256; ++i)
+    for (int k = 1; k < 8; ++k)
+      table[k][i] = table[0][table[k - 1][i] & 0xFF] ^ (table[k - 1][i] >> 8);
+#ifdef HAVE_CRC32C_INSN
+  __builtin_cpu_init();
+  useHardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+/*
+ * crc32c() - Continues a CRC32C over len bytes of buf. Pass 0 to start a
+ * new checksum.
+ */
+u_int32_t crc32c(u_int32_t crc, const void *buf, size_t len)
+{
+  crc = ~crc;
+#ifdef HAVE_CRC32C_INSN
+  if (useHardware)
+    return ~crc32cHardware(crc, (const u_int8_t*)buf, len);
+#endif
+  return ~crc32cSoftware(crc, (const u_int8_t*)buf, len);
+}
@@ -0,0 +1,18 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * CRC32C (Castagnoli) used for cluster and FAT checksums.
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU has it and falls back to a
+ * slicing-by-8 table otherwise. Call crc32cInit() once before any thread
+ * computes a checksum.
+ */
+
+void crc32cInit(void);
+u_int32_t crc32c(u_int32_t crc, const void *buf, size_t len);
+
+#endif
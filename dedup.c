@@ -0,0 +1,53 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dedup.h"
+
+#define BUCKET_BITS 12
+
+static u_int16_t bucket[1 << BUCKET_BITS]; // first physical cluster per bucket
+static u_int16_t *next = NULL;             // next physical cluster in the bucket
+static u_int32_t *fingerprint = NULL;
+static u_int8_t *indexed = NULL;
+
+void dedupInit(u_int32_t clusters)
+{
+  free(next);
+  free(fingerprint);
+  free(indexed);
+  memset(bucket, 0, sizeof(bucket));
+  next = calloc(clusters + 2, sizeof(u_int16_t));
+  fingerprint = calloc(clusters + 2, sizeof(u_int32_t));
+  indexed = calloc(clusters + 2, sizeof(u_int8_t));
+}
+
+void dedupInsert(u_int16_t p, u_int32_t crc)
+{
+  if (indexed[p])
+    dedupRemove(p);
+  u_int16_t *head = &bucket[crc & ((1 << BUCKET_BITS) - 1)];
+  next[p] = *head;
+  *head = p;
+  fingerprint[p] = crc;
+  indexed[p] = 1;
+}
+
+void dedupRemove(u_int16_t p)
+{
+  if (!indexed[p])
+    return;
+  u_int16_t *link = &bucket[fingerprint[p] & ((1 << BUCKET_BITS) - 1)];
+  while (*link != p)
+    link = &next[*link];
+  *link = next[p];
+  indexed[p] = 0;
+}
+
+u_int16_t dedupFind(u_int32_t crc, const u_int8_t *buf, u_int32_t size, u_int16_t exclude,
+                    u_int8_t *data, BootSector *sysInfo)
+{
+  for (u_int16_t p = bucket[crc & ((1 << BUCKET_BITS) - 1)]; p != 0; p = next[p]) {
+    if (p != exclude && fingerprint[p] == crc && memcmp(physicalAddr(p, data, sysInfo), buf, size) == 0)
+      return p;
+  }
+  return 0;
+}
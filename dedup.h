@@ -0,0 +1,23 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <sys/types.h>
+#include "structs.h"
+
+/*
+ * In-memory fingerprint index over the physical clusters holding file data.
+ * The fingerprint of a cluster is its CRC32C from the checksum table; a hit
+ * is confirmed with a byte comparison before a cluster is shared.
+ * The index is rebuilt from the checksum table every time a volume is mounted.
+ */
+
+void dedupInit(u_int32_t clusters);
+void dedupInsert(u_int16_t p, u_int32_t crc);
+void dedupRemove(u_int16_t p);
+
+//Return a physical cluster other than exclude holding exactly the size bytes
+//at buf, or 0 if there is none.
+u_int16_t dedupFind(u_int32_t crc, const u_int8_t *buf, u_int32_t size, u_int16_t exclude,
+                    u_int8_t *data, BootSector *sysInfo);
+
+#endif
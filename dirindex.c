@@ -0,0 +1,178 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dirindex.h"
+
+typedef struct DirPosition {
+  u_int16_t node; // of the directory cluster holding the entry
+  u_int16_t slot; // of the entry in that cluster
+  u_int32_t hash;
+  u_int32_t next; // 1 + the next position in the bucket, 0 if there is none
+} DirPosition;
+
+typedef struct DirIndex {
+  DirPosition *positions; // in the order of the entries in the chain
+  u_int32_t count, size;
+  u_int32_t *bucket; // 1 + the last position added to the bucket, 0 if it is empty
+  u_int32_t buckets; // a power of two
+  u_int16_t endNode; // holding the first free entry, 0 if every cluster is in use
+  u_int16_t endSlot;
+  u_int16_t last;    // last node of the chain
+} DirIndex;
+
+static DirIndex **dirs = NULL; // indexed by the first cluster of a directory
+static u_int32_t dirSlots = 0;
+
+void dirIndexInit(u_int32_t nodes)
+{
+  for (u_int32_t i = 0; i < dirSlots; ++i)
+    dirIndexForget(i);
+  free(dirs);
+  dirs = calloc(nodes, sizeof(DirIndex*));
+  dirSlots = nodes;
+}
+
+void dirIndexForget(u_int16_t first)
+{
+  if (first >= dirSlots || dirs[first] == NULL)
+    return;
+  free(dirs[first]->positions);
+  free(dirs[first]->bucket);
+  free(dirs[first]);
+  dirs[first] = NULL;
+}
+
+//Hash of a name as strcmp compares it, cut at the length of a short name,
+//since a short entry's Filename need not end in a NUL.
+static u_int32_t nameHash(const u_int8_t *name)
+{
+  u_int32_t h = 2166136261u;
+  for (int i = 0; i < MAX_LEN_OF_SFN && name[i] != 0; ++i)
+    h = (h ^ name[i]) * 16777619u;
+  return h;
+}
+
+static FILE_t* entryAt(u_int16_t node, u_int32_t slot, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  return (FILE_t*)clusterAddr(node, FAT, data, sysInfo) + slot;
+}
+
+static void linkPosition(DirIndex *d, u_int32_t i)
+{
+  u_int32_t *head = &d->bucket[d->positions[i].hash & (d->buckets - 1)];
+  d->positions[i].next = *head;
+  *head = i + 1;
+}
+
+static void insert(DirIndex *d, u_int16_t node, u_int32_t slot, FILE_t *f)
+{
+  if (f->Filename[0] == 0 || f->Filename[0] == DIRECTORY_NOT_USED)
+    return; // no name a lookup can ask for
+  if (d->count == d->size) {
+    d->size = d->size ? 2 * d->size : 64;
+    d->positions = realloc(d->positions, d->size * sizeof(DirPosition));
+  }
+  DirPosition *p = &d->positions[d->count++];
+  p->node = node;
+  p->slot = slot;
+  p->hash = nameHash(f->Filename);
+  if (d->count > d->buckets) {
+    d->buckets = d->buckets ? 2 * d->buckets : 64;
+    free(d->bucket);
+    d->bucket = calloc(d->buckets, sizeof(u_int32_t));
+    for (u_int32_t i = 0; i < d->count; ++i)
+      linkPosition(d, i);
+  }
+  else {
+    linkPosition(d, d->count - 1);
+  }
+}
+
+//Index the entries of node from slot on, up to the first free one.
+static void indexFrom(DirIndex *d, u_int16_t node, u_int32_t slot, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  u_int32_t perCluster = clusterSize(sysInfo) / FILE_ENTRY_SIZE;
+  for (; slot < perCluster; ++slot) {
+    FILE_t *f = entryAt(node, slot, FAT, data, sysInfo);
+    if (f->Filename[0] == DIRECTORY_NOT_USED) {
+      d->endNode = node;
+      d->endSlot = slot;
+      return;
+    }
+    insert(d, node, slot, f);
+  }
+  d->endNode = 0;
+}
+
+static DirIndex* indexOf(FILE_t *dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  DirIndex *d = dirs[dir->FirstClusterNo];
+  if (d != NULL)
+    return d;
+  d = dirs[dir->FirstClusterNo] = calloc(1, sizeof(DirIndex));
+  u_int16_t N = dir->FirstClusterNo;
+  while (1) {
+    indexFrom(d, N, RESERVED_DIRECTORY_REGION_SIZE / FILE_ENTRY_SIZE, FAT, data, sysInfo);
+    if (d->endNode != 0 || FAT[N] == END_OF_FILE)
+      break;
+    N = FAT[N];
+  }
+  while (FAT[N] != END_OF_FILE)
+    N = FAT[N];
+  d->last = N;
+  return d;
+}
+
+FILE_t* dirIndexSearch(FILE_t *dir, char *filename, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  DirIndex *d = indexOf(dir, FAT, data, sysInfo);
+  u_int32_t hash = nameHash((u_int8_t*)filename);
+  u_int32_t live = 0, deleted = 0; // 1 + the first position found of each
+  for (u_int32_t i = d->bucket ? d->bucket[hash & (d->buckets - 1)] : 0; i != 0; i = d->positions[i - 1].next) {
+    DirPosition *p = &d->positions[i - 1];
+    if (p->hash != hash)
+      continue;
+    FILE_t *f = entryAt(p->node, p->slot, FAT, data, sysInfo);
+    if (strcmp((char*)f->Filename, filename) != 0)
+      continue;
+    // buckets list the newest position first
+    if (!(f->Attr & ATTR_DELETED))
+      live = i;
+    else
+      deleted = i;
+  }
+  u_int32_t i = live ? live : deleted;
+  if (i != 0)
+    return entryAt(d->positions[i - 1].node, d->positions[i - 1].slot, FAT, data, sysInfo);
+  if (d->endNode != 0)
+    return entryAt(d->endNode, d->endSlot, FAT, data, sysInfo);
+  return NULL;
+}
+
+void dirIndexEnd(FILE_t *dir, u_int16_t *node, u_int16_t *last,
+                 u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  DirIndex *d = indexOf(dir, FAT, data, sysInfo);
+  *node = d->endNode;
+  *last = d->last;
+}
+
+void dirIndexAdd(FILE_t *dir, u_int16_t node, u_int32_t slot, u_int32_t count,
+                 u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  DirIndex *d = dirs[dir->FirstClusterNo];
+  if (d == NULL)
+    return;
+  int appended = FAT[d->last] == node && (d->endNode == 0 || d->endNode == d->last);
+  if (node != d->endNode && !appended) {
+    // not at the end the index knew, nor in a cluster added right after it
+    dirIndexForget(dir->FirstClusterNo);
+    return;
+  }
+  if (FAT[node] == END_OF_FILE)
+    d->last = node;
+  for (u_int32_t i = 0; i < count; ++i)
+    insert(d, node, slot + i, entryAt(node, slot + i, FAT, data, sysInfo));
+  indexFrom(d, node, slot + count, FAT, data, sysInfo);
+  if (d->endNode == 0 && FAT[node] != END_OF_FILE)
+    dirIndexForget(dir->FirstClusterNo); // where the chain goes on is for a rebuild to find
+}
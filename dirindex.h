@@ -0,0 +1,40 @@
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+#include <sys/types.h>
+#include "structs.h"
+
+/*
+ * In-memory index over the entries of the directories of the live volume,
+ * so looking a name up or adding an entry does not walk the whole chain.
+ *
+ * A directory is indexed, by its first cluster, the first time it is
+ * searched: every entry in front of its first free one goes into a hash of
+ * names to positions (chain node and slot), and the position of that free
+ * entry is kept as the end of the directory. Entries are only ever added
+ * there and their names never change in place, so createEntry records what
+ * it adds and a hit only needs its ATTR_DELETED bit looked at.
+ * The index is dropped every time a volume is mounted or replaced.
+ */
+
+void dirIndexInit(u_int32_t nodes);
+
+//Drop the index of the directory starting at cluster first, if it has one.
+void dirIndexForget(u_int16_t first);
+
+//Return what a walk of dir's chain would: the first live entry named
+//filename, else the first deleted one, else the first free entry, or NULL
+//if there is none of these.
+FILE_t* dirIndexSearch(FILE_t *dir, char *filename, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+
+//Give the node holding the first free entry of dir, 0 if every cluster
+//is in use, and the last node of its chain.
+void dirIndexEnd(FILE_t *dir, u_int16_t *node, u_int16_t *last,
+                 u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+
+//Record that the count entries of dir from slot of node on, which were
+//its first free ones, have been written.
+void dirIndexAdd(FILE_t *dir, u_int16_t node, u_int32_t slot, u_int32_t count,
+                 u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+
+#endif
@@ -10,8 +10,9 @@
 //Help dialog
 void help(char *progname);
 
-//Main filesystem loop
-void filesystem(char *file);
+//Main filesystem loop over the images of a volume, recording a trace of its
+//commands unless record is NULL
+void filesystem(char **files, int count, char *record);
 
 //Converts source data into appropriate binary data.
 //User must free the returned pointer
@@ -0,0 +1,373 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "handle.h"
+#include "snapshot.h"
+
+static Handle handles[MAX_HANDLES];
+static u_int32_t generation = 1; // bumped whenever cursors may have gone stale
+
+static AppendBuffer buffers[MAX_APPEND_BUFFERS];
+static u_int32_t buffered; // bytes in all append buffers
+
+/*
+ * The file entry in slot of directory node dir, or NULL if it no longer is
+ * the file named name: its directory cluster has been deleted or freed,
+ * or the entry deleted or reused.
+ */
+static FILE_t* entryAt(u_int16_t dir, u_int16_t slot, const u_int8_t *name,
+                       u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  u_int16_t link = FAT[dir];
+  if (link == FREE_CLUSTER || isDeletedLink(link, sysInfo))
+    return NULL;
+  FILE_t *f = (FILE_t*)clusterAddr(dir, FAT, data, sysInfo) + slot;
+  if (f->Filename[0] == DIRECTORY_NOT_USED || f->Attr & (ATTR_DELETED | ATTR_DIRECTORY)
+      || (f->Attr & ATTR_LONE_FILE_NAME) == ATTR_LONE_FILE_NAME
+      || memcmp(f->Filename, name, MAX_LEN_OF_SFN) != 0)
+    return NULL;
+  return f;
+}
+
+static FILE_t* handleEntry(Handle *h, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  return entryAt(h->dir, h->slot, h->name, FAT, data, sysInfo);
+}
+
+//Node of working_dir's chain whose cluster holds entry f, and f's slot there.
+static void locateEntry(FILE_t *f, FILE_t *working_dir, u_int16_t *dir, u_int16_t *slot,
+                        u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  u_int32_t size = clusterSize(sysInfo);
+  u_int16_t N = working_dir->FirstClusterNo;
+  u_int8_t *begin = clusterAddr(N, FAT, data, sysInfo);
+  while ((u_int8_t*)f < begin || (u_int8_t*)f >= begin + size) {
+    N = FAT[N];
+    begin = clusterAddr(N, FAT, data, sysInfo);
+  }
+  *dir = N;
+  *slot = ((u_int8_t*)f - begin) / FILE_ENTRY_SIZE;
+}
+
+/*
+ * The open handle fd and its entry in *f. A handle whose file is gone is
+ * closed. Return NULL, after saying why, if fd can not be used.
+ */
+static Handle* useHandle(const char *cmd, int fd, FILE_t **f, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  if (fd < 0 || fd >= MAX_HANDLES || !handles[fd].open) {
+    printf("%s: %d is not an open handle.\n", cmd, fd);
+    return NULL;
+  }
+  Handle *h = &handles[fd];
+  *f = handleEntry(h, FAT, data, sysInfo);
+  if (*f == NULL) {
+    printf("%s: the file of handle %d is gone, closing it.\n", cmd, fd);
+    h->open = 0;
+    return NULL;
+  }
+  if (h->generation != generation) {
+    h->cursor.node = 0;
+    h->generation = generation;
+  }
+  return h;
+}
+
+void openHandle(char *filename, FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  FILE_t *f = searchFile(working_dir, FAT, data, sysInfo, filename);
+  if (f->Filename[0] == DIRECTORY_NOT_USED || f->Attr & ATTR_DELETED) {
+    printf("open: %s does not exist.\n", filename);
+    return;
+  }
+  if (f->Attr & ATTR_DIRECTORY) {
+    printf("open: %s is not a file.\n", filename);
+    return;
+  }
+  int fd = 0;
+  while (fd < MAX_HANDLES && handles[fd].open)
+    ++fd;
+  if (fd == MAX_HANDLES) {
+    printf("open: all %d handles are in use.\n", MAX_HANDLES);
+    return;
+  }
+
+  Handle *h = &handles[fd];
+  memset(h, 0, sizeof(Handle));
+  h->open = 1;
+  locateEntry(f, working_dir, &h->dir, &h->slot, FAT, data, sysInfo);
+  h->dirFirst = working_dir->FirstClusterNo;
+  memcpy(h->name, f->Filename, MAX_LEN_OF_SFN);
+  h->generation = generation;
+  printf("%d\n", fd);
+}
+
+void readHandle(int fd, size_t amt, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  FILE_t *f;
+  Handle *h = useHandle("read", fd, &f, FAT, data, sysInfo);
+  if (h == NULL)
+    return;
+  u_int8_t *buf = malloc(amt + 1);
+  int n = fileRead(f, h->offset, buf, amt, &h->cursor, FAT, data, sysInfo);
+  if (n < 0) {
+    printf("read: handle %d is damaged, checksum verification failed.\n", fd);
+    free(buf);
+    return;
+  }
+  h->offset += n;
+  fwrite(buf, 1, n, stdout);
+  printf("\n");
+  free(buf);
+}
+
+/*
+ * The entry may sit in a directory other than the working one, so its
+ * cluster is made private here and its usage accounted for here rather
+ * than by the command loop.
+ */
+void writeHandle(int fd, size_t amt, char *input, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  FILE_t *f;
+  Handle *h = useHandle("fdwrite", fd, &f, FAT, data, sysInfo);
+  if (h == NULL)
+    return;
+  FILE_t dir;
+  memset(&dir, 0, sizeof(dir));
+  dir.FirstClusterNo = h->dirFirst;
+  if (privatizeDirectory(&dir, 0, FAT, data, sysInfo) != 0) {
+    printf("fdwrite: no space left on device\n");
+    return;
+  }
+  f = handleEntry(h, FAT, data, sysInfo);
+
+  u_int64_t bytesBefore, bytesAfter;
+  u_int32_t clustersBefore, clustersAfter;
+  entryUsage(f, FAT, sysInfo, &bytesBefore, &clustersBefore);
+  size_t len = strlen(input);
+  int err = fileWrite(f, h->offset, input, len, &h->cursor, FAT, data, sysInfo);
+  entryModified(f, data, sysInfo);
+  entryUsage(f, FAT, sysInfo, &bytesAfter, &clustersAfter);
+  addDirUsage(h->dirFirst, (int64_t)bytesAfter - bytesBefore, (int64_t)clustersAfter - clustersBefore);
+  if (err != 0) {
+    printf("fdwrite: no space left on device\n");
+    return;
+  }
+  h->offset += len;
+}
+
+void seekHandle(int fd, char *where, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  FILE_t *f;
+  Handle *h = useHandle("seek", fd, &f, FAT, data, sysInfo);
+  if (h == NULL)
+    return;
+  h->offset = strcmp(where, "end") ? strtoul(where, NULL, 10) : f->FileSize;
+}
+
+void closeHandle(int fd)
+{
+  if (fd < 0 || fd >= MAX_HANDLES || !handles[fd].open) {
+    printf("close: %d is not an open handle.\n", fd);
+    return;
+  }
+  handles[fd].open = 0;
+}
+
+void handlesChanged(u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  ++generation;
+  for (int fd = 0; fd < MAX_HANDLES; ++fd) {
+    if (handles[fd].open && handleEntry(&handles[fd], FAT, data, sysInfo) == NULL)
+      handles[fd].open = 0;
+  }
+}
+
+void closeAllHandles(void)
+{
+  memset(handles, 0, sizeof(handles));
+}
+
+/*
+ * Clusters f needs once len buffered bytes are appended to it. Bytes past
+ * the end of an inline file's slots move the whole file to a chain, and a
+ * compressed file may need a cluster more for its chunk table. Filling a
+ * last cluster that other nodes share takes a private copy of it.
+ */
+static u_int32_t clustersNeeded(AppendBuffer *b, FILE_t *f, u_int32_t len, BootSector *sysInfo)
+{
+  u_int32_t size = clusterSize(sysInfo);
+  if (len <= b->slack)
+    return len > 0 ? b->copy : 0;
+  if (f->Flags & INLINE_DATA)
+    return (f->FileSize + len + size - 1) / size;
+  if (f->Attr & ATTR_COMPRESSED)
+    return (len + size - 1) / size + 1;
+  return (len - b->slack + size - 1) / size + b->copy;
+}
+
+/*
+ * Bytes f can take before it needs another cluster. A hole at the end does
+ * not count. *copy is set to 1 if the last cluster is shared, 0 otherwise.
+ */
+static u_int32_t tailSlack(FILE_t *f, u_int32_t *copy, u_int16_t *FAT, BootSector *sysInfo)
+{
+  *copy = 0;
+  if (f->Flags & INLINE_DATA)
+    return MAX_INLINE_SIZE - f->FileSize;
+  if (f->Attr & ATTR_COMPRESSED || f->FirstClusterNo == 0)
+    return 0;
+  u_int16_t N = f->FirstClusterNo;
+  u_int32_t end = nodeBytes(N, FAT, sysInfo);
+  while (FAT[N] != END_OF_FILE) {
+    N = FAT[N];
+    end += nodeBytes(N, FAT, sysInfo);
+  }
+  if (isHole(N, FAT, sysInfo) || end <= f->FileSize)
+    return 0;
+  *copy = isSharedCluster(N, FAT, sysInfo);
+  return end - f->FileSize;
+}
+
+/*
+ * Place len bytes at the end of the file of b's entry. Like writeHandle,
+ * the entry's directory is made private and its usage accounted for here.
+ * Return 0 on success, -1 otherwise.
+ */
+static int placeBytes(AppendBuffer *b, const u_int8_t *bytes, u_int32_t len,
+                      u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  FILE_t dir;
+  memset(&dir, 0, sizeof(dir));
+  dir.FirstClusterNo = b->dirFirst;
+  FILE_t *f = entryAt(b->dir, b->slot, b->name, FAT, data, sysInfo);
+  if (f == NULL) {
+    printf("append: %s is gone, dropping %u buffered bytes.\n", b->filename, len);
+    return -1;
+  }
+  if (privatizeDirectory(&dir, 0, FAT, data, sysInfo) != 0) {
+    printf("append: no space left on device\n");
+    return -1;
+  }
+  f = entryAt(b->dir, b->slot, b->name, FAT, data, sysInfo);
+  u_int64_t bytesBefore, bytesAfter;
+  u_int32_t clustersBefore, clustersAfter;
+  entryUsage(f, FAT, sysInfo, &bytesBefore, &clustersBefore);
+  int err = appendFile(f, bytes, len, FAT, data, sysInfo);
+  entryModified(f, data, sysInfo);
+  entryUsage(f, FAT, sysInfo, &bytesAfter, &clustersAfter);
+  addDirUsage(b->dirFirst, (int64_t)bytesAfter - bytesBefore, (int64_t)clustersAfter - clustersBefore);
+  if (err != 0)
+    printf("append: could not append to %s.\n", b->filename);
+  return err;
+}
+
+//Place the bytes of b at the end of its file and free b.
+static void flushBuffer(AppendBuffer *b, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  unreserveClusters(b->reserved);
+  buffered -= b->len;
+  if (b->len > 0)
+    placeBytes(b, b->bytes, b->len, FAT, data, sysInfo);
+  free(b->bytes);
+  memset(b, 0, sizeof(AppendBuffer));
+  handlesChanged(FAT, data, sysInfo);
+}
+
+//The buffer for the entry in slot of directory node dir, a new one if it has none.
+static AppendBuffer* getBuffer(u_int16_t dir, u_int16_t slot, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  AppendBuffer *b = NULL, *oldest = NULL;
+  for (int i = 0; i < MAX_APPEND_BUFFERS; ++i) {
+    if (buffers[i].used && buffers[i].dir == dir && buffers[i].slot == slot)
+      return &buffers[i];
+    if (!buffers[i].used && b == NULL)
+      b = &buffers[i];
+    if (buffers[i].used && (oldest == NULL || buffers[i].started < oldest->started))
+      oldest = &buffers[i];
+  }
+  if (b == NULL) {
+    flushBuffer(oldest, FAT, data, sysInfo);
+    b = oldest;
+  }
+  return b;
+}
+
+void bufferAppend(char *filename, size_t amt, char *input, FILE_t *working_dir,
+                  u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  FILE_t *f = searchFile(working_dir, FAT, data, sysInfo, filename);
+  if (f->Attr & ATTR_DIRECTORY) {
+    printf("append: %s is not a file.\n", filename);
+    return;
+  }
+  if (f->Filename[0] == DIRECTORY_NOT_USED || f->Attr & ATTR_DELETED) {
+    printf("append: %s does not exist.\n", filename);
+    return;
+  }
+  u_int16_t dir, slot;
+  locateEntry(f, working_dir, &dir, &slot, FAT, data, sysInfo);
+  AppendBuffer *b = getBuffer(dir, slot, FAT, data, sysInfo);
+  f = (FILE_t*)clusterAddr(dir, FAT, data, sysInfo) + slot;
+  if (!b->used) {
+    b->used = 1;
+    b->dir = dir;
+    b->slot = slot;
+    b->dirFirst = working_dir->FirstClusterNo;
+    memcpy(b->name, f->Filename, MAX_LEN_OF_SFN);
+    snprintf(b->filename, sizeof(b->filename), "%s", filename);
+    b->slack = tailSlack(f, &b->copy, FAT, sysInfo);
+    b->started = time(NULL);
+  }
+
+  size_t len = strlen(input);
+  u_int32_t need = clustersNeeded(b, f, b->len + len, sysInfo);
+  if (need > b->reserved && reserveClusters(need - b->reserved, sysInfo) != 0) {
+    // without a promise of space the new bytes can only be tried right away,
+    // after the buffered ones, which have theirs, so a failure loses only them
+    AppendBuffer target = *b;
+    flushBuffer(b, FAT, data, sysInfo);
+    placeBytes(&target, (u_int8_t*)input, len, FAT, data, sysInfo);
+    handlesChanged(FAT, data, sysInfo);
+    return;
+  }
+  if (need > b->reserved)
+    b->reserved = need;
+  if (b->len + len > b->size) {
+    while (b->len + len > b->size)
+      b->size = b->size ? 2 * b->size : 256;
+    b->bytes = realloc(b->bytes, b->size);
+  }
+  memcpy(b->bytes + b->len, input, len);
+  b->len += len;
+  buffered += len;
+
+  if (b->len >= APPEND_BUFFER_BYTES)
+    flushBuffer(b, FAT, data, sysInfo);
+  while (buffered > APPEND_BUFFER_TOTAL) {
+    AppendBuffer *largest = NULL;
+    for (int i = 0; i < MAX_APPEND_BUFFERS; ++i) {
+      if (buffers[i].used && (largest == NULL || buffers[i].len > largest->len))
+        largest = &buffers[i];
+    }
+    flushBuffer(largest, FAT, data, sysInfo);
+  }
+}
+
+void flushExpiredAppends(u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  time_t now = time(NULL);
+  for (int i = 0; i < MAX_APPEND_BUFFERS; ++i) {
+    if (buffers[i].used && now - buffers[i].started >= APPEND_BUFFER_SECONDS)
+      flushBuffer(&buffers[i], FAT, data, sysInfo);
+  }
+}
+
+void flushAppends(u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  for (int i = 0; i < MAX_APPEND_BUFFERS; ++i) {
+    if (buffers[i].used)
+      flushBuffer(&buffers[i], FAT, data, sysInfo);
+  }
+}
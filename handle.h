@@ -0,0 +1,91 @@
+#ifndef HANDLE_H
+#define HANDLE_H
+
+#include <sys/types.h>
+#include <time.h>
+#include "structs.h"
+
+/*
+ * Open files. A handle remembers where its file's entry is, as a node of
+ * its directory's chain and a slot in that node's cluster, so neither
+ * looking the name up again nor a directory cluster moving to another
+ * physical cluster gets in the way. It also keeps the file offset and a
+ * cursor into the file's chain, so sequential reads and writes carry on
+ * from where the last one stopped.
+ *
+ * Handles work on the live volume. Other commands may change a file
+ * behind its handles' back, so handlesChanged must be called after every
+ * one that changes the volume.
+ */
+#define MAX_HANDLES 32
+
+typedef struct Handle {
+  int open;
+  u_int16_t dir;      // node of the directory cluster holding the entry
+  u_int16_t slot;     // of the entry in that cluster
+  u_int16_t dirFirst; // first cluster of the directory, which keys its usage
+  u_int8_t name[MAX_LEN_OF_SFN]; // of the entry, to tell a reused slot
+  u_int32_t offset;
+  ChainCursor cursor;
+  u_int32_t generation; // of the volume when the cursor was set
+} Handle;
+
+// "open <file>": Open a file of working_dir and print its handle.
+void openHandle(char *filename, FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+
+// "read <fd> <amt>": Print up to amt bytes from the offset of handle fd on.
+void readHandle(int fd, size_t amt, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+
+// "fdwrite <fd> <amt> <data>": Write data at the offset of handle fd.
+void writeHandle(int fd, size_t amt, char *input, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+
+// "seek <fd> <offset>|end": Move the offset of handle fd.
+void seekHandle(int fd, char *where, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+
+// "close <fd>"
+void closeHandle(int fd);
+
+//Forget every cursor and close the handles whose file is gone.
+void handlesChanged(u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+
+void closeAllHandles(void);
+
+/*
+ * Delayed allocation for appends. "append" only adds its bytes to an
+ * in-memory buffer kept for the file, found like a handle's, and reserves
+ * the clusters they will need from the free count. A buffer is placed at
+ * the end of its file, with every new cluster allocated as one extent,
+ * once it holds APPEND_BUFFER_BYTES or is APPEND_BUFFER_SECONDS old, when
+ * all buffers together hold more than APPEND_BUFFER_TOTAL, before any
+ * command other than append, pwd or cd, and when the volume is closed.
+ * A run of small appends so costs one chain walk and one allocation.
+ */
+#define MAX_APPEND_BUFFERS 16
+#define APPEND_BUFFER_BYTES (32 * 1024)
+#define APPEND_BUFFER_TOTAL (256 * 1024)
+#define APPEND_BUFFER_SECONDS 5
+
+typedef struct AppendBuffer {
+  int used;
+  u_int16_t dir, slot, dirFirst; // of the file's entry, as in a Handle
+  u_int8_t name[MAX_LEN_OF_SFN];
+  char filename[MAX_LEN_OF_LFN + 1]; // as given to append, for messages
+  u_int8_t *bytes;
+  u_int32_t len, size;
+  u_int32_t slack;    // bytes the file took without a new cluster when the buffer started
+  u_int32_t copy;     // 1 if filling the slack takes a copy of a shared cluster
+  u_int32_t reserved; // clusters reserved for bytes
+  time_t started;
+} AppendBuffer;
+
+// "append <file> <amt> <data>": Buffer data for the end of a file of working_dir.
+void bufferAppend(char *filename, size_t amt, char *input, FILE_t *working_dir,
+                  u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+
+//Place the buffers older than APPEND_BUFFER_SECONDS.
+void flushExpiredAppends(u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+
+//Place every buffer.
+void flushAppends(u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+
+#endif
@@ -0,0 +1,134 @@
+#include <string.h>
+#include "lz.h"
+
+#define HASH_BITS     12
+#define MIN_MATCH     4
+#define LAST_LITERALS 5
+#define MAX_OFFSET    65535
+
+static u_int32_t hash4(const u_int8_t *p)
+{
+  u_int32_t v;
+  memcpy(&v, p, 4);
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static u_int8_t* putLength(u_int8_t *op, int len)
+{
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (u_int8_t)len;
+  return op;
+}
+
+/*
+ * Emit one sequence: literals [lit, lit+litLen) followed by a match of
+ * matchLen bytes at offset. A matchLen of 0 emits only literals and ends
+ * the block. Returns NULL if the sequence does not fit before end.
+ */
+static u_int8_t* putSequence(u_int8_t *op, u_int8_t *end, const u_int8_t *lit, int litLen,
+                             int offset, int matchLen)
+{
+  if (op + 1 + litLen / 255 + 1 + litLen + 2 + matchLen / 255 + 1 > end)
+    return NULL;
+
+  u_int8_t *token = op++;
+  *token = (litLen >= 15 ? 15 : litLen) << 4;
+  if (litLen >= 15)
+    op = putLength(op, litLen - 15);
+  memcpy(op, lit, litLen);
+  op += litLen;
+
+  if (matchLen == 0)
+    return op;
+  *op++ = offset & 0xFF;
+  *op++ = offset >> 8;
+  matchLen -= MIN_MATCH;
+  *token |= matchLen >= 15 ? 15 : matchLen;
+  if (matchLen >= 15)
+    op = putLength(op, matchLen - 15);
+  return op;
+}
+
+int lzCompress(const u_int8_t *src, int srcLen, u_int8_t *dst, int dstCap)
+{
+  int table[1 << HASH_BITS];
+  memset(table, 0xFF, sizeof(table));
+
+  u_int8_t *op = dst, *end = dst + dstCap;
+  int ip = 0, anchor = 0;
+  int limit = srcLen - LAST_LITERALS - MIN_MATCH;
+
+  while (ip < limit) {
+    u_int32_t h = hash4(src + ip);
+    int ref = table[h];
+    table[h] = ip;
+    if (ref < 0 || ip - ref > MAX_OFFSET || memcmp(src + ref, src + ip, MIN_MATCH) != 0) {
+      ++ip;
+      continue;
+    }
+    int len = MIN_MATCH;
+    while (ip + len < srcLen - LAST_LITERALS && src[ref + len] == src[ip + len])
+      ++len;
+    op = putSequence(op, end, src + anchor, ip - anchor, ip - ref, len);
+    if (op == NULL)
+      return 0;
+    ip += len;
+    anchor = ip;
+  }
+
+  op = putSequence(op, end, src + anchor, srcLen - anchor, 0, 0);
+  if (op == NULL)
+    return 0;
+  return op - dst;
+}
+
+static int getLength(const u_int8_t *src, int srcLen, int *ip, int len)
+{
+  u_int8_t b;
+  do {
+    if (*ip >= srcLen)
+      return -1;
+    b = src[(*ip)++];
+    len += b;
+  } while (b == 255);
+  return len;
+}
+
+int lzDecompress(const u_int8_t *src, int srcLen, u_int8_t *dst, int dstCap)
+{
+  int ip = 0, op = 0;
+  while (ip < srcLen) {
+    u_int8_t token = src[ip++];
+
+    int litLen = token >> 4;
+    if (litLen == 15 && (litLen = getLength(src, srcLen, &ip, litLen)) < 0)
+      return -1;
+    if (ip + litLen > srcLen || op + litLen > dstCap)
+      return -1;
+    memcpy(dst + op, src + ip, litLen);
+    ip += litLen;
+    op += litLen;
+
+    if (ip == srcLen)
+      break; // the last sequence has no match
+    if (ip + 2 > srcLen)
+      return -1;
+    int offset = src[ip] | (src[ip + 1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > op)
+      return -1;
+
+    int matchLen = token & 15;
+    if (matchLen == 15 && (matchLen = getLength(src, srcLen, &ip, matchLen)) < 0)
+      return -1;
+    matchLen += MIN_MATCH;
+    if (op + matchLen > dstCap)
+      return -1;
+    for (int i = 0; i < matchLen; ++i, ++op) // regions may overlap
+      dst[op] = dst[op - offset];
+  }
+  return op;
+}
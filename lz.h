@@ -0,0 +1,20 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <sys/types.h>
+
+/*
+ * Small LZ77 codec using the LZ4 block format: a token byte holding literal
+ * and match lengths, the literals, then a 2 byte little-endian offset.
+ * Used to compress file chunks, so inputs are at most 64K.
+ */
+
+//Compress srcLen bytes into dst. Returns the compressed length, or 0 if
+//the result would not fit in dstCap bytes.
+int lzCompress(const u_int8_t *src, int srcLen, u_int8_t *dst, int dstCap);
+
+//Decompress srcLen bytes into dst. Returns the decompressed length, or -1
+//if the input is malformed or would overflow dstCap bytes.
+int lzDecompress(const u_int8_t *src, int srcLen, u_int8_t *dst, int dstCap);
+
+#endif
@@ -0,0 +1,598 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "structs.h"
+#include "crc32c.h"
+
+//The FAT a new volume gets; snapshots can not freeze a larger one
+#define MAX_FAT_ENTRIES 16384
+#define MAX_SECTORS_PER_CLUSTER 128
+#define CHUNK_SIZE (1024 * 1024)
+//Free clusters left by default: a share of the tree's, but never fewer than the minimum
+#define DEFAULT_SPARE_PERCENT 25
+#define MIN_SPARE_CLUSTERS 64
+
+//A file or directory of the host tree
+typedef struct Node {
+	char *name;
+	char *hostPath;
+	int isDir;
+	u_int32_t size; // of a file
+	struct Node **children; // of a directory, sorted by name
+	u_int32_t childCount, childSize;
+	u_int32_t first; // its first cluster, counted from the start of the data region
+	u_int32_t clusters; // 0 for a file stored inline
+	u_int8_t *contents; // of a directory, built in memory
+} Node;
+
+static u_int32_t clusterBytes;
+static Node **extents = NULL; // every file and directory, in the order of their clusters
+static u_int32_t extentCount = 0;
+static u_int32_t fileCount = 0, dirCount = 0;
+
+static Node* newNode(const char *name, const char *hostPath, int isDir)
+{
+	Node *n = calloc(1, sizeof(Node));
+	n->name = strdup(name);
+	n->hostPath = strdup(hostPath);
+	n->isDir = isDir;
+	return n;
+}
+
+static int compareNodes(const void *a, const void *b)
+{
+	return strcmp((*(Node* const*)a)->name, (*(Node* const*)b)->name);
+}
+
+/*
+ * scanDirectory() - Adds everything in the host directory of dir to it,
+ * recursively. Entries that can not go on a volume are skipped with a
+ * warning. Returns 0 on success, -1 if a directory can not be read.
+ */
+static int scanDirectory(Node *dir)
+{
+	DIR *d = opendir(dir->hostPath);
+	if (d == NULL)
+	{
+		fprintf(stderr, "%s: %s\n", dir->hostPath, strerror(errno));
+		return -1;
+	}
+	struct dirent *e;
+	while ((e = readdir(d)) != NULL)
+	{
+		if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+			continue;
+		char *hostPath = malloc(strlen(dir->hostPath) + strlen(e->d_name) + 2);
+		sprintf(hostPath, "%s/%s", dir->hostPath, e->d_name);
+		struct stat st;
+		Node *n = NULL;
+		if (lstat(hostPath, &st) != 0)
+			fprintf(stderr, "%s: %s, skipped\n", hostPath, strerror(errno));
+		else if (strlen(e->d_name) > MAX_LEN_OF_LFN)
+			fprintf(stderr, "%s: name too long, skipped\n", hostPath);
+		else if (S_ISDIR(st.st_mode))
+			n = newNode(e->d_name, hostPath, 1);
+		else if (!S_ISREG(st.st_mode))
+			fprintf(stderr, "%s: not a regular file, skipped\n", hostPath);
+		else if (st.st_size > 0xFFFFFFFFu)
+			fprintf(stderr, "%s: larger than 4GB, skipped\n", hostPath);
+		else
+		{
+			n = newNode(e->d_name, hostPath, 0);
+			n->size = st.st_size;
+		}
+		free(hostPath);
+		if (n == NULL)
+			continue;
+		if (n->isDir && scanDirectory(n) != 0)
+		{
+			closedir(d);
+			return -1;
+		}
+		if (dir->childCount == dir->childSize)
+		{
+			dir->childSize = dir->childSize ? 2 * dir->childSize : 16;
+			dir->children = realloc(dir->children, dir->childSize * sizeof(Node*));
+		}
+		dir->children[dir->childCount++] = n;
+	}
+	closedir(d);
+	qsort(dir->children, dir->childCount, sizeof(Node*), compareNodes);
+	return 0;
+}
+
+//Files small enough live in inline slots after their entry, as writeFile would create them.
+static int isInline(Node *n)
+{
+	return !n->isDir && n->size <= MAX_INLINE_SIZE;
+}
+
+//Directory entries n takes: its name's, and its inline slots if it has them.
+static u_int32_t entriesFor(Node *n)
+{
+	return entriesForName(n->name) + (isInline(n) ? MAX_INLINE_SLOTS : 0);
+}
+
+/*
+ * readSmall() - Reads all of the small file n into buf, leaving zeros for
+ * whatever can not be read.
+ */
+static void readSmall(Node *n, u_int8_t *buf)
+{
+	memset(buf, 0, n->size);
+	int fd = open(n->hostPath, O_RDONLY);
+	ssize_t got = 0, r = 0;
+	while (fd >= 0 && (size_t)got < n->size && (r = pread(fd, buf + got, n->size - got, got)) > 0)
+		got += r;
+	if (fd < 0 || r < 0 || (size_t)got < n->size)
+		fprintf(stderr, "%s: could not be read in full, the rest is zeros\n", n->hostPath);
+	if (fd >= 0)
+		close(fd);
+}
+
+//Node numbers skip DELETED_END_OF_FILE, which would read as a deleted end of chain.
+static u_int16_t nodeNumber(u_int32_t cluster)
+{
+	u_int32_t N = cluster + 2;
+	return N >= DELETED_END_OF_FILE ? N + 1 : N;
+}
+
+/*
+ * placeEntries() - Lays out the entries of dir the way createFile would
+ * add them one at a time: after the two reserved ones, a name's entries
+ * never cross a cluster, the rest of the cluster being padded with deleted
+ * entries. Writes them to dir->contents unless it is NULL.
+ * Returns the number of clusters dir takes.
+ */
+static u_int32_t placeEntries(Node *dir)
+{
+	u_int32_t perCluster = clusterBytes / FILE_ENTRY_SIZE;
+	u_int32_t cluster = 0, slot = RESERVED_DIRECTORY_REGION_SIZE / FILE_ENTRY_SIZE;
+	for (u_int32_t i = 0; i < dir->childCount; ++i)
+	{
+		Node *n = dir->children[i];
+		u_int32_t count = entriesFor(n);
+		if (slot + count > perCluster)
+		{
+			for (; dir->contents != NULL && slot < perCluster; ++slot)
+			{
+				FILE_t *pad = (FILE_t*)(dir->contents + cluster * clusterBytes) + slot;
+				memset(pad, 0, FILE_ENTRY_SIZE);
+				pad->Attr = ATTR_DELETED;
+			}
+			++cluster;
+			slot = RESERVED_DIRECTORY_REGION_SIZE / FILE_ENTRY_SIZE;
+		}
+		if (dir->contents != NULL)
+		{
+			FILE_t *f = nameEntries(dir->contents + cluster * clusterBytes + slot * FILE_ENTRY_SIZE, n->name);
+			f->FirstClusterNo = nodeNumber(n->first);
+			if (n->isDir)
+				f->Attr ^= ATTR_DIRECTORY;
+			else
+				f->FileSize = n->size;
+			if (isInline(n))
+			{
+				u_int8_t content[MAX_INLINE_SIZE];
+				readSmall(n, content);
+				f->Flags = INLINE_SLOTS;
+				writeInline(f, content, n->size);
+			}
+		}
+		slot += count;
+	}
+	return cluster + 1;
+}
+
+//Directories below dir, dir included.
+static u_int32_t countDirectories(Node *dir)
+{
+	u_int32_t count = 1;
+	for (u_int32_t i = 0; i < dir->childCount; ++i)
+	{
+		if (dir->children[i]->isDir)
+			count += countDirectories(dir->children[i]);
+	}
+	return count;
+}
+
+/*
+ * sizeTree() - Returns the clusters the tree below dir takes with
+ * clusters of clusterBytes, dir's own included, or 0 if a name does not
+ * fit in a directory cluster of that size.
+ */
+static u_int32_t sizeTree(Node *dir)
+{
+	u_int32_t total = 0;
+	for (u_int32_t i = 0; i < dir->childCount; ++i)
+	{
+		Node *n = dir->children[i];
+		if (entriesFor(n) * FILE_ENTRY_SIZE > clusterBytes - RESERVED_DIRECTORY_REGION_SIZE)
+			return 0;
+		if (n->isDir)
+		{
+			u_int32_t below = sizeTree(n);
+			if (below == 0)
+				return 0;
+			total += below;
+		}
+		else
+		{
+			n->clusters = isInline(n) ? 0 : (n->size + clusterBytes - 1) / clusterBytes;
+			total += n->clusters;
+		}
+	}
+	dir->clusters = placeEntries(dir);
+	return total + dir->clusters;
+}
+
+/*
+ * assignClusters() - Gives every directory, then every file not stored
+ * inline, a contiguous run of clusters, both breadth first so that the
+ * files of a directory sit next to each other.
+ */
+static void assignClusters(Node *root)
+{
+	u_int32_t nodes = 1, next = 0;
+	extents = malloc(sizeof(Node*));
+	extents[extentCount++] = root;
+	for (u_int32_t d = 0; d < extentCount; ++d)
+	{
+		Node *dir = extents[d];
+		dir->first = next;
+		next += dir->clusters;
+		++dirCount;
+		nodes += dir->childCount;
+		extents = realloc(extents, nodes * sizeof(Node*));
+		for (u_int32_t i = 0; i < dir->childCount; ++i)
+		{
+			if (dir->children[i]->isDir)
+				extents[extentCount++] = dir->children[i];
+		}
+	}
+	for (u_int32_t d = 0; d < dirCount; ++d)
+	{
+		Node *dir = extents[d];
+		for (u_int32_t i = 0; i < dir->childCount; ++i)
+		{
+			Node *f = dir->children[i];
+			if (f->isDir)
+				continue;
+			++fileCount;
+			if (isInline(f))
+				continue;
+			f->first = next;
+			next += f->clusters;
+			extents[extentCount++] = f;
+		}
+	}
+}
+
+/*
+ * buildDirectory() - Fills in the clusters of dir in memory. Like every
+ * directory, only its first cluster names "." and "..".
+ */
+static void buildDirectory(Node *dir)
+{
+	dir->contents = calloc(dir->clusters, clusterBytes);
+	for (u_int32_t c = 0; c < dir->clusters; ++c)
+	{
+		u_int8_t *begin = dir->contents + c * clusterBytes;
+		for (u_int8_t *e = begin + RESERVED_DIRECTORY_REGION_SIZE; e != begin + clusterBytes; e += FILE_ENTRY_SIZE)
+			((FILE_t*)e)->Filename[0] = DIRECTORY_NOT_USED;
+	}
+	strcpy((char*)((SoftLink*)dir->contents)->Filename, ".");
+	strcpy((char*)((SoftLink*)(dir->contents + FILE_ENTRY_SIZE))->Filename, "..");
+	placeEntries(dir);
+}
+
+/*
+ * linkChains() - Chains the clusters of every extent in the FAT, maps each
+ * node onto the physical cluster at the same position and takes its
+ * reference.
+ */
+static void linkChains(BootSector *sysInfo)
+{
+	u_int16_t *FAT = fatCopy(sysInfo, 0);
+	u_int16_t *remap = remapTable(FAT, sysInfo);
+	u_int16_t *refcount = refcountTable(sysInfo);
+	FAT[0] = RESERVED_CLUSTER;
+	FAT[1] = RESERVED_CLUSTER;
+	if (fatEntries(sysInfo) > DELETED_END_OF_FILE)
+		FAT[DELETED_END_OF_FILE] = RESERVED_CLUSTER;
+	for (u_int32_t e = 0; e < extentCount; ++e)
+	{
+		Node *n = extents[e];
+		for (u_int32_t c = n->first; c < n->first + n->clusters; ++c)
+		{
+			u_int16_t N = nodeNumber(c);
+			FAT[N] = c + 1 < n->first + n->clusters ? nodeNumber(c + 1) : END_OF_FILE;
+			remap[N] = c + 2;
+			refcount[c] = 1;
+		}
+	}
+	for (int i = 1; i < sysInfo->FATCopies; ++i)
+		memcpy(fatCopy(sysInfo, i), FAT, fatCopySectors(sysInfo) * sysInfo->BytesPerSector);
+}
+
+/*
+ * The data region is written in chunks of whole clusters, in order, while
+ * the reader threads fill the next ones from the host files.
+ */
+typedef struct Writer {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	u_int32_t chunks, chunkClusters, used; // used: clusters holding the tree
+	u_int32_t next;    // next chunk to read
+	u_int32_t written; // chunks written so far
+	int slots;
+	u_int8_t **buffers; // chunk c is read into buffers[c % slots]
+	int *ready;
+	u_int32_t *checksums;
+} Writer;
+
+/*
+ * readExtent() - Copies the clusters [from, to) of extent n into out.
+ */
+static void readExtent(Node *n, u_int32_t from, u_int32_t to, u_int8_t *out)
+{
+	size_t len = (size_t)(to - from) * clusterBytes;
+	if (n->isDir)
+	{
+		memcpy(out, n->contents + (size_t)(from - n->first) * clusterBytes, len);
+		return;
+	}
+	memset(out, 0, len);
+	off_t offset = (off_t)(from - n->first) * clusterBytes;
+	size_t want = offset >= n->size ? 0 : n->size - offset;
+	if (want > len)
+		want = len;
+	if (want == 0)
+		return;
+	int fd = open(n->hostPath, O_RDONLY);
+	ssize_t got = 0, r = 0;
+	while (fd >= 0 && (size_t)got < want && (r = pread(fd, out + got, want - got, offset + got)) > 0)
+		got += r;
+	if (fd < 0 || r < 0 || (size_t)got < want)
+		fprintf(stderr, "%s: could not be read in full, the rest is zeros\n", n->hostPath);
+	if (fd >= 0)
+		close(fd);
+}
+
+static void readChunk(Writer *w, u_int32_t chunk, u_int8_t *out)
+{
+	u_int32_t from = chunk * w->chunkClusters;
+	u_int32_t to = from + w->chunkClusters < w->used ? from + w->chunkClusters : w->used;
+	//the last extent starting at or before from
+	u_int32_t lo = 0, hi = extentCount;
+	while (hi - lo > 1)
+	{
+		u_int32_t mid = (lo + hi) / 2;
+		if (extents[mid]->first <= from)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	for (u_int32_t e = lo, c = from; c < to; ++e)
+	{
+		Node *n = extents[e];
+		u_int32_t end = n->first + n->clusters < to ? n->first + n->clusters : to;
+		readExtent(n, c, end, out + (size_t)(c - from) * clusterBytes);
+		c = end;
+	}
+	for (u_int32_t c = from; c < to; ++c)
+		w->checksums[c] = crc32c(0, out + (size_t)(c - from) * clusterBytes, clusterBytes);
+}
+
+static void* readChunks(void *arg)
+{
+	Writer *w = (Writer*)arg;
+	while (1)
+	{
+		pthread_mutex_lock(&w->lock);
+		u_int32_t chunk = w->next++;
+		while (chunk < w->chunks && chunk - w->written >= (u_int32_t)w->slots)
+			pthread_cond_wait(&w->changed, &w->lock);
+		pthread_mutex_unlock(&w->lock);
+		if (chunk >= w->chunks)
+			return NULL;
+
+		readChunk(w, chunk, w->buffers[chunk % w->slots]);
+		pthread_mutex_lock(&w->lock);
+		w->ready[chunk % w->slots] = 1;
+		pthread_cond_broadcast(&w->changed);
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+/*
+ * writeData() - Writes the clusters of the tree to fd at offset, reading
+ * the host files with one thread per CPU and computing their checksums.
+ * Returns 0 on success, -1 if the image could not be written.
+ */
+static int writeData(int fd, off_t offset, u_int32_t used, u_int32_t *checksums)
+{
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1)
+		threads = 1;
+	Writer w;
+	pthread_mutex_init(&w.lock, NULL);
+	pthread_cond_init(&w.changed, NULL);
+	w.chunkClusters = CHUNK_SIZE > clusterBytes ? CHUNK_SIZE / clusterBytes : 1;
+	w.used = used;
+	w.chunks = (used + w.chunkClusters - 1) / w.chunkClusters;
+	w.next = 0;
+	w.written = 0;
+	w.slots = 2 * threads;
+	w.buffers = malloc(w.slots * sizeof(u_int8_t*));
+	for (int i = 0; i < w.slots; ++i)
+		w.buffers[i] = malloc((size_t)w.chunkClusters * clusterBytes);
+	w.ready = calloc(w.slots, sizeof(int));
+	w.checksums = checksums;
+
+	pthread_t *tids = malloc(threads * sizeof(pthread_t));
+	for (long i = 0; i < threads; ++i)
+		pthread_create(&tids[i], NULL, readChunks, &w);
+
+	int err = 0;
+	for (u_int32_t chunk = 0; chunk < w.chunks; ++chunk)
+	{
+		int slot = chunk % w.slots;
+		pthread_mutex_lock(&w.lock);
+		while (!w.ready[slot])
+			pthread_cond_wait(&w.changed, &w.lock);
+		pthread_mutex_unlock(&w.lock);
+
+		u_int32_t from = chunk * w.chunkClusters;
+		u_int32_t count = from + w.chunkClusters < used ? w.chunkClusters : used - from;
+		size_t len = (size_t)count * clusterBytes;
+		if (!err && pwrite(fd, w.buffers[slot], len, offset + (off_t)from * clusterBytes) != (ssize_t)len)
+			err = -1;
+
+		pthread_mutex_lock(&w.lock);
+		w.ready[slot] = 0;
+		++w.written;
+		pthread_cond_broadcast(&w.changed);
+		pthread_mutex_unlock(&w.lock);
+	}
+	for (long i = 0; i < threads; ++i)
+		pthread_join(tids[i], NULL);
+
+	for (int i = 0; i < w.slots; ++i)
+		free(w.buffers[i]);
+	free(w.buffers);
+	free(w.ready);
+	free(tids);
+	pthread_cond_destroy(&w.changed);
+	pthread_mutex_destroy(&w.lock);
+	return err;
+}
+
+static void help(char *progname)
+{
+	printf("Usage: %s [-f CLUSTERS] HOSTDIR IMAGE\n", progname);
+	printf("Builds the volume image IMAGE holding a copy of the host directory tree HOSTDIR.\n");
+	printf("Directories come first, then every file in one contiguous run of clusters.\n");
+	printf("Files of up to %d bytes are stored inline in their directory entries.\n", MAX_INLINE_SIZE);
+	printf("The volume holds the tree and some free clusters, using the smallest cluster\n");
+	printf("size that fits them.\n");
+	printf("  -f CLUSTERS  leave that many clusters free for later changes, by default\n");
+	printf("               %d%% of the tree's clusters and at least %d\n", DEFAULT_SPARE_PERCENT, MIN_SPARE_CLUSTERS);
+	printf("Every directory can always grow by a cluster, however few are asked for.\n");
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	long spare = 0;
+	int spareGiven = 0;
+	long opt;
+	while((opt = getopt(argc, argv, "hf:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'h':
+			help(argv[0]);
+			break;
+		case 'f':
+			spare = atol(optarg);
+			spareGiven = 1;
+			break;
+		default:
+			return 1;
+		}
+	}
+	if(argc - optind != 2 || spare < 0)
+	{
+		fprintf(stderr, "A host directory and an image are required, try -h for help.\n");
+		return 1;
+	}
+	char *image = argv[optind + 1];
+
+	Node *root = newNode("", argv[optind], 1);
+	if (scanDirectory(root) != 0)
+		return 1;
+
+	//the smallest cluster size the tree and its free clusters fit in
+	u_int32_t dirs = countDirectories(root);
+	u_int32_t used = 0, spareClusters = 0, fatNeeded = 0;
+	u_int16_t sectorsPerCluster;
+	for (sectorsPerCluster = 1; sectorsPerCluster <= MAX_SECTORS_PER_CLUSTER; sectorsPerCluster *= 2)
+	{
+		clusterBytes = sectorsPerCluster * 512;
+		used = sizeTree(root);
+		spareClusters = spareGiven ? spare : used * DEFAULT_SPARE_PERCENT / 100;
+		if (!spareGiven && spareClusters < MIN_SPARE_CLUSTERS)
+			spareClusters = MIN_SPARE_CLUSTERS;
+		if (spareClusters < dirs)
+			spareClusters = dirs;
+		u_int32_t clusters = used + spareClusters;
+		// node numbers are 16 bits, so only ask for one that can fit
+		fatNeeded = clusters < MAX_FAT_ENTRIES ? nodeNumber(clusters - 1) + 1 : clusters;
+		if (used != 0 && fatNeeded <= MAX_FAT_ENTRIES)
+			break;
+	}
+	if (sectorsPerCluster > MAX_SECTORS_PER_CLUSTER)
+	{
+		fprintf(stderr, "%s: too large for a volume of %u clusters\n", argv[optind], MAX_FAT_ENTRIES - 3);
+		return 1;
+	}
+	assignClusters(root);
+	for (u_int32_t e = 0; e < dirCount; ++e)
+		buildDirectory(extents[e]);
+
+	BootSector boot;
+	memset(&boot, 0, sizeof(boot));
+	boot.BytesPerSector = 512;
+	boot.SectorsPerCluster = sectorsPerCluster;
+	boot.ReservedSectors = 1;
+	boot.FATCopies = FAT_COPIES;
+	boot.MaxRootEntries = 0; // the root is a cluster chain
+	boot.RootCluster = 2;
+	boot.SectorsPerFAT = (fatNeeded * sizeof(u_int16_t) + boot.BytesPerSector - 1) / boot.BytesPerSector;
+	boot.SectorsPerRemap = boot.SectorsPerFAT;
+	boot.SectorsPerFill = boot.SectorsPerFAT;
+	memcpy(boot.FileSystemType, "FAT16", 6);
+	boot.VolumeSerialNumber = (u_int32_t)time(NULL);
+	boot.ClusterCount = used + spareClusters;
+	sizeTables(&boot, boot.ClusterCount);
+	u_int32_t metaSectors = boot.ReservedSectors + boot.FATCopies * fatCopySectors(&boot) + boot.SectorsPerChecksum
+	                        + boot.SectorsPerRefcount + boot.SectorsPerSnapshotTable + boot.SectorsPerCheckpointTable;
+	u_int32_t totalSectors = metaSectors + boot.ClusterCount * sectorsPerCluster;
+	if (totalSectors > 0xFFFF)
+		boot.LargeSectors = totalSectors;
+	else
+		boot.TotalSectors = totalSectors;
+
+	u_int8_t *meta = calloc(metaSectors, boot.BytesPerSector);
+	BootSector *sysInfo = (BootSector*)meta;
+	memcpy(sysInfo, &boot, sizeof(boot));
+	linkChains(sysInfo);
+
+	crc32cInit();
+	int fd = open(image, O_RDWR | O_CREAT | O_TRUNC, (mode_t)0600);
+	off_t size = (off_t)totalSectors * boot.BytesPerSector;
+	if (fd < 0 || ftruncate(fd, size) != 0
+	    || writeData(fd, (off_t)metaSectors * boot.BytesPerSector, used, checksumTable(sysInfo)) != 0)
+	{
+		fprintf(stderr, "%s: %s\n", image, strerror(errno));
+		return 1;
+	}
+	refreshFATChecksums(sysInfo);
+	if (pwrite(fd, meta, (size_t)metaSectors * boot.BytesPerSector, 0) != (ssize_t)metaSectors * boot.BytesPerSector
+	    || close(fd) != 0)
+	{
+		fprintf(stderr, "%s: %s\n", image, strerror(errno));
+		return 1;
+	}
+	printf("%s: %u files and %u directories in %u clusters of %u bytes, %u free, %lu bytes\n",
+	       image, fileCount, dirCount, used, clusterBytes, spareClusters, (unsigned long)size);
+	return 0;
+}
@@ -0,0 +1,238 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include "command.h"
+#include "trace.h"
+
+#define MAX_COMMAND_NAMES 64
+#define MAX_COMMAND_NAME  15
+
+//Replay latencies of every command with the same name, in nanoseconds.
+typedef struct Latencies {
+  char Name[MAX_COMMAND_NAME + 1];
+  u_int64_t *Samples;
+  size_t Count;
+  size_t Capacity;
+  u_int64_t Recorded; // sum of the latencies in the trace
+} Latencies;
+
+Latencies commands[MAX_COMMAND_NAMES];
+int commandNames = 0;
+
+/*
+ * latencies() - Returns the samples of the command named by the first word
+ * of line. Past MAX_COMMAND_NAMES names, the rest share the last entry.
+ */
+Latencies* latencies(const char *line)
+{
+	char name[MAX_COMMAND_NAME + 1];
+	size_t len = strcspn(line, " ");
+	if (len > MAX_COMMAND_NAME)
+		len = MAX_COMMAND_NAME;
+	memcpy(name, line, len);
+	name[len] = '\0';
+
+	for (int i = 0; i < commandNames; ++i)
+	{
+		if (!strcmp(commands[i].Name, name))
+			return &commands[i];
+	}
+	if (commandNames == MAX_COMMAND_NAMES)
+		return &commands[MAX_COMMAND_NAMES - 1];
+	strcpy(commands[commandNames].Name, commandNames == MAX_COMMAND_NAMES - 1 ? "(other)" : name);
+	return &commands[commandNames++];
+}
+
+void addSample(Latencies *l, u_int64_t latency, u_int64_t recorded)
+{
+	if (l->Count == l->Capacity)
+	{
+		l->Capacity = l->Capacity ? 2 * l->Capacity : 64;
+		l->Samples = realloc(l->Samples, l->Capacity * sizeof(u_int64_t));
+	}
+	l->Samples[l->Count++] = latency;
+	l->Recorded += recorded;
+}
+
+int compareSamples(const void *a, const void *b)
+{
+	u_int64_t x = *(const u_int64_t*)a, y = *(const u_int64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+//Nearest-rank percentile p of the sorted samples, in microseconds
+double percentile(Latencies *l, int p)
+{
+	size_t rank = (l->Count * p + 99) / 100;
+	return l->Samples[rank ? rank - 1 : 0] / 1000.0;
+}
+
+void report(FILE *out, u_int64_t elapsed, u_int64_t recordedElapsed)
+{
+	size_t total = 0;
+	for (int i = 0; i < commandNames; ++i)
+		total += commands[i].Count;
+	fprintf(out, "replayed %zu commands in %.3f s, %.1f commands/s (%.3f s when recorded)\n",
+	        total, elapsed / 1e9, elapsed ? total / (elapsed / 1e9) : 0.0, recordedElapsed / 1e9);
+
+	fprintf(out, "%-15s %8s %10s %10s %10s %10s %10s %10s\n",
+	        "command", "count", "mean(us)", "p50", "p90", "p99", "max", "recorded");
+	for (int i = 0; i < commandNames; ++i)
+	{
+		Latencies *l = &commands[i];
+		u_int64_t sum = 0;
+		for (size_t j = 0; j < l->Count; ++j)
+			sum += l->Samples[j];
+		qsort(l->Samples, l->Count, sizeof(u_int64_t), compareSamples);
+		fprintf(out, "%-15s %8zu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		        l->Name, l->Count, sum / 1000.0 / l->Count, percentile(l, 50), percentile(l, 90),
+		        percentile(l, 99), l->Samples[l->Count - 1] / 1000.0, l->Recorded / 1000.0 / l->Count);
+	}
+}
+
+/*
+ * copyImage() - Copies the image at from to to. If from does not exist, to
+ * is removed so that the replay starts from a freshly created volume.
+ * Returns 0 on success, -1 otherwise.
+ */
+int copyImage(char *from, char *to)
+{
+	int in = open(from, O_RDONLY);
+	if (in < 0)
+	{
+		unlink(to);
+		return 0;
+	}
+	int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, (mode_t)0600);
+	if (out < 0)
+	{
+		close(in);
+		return -1;
+	}
+	char buf[64 * 1024];
+	ssize_t n;
+	while ((n = read(in, buf, sizeof(buf))) > 0)
+	{
+		if (write(out, buf, n) != n)
+		{
+			n = -1;
+			break;
+		}
+	}
+	close(in);
+	close(out);
+	return n < 0 ? -1 : 0;
+}
+
+void sleepUntil(u_int64_t when)
+{
+	u_int64_t now = traceClock();
+	if (now >= when)
+		return;
+	struct timespec ts = { (when - now) / 1000000000u, (when - now) % 1000000000u };
+	nanosleep(&ts, NULL);
+}
+
+void help(char *progname)
+{
+	printf("Usage: %s [-p] [-v] [-o COPY] TRACE IMAGE [STRIPE]...\n", progname);
+	printf("Replays the commands recorded in TRACE against a copy of IMAGE and reports\n");
+	printf("throughput and per-command latencies. A missing IMAGE replays against a new volume.\n");
+	printf("The stripe images of a striped volume follow IMAGE and are copied to STRIPE.replay.\n");
+	printf("  -p       keep the pacing of the recording instead of replaying as fast as possible\n");
+	printf("  -v       show the output of the commands\n");
+	printf("  -o COPY  image to replay against, IMAGE.replay by default\n");
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	int paced = 0, verbose = 0;
+	char *copy = NULL;
+	long opt;
+	while((opt = getopt(argc, argv, "hpvo:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'h':
+			help(argv[0]);
+			break;
+		case 'p':
+			paced = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'o':
+			copy = optarg;
+			break;
+		default:
+			return 1;
+		}
+	}
+	if(argc - optind < 2)
+	{
+		fprintf(stderr, "A trace and an image are required, try -h for help.\n");
+		return 1;
+	}
+	char **images = argv + optind + 1;
+	int count = argc - optind - 1;
+	char **copies = calloc(count, sizeof(char*));
+	for (int i = 0; i < count; ++i)
+	{
+		copies[i] = malloc(strlen(images[i]) + sizeof(".replay"));
+		sprintf(copies[i], "%s.replay", images[i]);
+	}
+	if (copy != NULL)
+		copies[0] = copy;
+
+	Trace trace;
+	if (traceOpen(&trace, argv[optind], 0) != 0)
+	{
+		fprintf(stderr, "%s: not a trace\n", argv[optind]);
+		return 1;
+	}
+	for (int i = 0; i < count; ++i)
+	{
+		if (copyImage(images[i], copies[i]) != 0)
+		{
+			fprintf(stderr, "%s: cannot copy %s there\n", copies[i], images[i]);
+			return 1;
+		}
+	}
+
+	//command output would drown the report, and no one answers prompts
+	FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+	if (!verbose)
+		freopen("/dev/null", "w", stdout);
+	freopen("/dev/null", "r", stdin);
+
+	if (openVolume(copies, count) != 0)
+		return 1;
+	char *command = NULL;
+	size_t size = 0;
+	u_int64_t start, recorded, recordedElapsed = 0;
+	u_int64_t begin = traceClock();
+	while (traceRead(&trace, &start, &recorded, &command, &size) == 0)
+	{
+		if (paced)
+			sleepUntil(begin + start);
+		Latencies *l = latencies(command);
+		u_int64_t before = traceClock();
+		runCommand(command);
+		addSample(l, traceClock() - before, recorded);
+		recordedElapsed = start + recorded;
+	}
+	u_int64_t elapsed = traceClock() - begin;
+	fflush(stdout);
+	closeVolume();
+	traceClose(&trace);
+	free(command);
+
+	report(out, elapsed, recordedElapsed);
+	fclose(out);
+	return 0;
+}
@@ -0,0 +1,312 @@
+#include <time.h>
+#include "snapshot.h"
+#include "dedup.h"
+#include "dirindex.h"
+#include "backup.h"
+
+static Snapshot* snapshots(BootSector *sysInfo) {
+  return (Snapshot*)snapshotTable(sysInfo);
+}
+
+//Number of sectors a snapshot freezes: the (FAT, remap, fill) tables.
+static u_int32_t metadataSectors(BootSector *sysInfo) {
+  return fatCopySectors(sysInfo);
+}
+
+static u_int8_t* liveSector(BootSector *sysInfo, u_int32_t sector) {
+  return (u_int8_t*)fatCopy(sysInfo, 0) + sector * sysInfo->BytesPerSector;
+}
+
+static Snapshot* findSnapshot(char *name, BootSector *sysInfo) {
+  if (sysInfo->SectorsPerSnapshotTable == 0)
+    return NULL;
+  Snapshot *table = snapshots(sysInfo);
+  for (int i = 0; i < MAX_SNAPSHOTS; ++i) {
+    if (table[i].Name[0] != '\0' && strcmp(table[i].Name, name) == 0)
+      return &table[i];
+  }
+  return NULL;
+}
+
+//Copy the metadata sectors of snapshot s into buf.
+static void materialize(Snapshot *s, u_int8_t *buf, BootSector *sysInfo) {
+  u_int8_t *data = dataRegion(sysInfo);
+  for (u_int32_t i = 0; i < metadataSectors(sysInfo); ++i) {
+    u_int8_t *src = s->Sectors[i] ? physicalAddr(s->Sectors[i], data, sysInfo) : liveSector(sysInfo, i);
+    memcpy(buf + i * sysInfo->BytesPerSector, src, sysInfo->BytesPerSector);
+  }
+}
+
+//Number of remap entries in a sector
+static u_int32_t entriesPerSector(BootSector *sysInfo) {
+  return sysInfo->BytesPerSector / sizeof(u_int16_t);
+}
+
+static int isRemapSector(u_int32_t sector, BootSector *sysInfo) {
+  return sector >= sysInfo->SectorsPerFAT && sector < sysInfo->SectorsPerFAT + sysInfo->SectorsPerRemap;
+}
+
+/*
+ * Take (sign 1) or drop (sign -1) a reference on every physical cluster
+ * the remap entries in sector, a copy of a remap sector, point at.
+ */
+static void sectorReferences(u_int16_t *sector, int sign, BootSector *sysInfo) {
+  for (u_int32_t i = 0; i < entriesPerSector(sysInfo); ++i) {
+    if (sector[i] == 0)
+      continue;
+    if (sign > 0)
+      addReference(sector[i], sysInfo);
+    else
+      releasePhysical(sector[i], sysInfo);
+  }
+}
+
+//Give back everything snapshot s holds and free its slot.
+static void releaseSnapshot(Snapshot *s, BootSector *sysInfo) {
+  u_int8_t *data = dataRegion(sysInfo);
+  for (u_int32_t i = 0; i < metadataSectors(sysInfo); ++i) {
+    if (s->Sectors[i] != 0 && isRemapSector(i, sysInfo))
+      sectorReferences((u_int16_t*)physicalAddr(s->Sectors[i], data, sysInfo), -1, sysInfo);
+    releasePhysical(s->Sectors[i], sysInfo);
+  }
+  memset(s, 0, sizeof(Snapshot));
+  metadataModified(s, sizeof(Snapshot), sysInfo);
+}
+
+/*
+ * Give every snapshot other than skip that still shares sector with the
+ * live volume its own copy. Snapshots needing a copy share a single one.
+ * A snapshot that can not be preserved for lack of space is deleted.
+ */
+static void preserveSector(BootSector *sysInfo, u_int32_t sector, Snapshot *skip) {
+  u_int8_t *data = dataRegion(sysInfo);
+  Snapshot *table = snapshots(sysInfo);
+  u_int16_t shared = 0;
+  for (int i = 0; i < MAX_SNAPSHOTS; ++i) {
+    Snapshot *s = &table[i];
+    if (s == skip || s->Name[0] == '\0' || s->Sectors[sector] != 0)
+      continue;
+    if (shared == 0) {
+      shared = allocMetaPhysical(fatCopy(sysInfo, 0), sysInfo);
+      if (shared == 0) {
+        printf("snapshot: no space left to preserve %s, deleting it\n", s->Name);
+        releaseSnapshot(s, sysInfo);
+        continue;
+      }
+      memcpy(physicalAddr(shared, data, sysInfo), liveSector(sysInfo, sector), sysInfo->BytesPerSector);
+      physicalModified(shared, data, sysInfo);
+    }
+    else {
+      addReference(shared, sysInfo);
+    }
+    // the live entries no longer stand for the snapshot's
+    if (isRemapSector(sector, sysInfo))
+      sectorReferences((u_int16_t*)liveSector(sysInfo, sector), 1, sysInfo);
+    s->Sectors[sector] = shared;
+    metadataModified(&s->Sectors[sector], sizeof(u_int16_t), sysInfo);
+  }
+}
+
+/*
+ * Called before a metadata sector of the live volume changes.
+ */
+void snapshotPreserve(BootSector *sysInfo, u_int32_t sector) {
+  if (sysInfo->SectorsPerSnapshotTable == 0)
+    return;
+  preserveSector(sysInfo, sector, NULL);
+}
+
+/*
+ * Return 1 if a snapshot still shares the sector holding live node N's
+ * remap entry, and so holds a reference on N's physical cluster that its
+ * reference count does not show.
+ */
+int snapshotShares(u_int16_t N, BootSector *sysInfo) {
+  if (sysInfo->SectorsPerSnapshotTable == 0)
+    return 0;
+  u_int32_t sector = sysInfo->SectorsPerFAT + N / entriesPerSector(sysInfo);
+  Snapshot *table = snapshots(sysInfo);
+  for (int i = 0; i < MAX_SNAPSHOTS; ++i) {
+    if (table[i].Name[0] != '\0' && table[i].Sectors[sector] == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Make sure no snapshot shares the clusters holding dir's entries, so they
+ * can be changed in place. With recursive set, do the same for every
+ * directory below dir.
+ * Return 0 on success, -1 if the volume ran out of clusters.
+ */
+int privatizeDirectory(FILE_t *dir, int recursive, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo) {
+  u_int32_t size = clusterSize(sysInfo);
+  for (u_int16_t N = dir->FirstClusterNo; N != END_OF_FILE; N = FAT[N]) {
+    u_int16_t P = physicalCluster(N, FAT, sysInfo);
+    if (!isSharedCluster(N, FAT, sysInfo))
+      continue;
+    u_int16_t Q = allocMetaPhysical(FAT, sysInfo);
+    if (Q == 0)
+      return -1;
+    memcpy(physicalAddr(Q, data, sysInfo), physicalAddr(P, data, sysInfo), size);
+    physicalModified(Q, data, sysInfo);
+    writeRemap(FAT, sysInfo, N, Q);
+    releasePhysical(P, sysInfo);
+  }
+  if (!recursive)
+    return 0;
+
+  u_int16_t clusterNo = dir->FirstClusterNo;
+  u_int8_t *begin = clusterAddr(clusterNo, FAT, data, sysInfo) + RESERVED_DIRECTORY_REGION_SIZE;
+  u_int8_t *end = clusterAddr(clusterNo, FAT, data, sysInfo) + size;
+  while (1) {
+    for (; begin != end; begin += FILE_ENTRY_SIZE) {
+      FILE_t *f = (FILE_t*)begin;
+      if (f->Filename[0] == DIRECTORY_NOT_USED)
+        return 0;
+      if (f->Attr & ATTR_DELETED || (f->Attr & ATTR_LONE_FILE_NAME) == ATTR_LONE_FILE_NAME)
+        continue;
+      if (f->Attr & ATTR_DIRECTORY && privatizeDirectory(f, 1, FAT, data, sysInfo) != 0)
+        return -1;
+    }
+    clusterNo = FAT[clusterNo];
+    if (clusterNo == END_OF_FILE)
+      return 0;
+    begin = clusterAddr(clusterNo, FAT, data, sysInfo) + RESERVED_DIRECTORY_REGION_SIZE;
+    end = clusterAddr(clusterNo, FAT, data, sysInfo) + size;
+  }
+}
+
+// "snapshot create <name>": Freeze the live volume. Nothing is copied and no
+// reference count changes: the snapshot shares every sector with the live volume.
+void snapshotCreate(char *name, BootSector *sysInfo) {
+  if (sysInfo->SectorsPerSnapshotTable == 0) {
+    printf("snapshot: volume has no snapshot table.\n");
+    return;
+  }
+  if (strlen(name) == 0 || strlen(name) > MAX_SNAPSHOT_NAME) {
+    printf("snapshot: name must be 1 to %d characters long.\n", MAX_SNAPSHOT_NAME);
+    return;
+  }
+  if (findSnapshot(name, sysInfo) != NULL) {
+    printf("snapshot: %s already exists.\n", name);
+    return;
+  }
+  Snapshot *table = snapshots(sysInfo), *s = NULL;
+  for (int i = 0; i < MAX_SNAPSHOTS && s == NULL; ++i) {
+    if (table[i].Name[0] == '\0')
+      s = &table[i];
+  }
+  if (s == NULL) {
+    printf("snapshot: all %d snapshot slots are in use.\n", MAX_SNAPSHOTS);
+    return;
+  }
+  memset(s, 0, sizeof(Snapshot));
+  strcpy(s->Name, name);
+  s->Created = time(NULL);
+  metadataModified(s, sizeof(Snapshot), sysInfo);
+}
+
+// "snapshot list": Print every snapshot with its creation time and the
+// number of metadata sectors it no longer shares with the live volume.
+void snapshotList(BootSector *sysInfo) {
+  if (sysInfo->SectorsPerSnapshotTable == 0)
+    return;
+  Snapshot *table = snapshots(sysInfo);
+  for (int i = 0; i < MAX_SNAPSHOTS; ++i) {
+    Snapshot *s = &table[i];
+    if (s->Name[0] == '\0')
+      continue;
+    u_int32_t preserved = 0;
+    for (u_int32_t k = 0; k < metadataSectors(sysInfo); ++k)
+      preserved += s->Sectors[k] != 0;
+    time_t created = s->Created;
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&created));
+    printf("%s\t%s\t%u sectors preserved\n", s->Name, when, preserved);
+  }
+}
+
+// "snapshot delete <name>"
+void snapshotDelete(char *name, BootSector *sysInfo) {
+  Snapshot *s = findSnapshot(name, sysInfo);
+  if (s == NULL) {
+    printf("snapshot: %s does not exist.\n", name);
+    return;
+  }
+  releaseSnapshot(s, sysInfo);
+}
+
+/*
+ * "snapshot rollback <name>": Make the live volume identical to a snapshot
+ * again. The snapshot is kept. Return 0 on success, -1 otherwise.
+ */
+int snapshotRollback(char *name, BootSector *sysInfo) {
+  Snapshot *s = findSnapshot(name, sysInfo);
+  if (s == NULL) {
+    printf("snapshot: %s does not exist.\n", name);
+    return -1;
+  }
+  // only the sectors s preserved differ from the live volume, and the
+  // other snapshots must stop sharing those
+  u_int32_t sectors = metadataSectors(sysInfo);
+  for (u_int32_t i = 0; i < sectors; ++i) {
+    if (s->Sectors[i] != 0)
+      preserveSector(sysInfo, i, s);
+  }
+
+  u_int32_t bps = sysInfo->BytesPerSector;
+  u_int8_t *data = dataRegion(sysInfo);
+  for (u_int32_t k = 0; k < sectors; ++k) {
+    if (s->Sectors[k] == 0)
+      continue;
+    u_int8_t *frozen = physicalAddr(s->Sectors[k], data, sysInfo);
+    // the references s took on its copy become the live volume's
+    if (isRemapSector(k, sysInfo))
+      sectorReferences((u_int16_t*)liveSector(sysInfo, k), -1, sysInfo);
+    for (int i = 0; i < sysInfo->FATCopies; ++i) {
+      u_int8_t *live = (u_int8_t*)fatCopy(sysInfo, i) + k * bps;
+      if (memcmp(live, frozen, bps) != 0) {
+        memcpy(live, frozen, bps);
+        metadataModified(live, bps, sysInfo);
+      }
+    }
+  }
+  refreshFATChecksums(sysInfo);
+
+  // the snapshot is identical to the live volume again
+  for (u_int32_t i = 0; i < sectors; ++i) {
+    releasePhysical(s->Sectors[i], sysInfo);
+    s->Sectors[i] = 0;
+  }
+  metadataModified(s->Sectors, sectors * sizeof(u_int16_t), sysInfo);
+  FILE_t root;
+  rootEntry(&root, sysInfo);
+  dirIndexInit(fatEntries(sysInfo));
+  buildDedupIndex(&root, fatCopy(sysInfo, 0), dataRegion(sysInfo), sysInfo);
+  countClusters(fatCopy(sysInfo, 0), sysInfo);
+  sumDirectory(&root, 0, fatCopy(sysInfo, 0), dataRegion(sysInfo), sysInfo);
+  return 0;
+}
+
+/*
+ * "snapshot mount <name>": Build a read-only view of a snapshot in view.
+ * Return 0 on success, -1 if there is no such snapshot.
+ */
+int snapshotMount(char *name, BootSector *sysInfo, SnapshotView *view) {
+  Snapshot *s = findSnapshot(name, sysInfo);
+  if (s == NULL) {
+    printf("snapshot: %s does not exist.\n", name);
+    return -1;
+  }
+  u_int8_t *frozen = malloc(metadataSectors(sysInfo) * sysInfo->BytesPerSector);
+  materialize(s, frozen, sysInfo);
+  view->FAT = (u_int16_t*)frozen;
+  rootEntry(&view->root, sysInfo);
+  return 0;
+}
+
+void snapshotUnmount(SnapshotView *view) {
+  free(view->FAT);
+  view->FAT = NULL;
+}
@@ -0,0 +1,53 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "structs.h"
+
+/*
+ * Copy-on-write volume snapshots.
+ *
+ * A snapshot freezes the (FAT, remap, fill) tables.
+ * Creating one copies nothing and touches no reference count.
+ * The frozen metadata is preserved lazily, one sector at a time, just
+ * before the live tree first changes it. Sectors[i] is 0 while sector i
+ * is still identical in the live volume, otherwise the physical cluster
+ * holding the preserved copy. Sectors are numbered over the primary
+ * (FAT, remap, fill) copy.
+ *
+ * While a remap sector is shared, the live references on the clusters it
+ * names stand for the snapshot's too; isSharedCluster asks snapshotShares
+ * about them, so writes to those clusters go to private copies. Once the
+ * sector is preserved, the snapshot takes references of its own on what
+ * its copy names, so deleting it only touches the sectors it preserved.
+ *
+ * Directory clusters are written in place, so a command that changes a
+ * directory's entries must first call privatizeDirectory on it.
+ */
+#define MAX_SNAPSHOTS 8
+#define MAX_SNAPSHOT_NAME 15
+#define MAX_SNAPSHOT_SECTORS 256
+
+typedef struct Snapshot {
+  char Name[MAX_SNAPSHOT_NAME + 1]; // empty if the slot is free
+  u_int32_t Created; // seconds since the epoch
+  u_int16_t Sectors[MAX_SNAPSHOT_SECTORS];
+} Snapshot;
+
+//A read-only view of a snapshot. FAT is followed by its remap table.
+typedef struct SnapshotView {
+  u_int16_t *FAT;
+  FILE_t root;
+} SnapshotView;
+
+void snapshotPreserve(BootSector *sysInfo, u_int32_t sector);
+int snapshotShares(u_int16_t N, BootSector *sysInfo);
+int privatizeDirectory(FILE_t *dir, int recursive, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+
+void snapshotCreate(char *name, BootSector *sysInfo);
+void snapshotList(BootSector *sysInfo);
+void snapshotDelete(char *name, BootSector *sysInfo);
+int snapshotRollback(char *name, BootSector *sysInfo);
+int snapshotMount(char *name, BootSector *sysInfo, SnapshotView *view);
+void snapshotUnmount(SnapshotView *view);
+
+#endif
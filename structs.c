@@ -1,4 +1,13 @@
 #include"structs.h"
+#include <pthread.h>
+#include <fnmatch.h>
+#include "crc32c.h"
+#include "lz.h"
+#include "dedup.h"
+#include "dirindex.h"
+#include "snapshot.h"
+#include "walk.h"
+#include "backup.h"
 
 /*
  *
@@ -11,83 +20,1343 @@ int isRootDirectory(FILE_t *working_dir) {
   return working_dir->Attr == ATTR_VOLUME_ID;
 }
 
+u_int32_t clusterSize(BootSector *sysInfo) {
+  return sysInfo->SectorsPerCluster * sysInfo->BytesPerSector;
+}
+
+//Size of the volume, in sectors; large volumes keep it in LargeSectors.
+u_int32_t volumeSectors(BootSector *sysInfo) {
+  return sysInfo->TotalSectors ? sysInfo->TotalSectors : sysInfo->LargeSectors;
+}
+
+//Number of entries in the FAT, i.e. the number of chain nodes
+u_int32_t fatEntries(BootSector *sysInfo) {
+  return sysInfo->SectorsPerFAT * sysInfo->BytesPerSector / sizeof(u_int16_t);
+}
+
+static u_int8_t* sectorAddr(BootSector *sysInfo, u_int32_t sector) {
+  return (u_int8_t*)sysInfo + sector * sysInfo->BytesPerSector;
+}
+
+//Sectors of one (FAT, remap, fill) copy
+u_int32_t fatCopySectors(BootSector *sysInfo) {
+  return sysInfo->SectorsPerFAT + sysInfo->SectorsPerRemap + sysInfo->SectorsPerFill;
+}
+
+u_int16_t* fatCopy(BootSector *sysInfo, int copy) {
+  return (u_int16_t*)sectorAddr(sysInfo, sysInfo->ReservedSectors + copy * fatCopySectors(sysInfo));
+}
+
+u_int16_t* remapTable(u_int16_t *FAT, BootSector *sysInfo) {
+  return FAT + fatEntries(sysInfo);
+}
+
+u_int16_t* fillTable(u_int16_t *FAT, BootSector *sysInfo) {
+  return FAT + 2 * fatEntries(sysInfo);
+}
+
+u_int32_t* checksumTable(BootSector *sysInfo) {
+  return (u_int32_t*)fatCopy(sysInfo, sysInfo->FATCopies);
+}
+
+u_int16_t* refcountTable(BootSector *sysInfo) {
+  return (u_int16_t*)((u_int8_t*)checksumTable(sysInfo) + sysInfo->SectorsPerChecksum * sysInfo->BytesPerSector);
+}
+
+u_int8_t* snapshotTable(BootSector *sysInfo) {
+  return (u_int8_t*)refcountTable(sysInfo) + sysInfo->SectorsPerRefcount * sysInfo->BytesPerSector;
+}
+
+u_int8_t* checkpointTable(BootSector *sysInfo) {
+  return snapshotTable(sysInfo) + sysInfo->SectorsPerSnapshotTable * sysInfo->BytesPerSector;
+}
+
+u_int8_t* dataRegion(BootSector *sysInfo) {
+  return checkpointTable(sysInfo) + sysInfo->SectorsPerCheckpointTable * sysInfo->BytesPerSector;
+}
+
+/*
+ * Size the checksum, reference count, snapshot and checkpoint tables for a
+ * volume of at most clusters physical clusters. The FAT must be sized already.
+ */
+void sizeTables(BootSector *sysInfo, u_int32_t clusters) {
+  u_int32_t bps = sysInfo->BytesPerSector;
+  u_int32_t checksums = clusters + fatCopySectors(sysInfo);
+  sysInfo->SectorsPerChecksum = (checksums * sizeof(u_int32_t) + bps - 1) / bps;
+  sysInfo->SectorsPerRefcount = (clusters * sizeof(u_int16_t) + bps - 1) / bps;
+  sysInfo->SectorsPerSnapshotTable = (MAX_SNAPSHOTS * sizeof(Snapshot) + bps - 1) / bps;
+  sysInfo->SectorsPerCheckpointTable = checkpointTableSectors(sysInfo, clusters);
+}
+
+/*
+ * Return 0 if the tables sysInfo describes hold what they index and, with
+ * the part of the data region kept in the metadata image, fit in its
+ * sectors, -1 otherwise. Nothing past the boot sector is looked at.
+ */
+int checkGeometry(BootSector *sysInfo) {
+  u_int64_t bps = sysInfo->BytesPerSector;
+  u_int64_t clusters = sysInfo->ClusterCount;
+  if (bps < sizeof(BootSector) || (bps & (bps - 1)) != 0 || sysInfo->SectorsPerCluster == 0
+      || sysInfo->ReservedSectors == 0 || sysInfo->FATCopies == 0 || clusters == 0)
+    return -1;
+  if (sysInfo->SectorsPerFAT == 0 || sysInfo->SectorsPerRemap != sysInfo->SectorsPerFAT
+      || (sysInfo->SectorsPerFill != 0 && sysInfo->SectorsPerFill != sysInfo->SectorsPerFAT)
+      || sysInfo->RootCluster < 2 || sysInfo->RootCluster >= fatEntries(sysInfo))
+    return -1;
+  if ((sysInfo->SectorsPerChecksum != 0
+       && sysInfo->SectorsPerChecksum * bps < (clusters + fatCopySectors(sysInfo)) * sizeof(u_int32_t))
+      || sysInfo->SectorsPerRefcount * bps < clusters * sizeof(u_int16_t)
+      || (sysInfo->SectorsPerSnapshotTable != 0
+          && sysInfo->SectorsPerSnapshotTable * bps < MAX_SNAPSHOTS * sizeof(Snapshot))
+      || (sysInfo->SectorsPerCheckpointTable != 0
+          && sysInfo->SectorsPerCheckpointTable < checkpointTableSectors(sysInfo, clusters)))
+    return -1;
+  if (sysInfo->StripeImages > MAX_STRIPES || (sysInfo->StripeImages > 1 && sysInfo->StripeClusters == 0))
+    return -1;
+  if (sysInfo->StripeImages > 1)
+    clusters = (u_int64_t)stripeUnits(0, sysInfo) * sysInfo->StripeClusters;
+  u_int64_t sectors = trackedSectors(sysInfo) + sysInfo->SectorsPerCheckpointTable
+                      + clusters * sysInfo->SectorsPerCluster;
+  return sectors <= volumeSectors(sysInfo) ? 0 : -1;
+}
+
+/*
+ * The root directory is an ordinary directory chain starting at
+ * sysInfo->RootCluster. It has no entry of its own on disk, so fill in
+ * root to stand for it.
+ */
+void rootEntry(FILE_t *root, BootSector *sysInfo) {
+  memset(root, 0, sizeof(FILE_t));
+  root->Attr = ATTR_VOLUME_ID;
+  root->FirstClusterNo = sysInfo->RootCluster;
+}
+
+u_int16_t physicalCluster(u_int16_t N, u_int16_t *FAT, BootSector *sysInfo) {
+  return remapTable(FAT, sysInfo)[N];
+}
+
+int isHole(u_int16_t N, u_int16_t *FAT, BootSector *sysInfo) {
+  return physicalCluster(N, FAT, sysInfo) == 0;
+}
+
+static u_int8_t *stripes[MAX_STRIPES]; // data of each stripe image, stripes[0] is unused
+
+/*
+ * Give the data of stripe images 1 .. count-1. The data of the metadata
+ * image is passed to each call like in an unstriped volume.
+ */
+void setStripes(u_int8_t **data, u_int32_t count) {
+  memset(stripes, 0, sizeof(stripes));
+  for (u_int32_t i = 1; i < count && i < MAX_STRIPES; ++i)
+    stripes[i] = data[i];
+}
+
+//Image holding physical cluster P
+u_int32_t stripeOf(u_int16_t P, BootSector *sysInfo) {
+  if (sysInfo->StripeImages < 2)
+    return 0;
+  return (P - 2) / sysInfo->StripeClusters % sysInfo->StripeImages;
+}
+
+//Number of stripe units image holds
+u_int32_t stripeUnits(u_int32_t image, BootSector *sysInfo) {
+  u_int32_t units = (sysInfo->ClusterCount + sysInfo->StripeClusters - 1) / sysInfo->StripeClusters;
+  return (units + sysInfo->StripeImages - 1 - image) / sysInfo->StripeImages;
+}
+
+u_int8_t* physicalAddr(u_int16_t P, u_int8_t *data, BootSector *sysInfo) {
+  if (sysInfo->StripeImages < 2)
+    return data + (P - 2) * clusterSize(sysInfo);
+  u_int32_t unit = (P - 2) / sysInfo->StripeClusters;
+  u_int32_t image = unit % sysInfo->StripeImages;
+  u_int32_t slot = unit / sysInfo->StripeImages * sysInfo->StripeClusters + (P - 2) % sysInfo->StripeClusters;
+  return (image == 0 ? data : stripes[image]) + slot * clusterSize(sysInfo);
+}
+
+//Physical cluster holding addr, or 0 if addr is outside the data region.
+static u_int16_t physicalAt(u_int8_t *addr, u_int8_t *data, BootSector *sysInfo) {
+  u_int32_t size = clusterSize(sysInfo);
+  u_int32_t images = sysInfo->StripeImages < 2 ? 1 : sysInfo->StripeImages;
+  for (u_int32_t image = 0; image < images; ++image) {
+    u_int8_t *begin = image == 0 ? data : stripes[image];
+    u_int32_t clusters = images == 1 ? sysInfo->ClusterCount : stripeUnits(image, sysInfo) * sysInfo->StripeClusters;
+    if (addr < begin || addr >= begin + clusters * size)
+      continue;
+    u_int32_t slot = (addr - begin) / size;
+    if (images == 1)
+      return slot + 2;
+    u_int32_t unit = slot / sysInfo->StripeClusters * images + image;
+    u_int32_t P = unit * sysInfo->StripeClusters + slot % sysInfo->StripeClusters + 2;
+    return P < sysInfo->ClusterCount + 2u ? P : 0;
+  }
+  return 0;
+}
+
+u_int8_t* clusterAddr(u_int16_t N, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo) {
+  return physicalAddr(physicalCluster(N, FAT, sysInfo), data, sysInfo);
+}
+
+/*
+ * Number of bytes node N holds, if N is not the last node of its chain.
+ * A data node holds at most a cluster; a hole may cover up to 64K.
+ */
+u_int32_t nodeBytes(u_int16_t N, u_int16_t *FAT, BootSector *sysInfo) {
+  if (sysInfo->SectorsPerFill == 0 || fillTable(FAT, sysInfo)[N] == 0)
+    return clusterSize(sysInfo);
+  return fillTable(FAT, sysInfo)[N];
+}
+
+/*
+ * rm marks a chain by xoring DELETED_CLUSTER into each link. Return 1 if a
+ * FAT value is such a marked link rather than a live one.
+ */
+int isDeletedLink(u_int16_t value, BootSector *sysInfo) {
+  if (value == DELETED_END_OF_FILE)
+    return 1;
+  return value != END_OF_FILE && value != RESERVED_CLUSTER && value >= fatEntries(sysInfo)
+         && (value ^ DELETED_CLUSTER) < fatEntries(sysInfo);
+}
+
+static void updateFATChecksum(u_int16_t *FAT, BootSector *sysInfo, u_int32_t index) {
+  if (sysInfo->SectorsPerChecksum == 0)
+    return;
+  u_int32_t entriesPerSector = sysInfo->BytesPerSector / sizeof(u_int16_t);
+  u_int32_t sector = index / entriesPerSector;
+  u_int32_t *checksum = &checksumTable(sysInfo)[sysInfo->ClusterCount + sector];
+  *checksum = crc32c(0, FAT + sector * entriesPerSector, sysInfo->BytesPerSector);
+  metadataModified(checksum, sizeof(u_int32_t), sysInfo);
+}
+
+//Recompute the checksum of every sector of the primary (FAT, remap, fill) copy.
+void refreshFATChecksums(BootSector *sysInfo) {
+  u_int16_t *FAT = fatCopy(sysInfo, 0);
+  u_int32_t entriesPerSector = sysInfo->BytesPerSector / sizeof(u_int16_t);
+  for (u_int32_t s = 0; s < fatCopySectors(sysInfo); ++s)
+    updateFATChecksum(FAT, sysInfo, s * entriesPerSector);
+}
+
+/*
+ * Every change to a (FAT, remap, fill) copy goes through here so the mirror
+ * copies and the checksum of the touched sector stay in step with the
+ * primary copy, snapshots still sharing that sector get their own copy first,
+ * and checkpoints see the sector change.
+ */
+static void writeTableEntry(u_int16_t *FAT, BootSector *sysInfo, u_int32_t index, u_int16_t value) {
+  snapshotPreserve(sysInfo, index / (sysInfo->BytesPerSector / sizeof(u_int16_t)));
+  FAT[index] = value;
+  for (int i = 1; i < sysInfo->FATCopies; ++i)
+    fatCopy(sysInfo, i)[index] = value;
+  for (int i = 0; i < sysInfo->FATCopies; ++i)
+    metadataModified(&fatCopy(sysInfo, i)[index], sizeof(u_int16_t), sysInfo);
+  updateFATChecksum(FAT, sysInfo, index);
+}
+
+static ClusterCounts counts;
+
+//Adjust counts for a node whose FAT entry is value by sign.
+static void countNode(u_int16_t value, int sign, BootSector *sysInfo) {
+  if (value == FREE_CLUSTER || value == RESERVED_CLUSTER)
+    return;
+  if (isDeletedLink(value, sysInfo))
+    counts.deleted += sign;
+  else
+    counts.used += sign;
+}
+
+/*
+ * Recount the nodes in use and held by deleted files, and the physical
+ * clusters in use. writeFAT, allocPhysical and releasePhysical keep the
+ * counts up to date afterwards. Reservations are not on disk and stay.
+ */
+void countClusters(u_int16_t *FAT, BootSector *sysInfo) {
+  u_int32_t reserved = counts.reserved;
+  memset(&counts, 0, sizeof(counts));
+  counts.reserved = reserved;
+  for (u_int32_t N = 2; N < fatEntries(sysInfo); ++N)
+    countNode(FAT[N], 1, sysInfo);
+  u_int16_t *refcount = refcountTable(sysInfo);
+  for (u_int32_t P = 2; P < sysInfo->ClusterCount + 2u; ++P)
+    counts.physical += refcount[P - 2] != 0;
+}
+
+const ClusterCounts* clusterCounts(void) {
+  return &counts;
+}
+
+/*
+ * Set clusters free physical clusters aside for data that has not been
+ * placed yet. Other allocations can not take them until they are given
+ * back with unreserveClusters. Return -1 if not that many are free.
+ */
+int reserveClusters(u_int32_t clusters, BootSector *sysInfo) {
+  if (counts.physical + counts.reserved + clusters > sysInfo->ClusterCount)
+    return -1;
+  counts.reserved += clusters;
+  return 0;
+}
+
+void unreserveClusters(u_int32_t clusters) {
+  counts.reserved -= clusters < counts.reserved ? clusters : counts.reserved;
+}
+
+void writeFAT(u_int16_t *FAT, BootSector *sysInfo, u_int16_t N, u_int16_t value) {
+  countNode(FAT[N], -1, sysInfo);
+  countNode(value, 1, sysInfo);
+  writeTableEntry(FAT, sysInfo, N, value);
+}
+
+/*
+ * writeFAT for count nodes at once. Every FAT sector they touch is
+ * preserved for snapshots and checksummed once instead of once per node.
+ */
+void writeFATBatch(u_int16_t *FAT, BootSector *sysInfo, const u_int16_t *nodes, const u_int16_t *values,
+                   u_int32_t count) {
+  u_int32_t entriesPerSector = sysInfo->BytesPerSector / sizeof(u_int16_t);
+  u_int8_t *touched = calloc(sysInfo->SectorsPerFAT, 1);
+  for (u_int32_t i = 0; i < count; ++i) {
+    u_int32_t sector = nodes[i] / entriesPerSector;
+    if (!touched[sector]) {
+      touched[sector] = 1;
+      snapshotPreserve(sysInfo, sector);
+    }
+  }
+  for (u_int32_t i = 0; i < count; ++i) {
+    countNode(FAT[nodes[i]], -1, sysInfo);
+    countNode(values[i], 1, sysInfo);
+    for (int k = 0; k < sysInfo->FATCopies; ++k) {
+      fatCopy(sysInfo, k)[nodes[i]] = values[i];
+      metadataModified(&fatCopy(sysInfo, k)[nodes[i]], sizeof(u_int16_t), sysInfo);
+    }
+  }
+  for (u_int32_t s = 0; s < sysInfo->SectorsPerFAT; ++s) {
+    if (touched[s])
+      updateFATChecksum(FAT, sysInfo, s * entriesPerSector);
+  }
+  free(touched);
+}
+
+//Point node N at physical cluster P, in every copy of the remap table.
+void writeRemap(u_int16_t *FAT, BootSector *sysInfo, u_int16_t N, u_int16_t P) {
+  writeTableEntry(FAT, sysInfo, fatEntries(sysInfo) + N, P);
+}
+
+//Record that node N's cluster holds bytes bytes, 0 for a full cluster.
+void writeFill(u_int16_t *FAT, BootSector *sysInfo, u_int16_t N, u_int16_t bytes) {
+  if (sysInfo->SectorsPerFill == 0 || fillTable(FAT, sysInfo)[N] == bytes)
+    return;
+  writeTableEntry(FAT, sysInfo, 2 * fatEntries(sysInfo) + N, bytes);
+}
+
+void setNodeBytes(u_int16_t N, u_int32_t bytes, u_int16_t *FAT, BootSector *sysInfo) {
+  writeFill(FAT, sysInfo, N, bytes == clusterSize(sysInfo) ? 0 : bytes);
+}
+
+/*
+ * Find an unreferenced physical cluster and take a reference to it. With
+ * meta set, clusters on the metadata image are preferred.
+ * Return 0 if every physical cluster is in use or reserved.
+ */
+static u_int16_t findPhysical(u_int16_t *FAT, BootSector *sysInfo, int meta) {
+  u_int16_t *refcount = refcountTable(sysInfo);
+  if (counts.physical + counts.reserved >= sysInfo->ClusterCount)
+    return 0;
+  for (u_int32_t P = 2; P < sysInfo->ClusterCount + 2u; ++P) {
+    if (refcount[P - 2] == 0 && (!meta || stripeOf(P, sysInfo) == 0)) {
+      refcount[P - 2] = 1;
+      metadataModified(&refcount[P - 2], sizeof(u_int16_t), sysInfo);
+      ++counts.physical;
+      return P;
+    }
+  }
+  return meta && sysInfo->StripeImages > 1 ? findPhysical(FAT, sysInfo, 0) : 0;
+}
+
+u_int16_t allocPhysical(u_int16_t *FAT, BootSector *sysInfo) {
+  return findPhysical(FAT, sysInfo, 0);
+}
+
+//allocPhysical for directories and other metadata, which stay on the metadata image.
+u_int16_t allocMetaPhysical(u_int16_t *FAT, BootSector *sysInfo) {
+  return findPhysical(FAT, sysInfo, 1);
+}
+
+//Take another reference to physical cluster P, which is in use.
+void addReference(u_int16_t P, BootSector *sysInfo) {
+  u_int16_t *refcount = refcountTable(sysInfo);
+  ++refcount[P - 2];
+  metadataModified(&refcount[P - 2], sizeof(u_int16_t), sysInfo);
+}
+
+/*
+ * Return 1 if the physical cluster of live node N is used by more than N:
+ * by other nodes, or by a snapshot still sharing N's remap entry.
+ */
+int isSharedCluster(u_int16_t N, u_int16_t *FAT, BootSector *sysInfo) {
+  return refcountTable(sysInfo)[physicalCluster(N, FAT, sysInfo) - 2] > 1 || snapshotShares(N, sysInfo);
+}
+
+void releasePhysical(u_int16_t P, BootSector *sysInfo) {
+  u_int16_t *refcount = refcountTable(sysInfo);
+  if (P == 0 || refcount[P - 2] == 0)
+    return;
+  metadataModified(&refcount[P - 2], sizeof(u_int16_t), sysInfo);
+  if (--refcount[P - 2] == 0) {
+    --counts.physical;
+    dedupRemove(P);
+  }
+}
+
+/*
+ * Return node N to the free pool along with its reference on its physical cluster.
+ */
+void freeCluster(u_int16_t N, u_int16_t *FAT, BootSector *sysInfo) {
+  u_int16_t P = physicalCluster(N, FAT, sysInfo);
+  writeRemap(FAT, sysInfo, N, 0); // a snapshot sharing the entry takes its reference first
+  releasePhysical(P, sysInfo);
+  writeFill(FAT, sysInfo, N, 0);
+  writeFAT(FAT, sysInfo, N, FREE_CLUSTER);
+}
+
+/*
+ * Space held by deleted files is only given back once the volume runs out:
+ * free every node whose link is marked deleted. Their files can no longer
+ * be undeleted afterwards.
+ */
+static void reclaimDeleted(u_int16_t *FAT, BootSector *sysInfo) {
+  for (u_int32_t N = 2; N < fatEntries(sysInfo); ++N) {
+    if (isDeletedLink(FAT[N], sysInfo))
+      freeCluster(N, FAT, sysInfo);
+  }
+}
+
+//findPhysical, reclaiming deleted chains if the volume is full.
+static u_int16_t allocData(u_int16_t *FAT, BootSector *sysInfo, int meta) {
+  u_int16_t P = findPhysical(FAT, sysInfo, meta);
+  if (P == 0) {
+    reclaimDeleted(FAT, sysInfo);
+    P = findPhysical(FAT, sysInfo, meta);
+  }
+  return P;
+}
+
+/*
+ * Find a free node, back it with a fresh physical cluster and mark it as
+ * the end of a chain. Return 0 if the data region is full.
+ */
+static u_int16_t allocNode(u_int16_t *FAT, BootSector *sysInfo, int meta) {
+  u_int16_t P = allocData(FAT, sysInfo, meta);
+  if (P == 0)
+    return 0;
+  for (u_int32_t N = 2; N < fatEntries(sysInfo); ++N) {
+    if (FAT[N] == FREE_CLUSTER) {
+      writeRemap(FAT, sysInfo, N, P);
+      writeFAT(FAT, sysInfo, N, END_OF_FILE);
+      return N;
+    }
+  }
+  releasePhysical(P, sysInfo);
+  return 0;
+}
+
+u_int16_t allocCluster(u_int16_t *FAT, BootSector *sysInfo) {
+  return allocNode(FAT, sysInfo, 0);
+}
+
+//allocCluster for directory clusters, which stay on the metadata image.
+u_int16_t allocDirCluster(u_int16_t *FAT, BootSector *sysInfo) {
+  return allocNode(FAT, sysInfo, 1);
+}
+
+/*
+ * Find a free node and make it a hole of bytes bytes at the end of a chain.
+ * A hole has no physical cluster and reads as zeros.
+ * Return 0 if there is no free node.
+ */
+u_int16_t allocHole(u_int16_t *FAT, BootSector *sysInfo, u_int32_t bytes) {
+  for (u_int32_t N = 2; N < fatEntries(sysInfo); ++N) {
+    if (FAT[N] == FREE_CLUSTER) {
+      writeFAT(FAT, sysInfo, N, END_OF_FILE);
+      setNodeBytes(N, bytes, FAT, sysInfo);
+      return N;
+    }
+  }
+  return 0;
+}
+
+//First of count consecutive entries of table[0, entries) that are 0, from 2 on, or 0 if there are none.
+static u_int32_t findFreeRun(u_int16_t *table, u_int32_t entries, u_int32_t count) {
+  u_int32_t run = 0;
+  for (u_int32_t i = 2; i < entries; ++i) {
+    run = table[i] == 0 ? run + 1 : 0;
+    if (run == count)
+      return i + 1 - count;
+  }
+  return 0;
+}
+
+/*
+ * Allocate a chain of count nodes with consecutive numbers, backed by
+ * consecutive physical clusters, so it reads back as one sequential run.
+ * Return its first node, or 0 if the volume has no such run free.
+ */
+static u_int16_t allocExtent(u_int32_t count, u_int16_t *FAT, BootSector *sysInfo) {
+  if (count == 0 || counts.physical + counts.reserved + count > sysInfo->ClusterCount)
+    return 0;
+  u_int16_t *refcount = refcountTable(sysInfo);
+  u_int32_t P = findFreeRun(refcount - 2, sysInfo->ClusterCount + 2, count);
+  u_int32_t N = findFreeRun(FAT, fatEntries(sysInfo), count);
+  if (P == 0 || N == 0)
+    return 0;
+  // the whole run is taken first: preserving a table sector for a snapshot allocates too
+  for (u_int32_t i = 0; i < count; ++i) {
+    refcount[P + i - 2] = 1;
+    metadataModified(&refcount[P + i - 2], sizeof(u_int16_t), sysInfo);
+  }
+  counts.physical += count;
+  for (u_int32_t i = 0; i < count; ++i) {
+    writeRemap(FAT, sysInfo, N + i, P + i);
+    writeFAT(FAT, sysInfo, N + i, i + 1 < count ? N + i + 1 : END_OF_FILE);
+  }
+  return N;
+}
+
+/*
+ * Refresh the checksum of physical cluster P after its contents have been
+ * written, and mark it changed for incremental backups.
+ */
+void physicalModified(u_int16_t P, u_int8_t *data, BootSector *sysInfo) {
+  markDirtyCluster(P, sysInfo);
+  if (sysInfo->SectorsPerChecksum == 0)
+    return;
+  checksumTable(sysInfo)[P - 2] = crc32c(0, physicalAddr(P, data, sysInfo), clusterSize(sysInfo));
+  metadataModified(&checksumTable(sysInfo)[P - 2], sizeof(u_int32_t), sysInfo);
+}
+
+//physicalModified for a cluster whose checksum is known to be crc.
+static void physicalWritten(u_int16_t P, u_int32_t crc, BootSector *sysInfo) {
+  markDirtyCluster(P, sysInfo);
+  if (sysInfo->SectorsPerChecksum == 0)
+    return;
+  checksumTable(sysInfo)[P - 2] = crc;
+  metadataModified(&checksumTable(sysInfo)[P - 2], sizeof(u_int32_t), sysInfo);
+}
+
+void clusterModified(u_int16_t N, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo) {
+  physicalModified(physicalCluster(N, FAT, sysInfo), data, sysInfo);
+}
+
+/*
+ * Refresh the checksum of the directory cluster holding entry.
+ * Entries outside the data region, such as the root's own, have none.
+ */
+void entryModified(void *entry, u_int8_t *data, BootSector *sysInfo) {
+  u_int16_t P = physicalAt((u_int8_t*)entry, data, sysInfo);
+  if (P != 0)
+    physicalModified(P, data, sysInfo);
+}
+
+/*
+ * Return 1 if physical cluster P matches its stored checksum, 0 otherwise.
+ */
+int verifyPhysical(u_int16_t P, u_int8_t *data, BootSector *sysInfo) {
+  if (sysInfo->SectorsPerChecksum == 0)
+    return 1;
+  return checksumTable(sysInfo)[P - 2] == crc32c(0, physicalAddr(P, data, sysInfo), clusterSize(sysInfo));
+}
+
+int verifyCluster(u_int16_t N, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo) {
+  return verifyPhysical(physicalCluster(N, FAT, sysInfo), data, sysInfo);
+}
+
 int isEmpty(FILE_t *f, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo) {
   u_int16_t clustNo = f->FirstClusterNo;
   do {
-    u_int8_t *begin = data + (clustNo - 2) * sysInfo->SectorsPerCluster * sysInfo->BytesPerSector + 2 * FILE_ENTRY_SIZE;
-    u_int8_t *end = begin + sysInfo->SectorsPerCluster * sysInfo->BytesPerSector;
+    u_int8_t *begin = clusterAddr(clustNo, FAT, data, sysInfo) + RESERVED_DIRECTORY_REGION_SIZE;
+    u_int8_t *end = clusterAddr(clustNo, FAT, data, sysInfo) + clusterSize(sysInfo);
     while (begin != end) {
       FILE_t *f = (FILE_t *) begin;
-      if (f->Filename[0] != DIRECTORY_NOT_USED) {
+      if (f->Filename[0] == DIRECTORY_NOT_USED)
+        return 1;
+      if (!(f->Attr & ATTR_DELETED) && (f->Attr & ATTR_LONE_FILE_NAME) != ATTR_LONE_FILE_NAME)
         return 0;
+      begin += FILE_ENTRY_SIZE;
+    }
+    clustNo = FAT[clustNo]; // search in next cluster
+  } while (clustNo != END_OF_FILE);
+  return 1;
+}
+
+u_int32_t chainLength(u_int16_t cluster, u_int16_t *FAT) {
+  u_int32_t count = 0;
+  if (cluster == 0)
+    return 0;
+  do {
+    ++count;
+    cluster = FAT[cluster];
+  } while (cluster != END_OF_FILE);
+  return count;
+}
+
+typedef struct StripeRead {
+  u_int16_t N;
+  u_int32_t offset; // in N's cluster
+  u_int32_t n;
+  u_int8_t *out;
+} StripeRead;
+
+typedef struct StripeTask {
+  u_int16_t *FAT;
+  u_int8_t *data;
+  BootSector *sysInfo;
+  StripeRead *reads;
+  u_int32_t count;
+  u_int32_t image; // only reads from this image are done
+  u_int32_t bad; // first read failing its checksum, count if none
+} StripeTask;
+
+static void* readStripe(void *arg) {
+  StripeTask *task = (StripeTask*)arg;
+  task->bad = task->count;
+  for (u_int32_t i = 0; i < task->count; ++i) {
+    StripeRead *r = &task->reads[i];
+    if (stripeOf(physicalCluster(r->N, task->FAT, task->sysInfo), task->sysInfo) != task->image)
+      continue;
+    if (!verifyCluster(r->N, task->FAT, task->data, task->sysInfo)) {
+      task->bad = i;
+      break;
+    }
+    memcpy(r->out, clusterAddr(r->N, task->FAT, task->data, task->sysInfo) + r->offset, r->n);
+  }
+  return NULL;
+}
+
+/*
+ * chainRead of a range spanning every image of a striped volume: collect
+ * the cluster reads, then do the ones on each image in a thread of its own
+ * so the images are read in parallel.
+ */
+static int chainReadStriped(u_int16_t N, u_int32_t offset, u_int8_t *out, u_int32_t len,
+                            u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  u_int32_t count = 0, capacity = len / clusterSize(sysInfo) + 2;
+  StripeRead *reads = malloc(capacity * sizeof(StripeRead));
+  while (len > 0) {
+    if (N == 0 || N == END_OF_FILE) {
+      free(reads);
+      return -1;
+    }
+    u_int32_t bytes = nodeBytes(N, FAT, sysInfo);
+    u_int32_t n = bytes - offset < len ? bytes - offset : len;
+    if (isHole(N, FAT, sysInfo)) {
+      memset(out, 0, n);
+    }
+    else {
+      if (count == capacity) {
+        capacity *= 2;
+        reads = realloc(reads, capacity * sizeof(StripeRead));
+      }
+      reads[count].N = N;
+      reads[count].offset = offset;
+      reads[count].n = n;
+      reads[count].out = out;
+      ++count;
+    }
+    out += n;
+    len -= n;
+    offset = 0;
+    N = FAT[N];
+  }
+
+  u_int32_t images = sysInfo->StripeImages;
+  StripeTask tasks[MAX_STRIPES];
+  pthread_t tids[MAX_STRIPES];
+  for (u_int32_t i = 0; i < images; ++i) {
+    tasks[i].FAT = FAT;
+    tasks[i].data = data;
+    tasks[i].sysInfo = sysInfo;
+    tasks[i].reads = reads;
+    tasks[i].count = count;
+    tasks[i].image = i;
+    if (i > 0)
+      pthread_create(&tids[i], NULL, readStripe, &tasks[i]);
+  }
+  readStripe(&tasks[0]);
+
+  u_int32_t bad = count;
+  for (u_int32_t i = 0; i < images; ++i) {
+    if (i > 0)
+      pthread_join(tids[i], NULL);
+    if (tasks[i].bad < bad)
+      bad = tasks[i].bad;
+  }
+  int result = bad < count ? reads[bad].N : 0;
+  free(reads);
+  return result;
+}
+
+/*
+ * Copy len bytes starting at byte offset of the chain beginning at first
+ * into buf, verifying the checksum of every cluster read. Holes read as zeros.
+ * Return 0 on success, the number of a cluster that fails its checksum,
+ * or -1 if the chain ends before offset + len.
+ */
+int chainRead(u_int16_t first, u_int32_t offset, void *buf, u_int32_t len,
+              u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  u_int8_t *out = (u_int8_t*)buf;
+  u_int16_t N = first;
+  if (len == 0)
+    return 0;
+  while (N != 0 && N != END_OF_FILE && offset >= nodeBytes(N, FAT, sysInfo)) {
+    offset -= nodeBytes(N, FAT, sysInfo);
+    N = FAT[N];
+  }
+  if (sysInfo->StripeImages > 1
+      && len >= sysInfo->StripeImages * sysInfo->StripeClusters * clusterSize(sysInfo))
+    return chainReadStriped(N, offset, out, len, FAT, data, sysInfo);
+  while (len > 0) {
+    if (N == 0 || N == END_OF_FILE)
+      return -1;
+    u_int32_t bytes = nodeBytes(N, FAT, sysInfo);
+    u_int32_t n = bytes - offset < len ? bytes - offset : len;
+    if (isHole(N, FAT, sysInfo)) {
+      memset(out, 0, n);
+    }
+    else {
+      if (!verifyCluster(N, FAT, data, sysInfo))
+        return N;
+      memcpy(out, clusterAddr(N, FAT, data, sysInfo) + offset, n);
+    }
+    out += n;
+    len -= n;
+    offset = 0;
+    N = FAT[N];
+  }
+  return 0;
+}
+
+/*
+ * Store n bytes at byte at of node N's cluster. A whole-cluster write whose
+ * contents already exist elsewhere just remaps N onto that cluster; a write
+ * to a cluster other nodes share goes to a private copy first.
+ * Return 0 on success, -1 if the volume ran out of clusters.
+ */
+static int writeCluster(u_int16_t N, u_int32_t at, const u_int8_t *in, u_int32_t n,
+                        u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  u_int32_t size = clusterSize(sysInfo);
+  u_int16_t P = physicalCluster(N, FAT, sysInfo);
+
+  if (n == size) {
+    u_int32_t crc = crc32c(0, in, size);
+    u_int16_t Q = dedupFind(crc, in, size, P, data, sysInfo);
+    if (Q != 0) {
+      addReference(Q, sysInfo);
+      writeRemap(FAT, sysInfo, N, Q);
+      releasePhysical(P, sysInfo);
+      return 0;
+    }
+  }
+  if (isSharedCluster(N, FAT, sysInfo)) {
+    u_int16_t Q = allocPhysical(FAT, sysInfo);
+    if (Q == 0)
+      return -1;
+    if (n < size)
+      memcpy(physicalAddr(Q, data, sysInfo), physicalAddr(P, data, sysInfo), size);
+    writeRemap(FAT, sysInfo, N, Q);
+    releasePhysical(P, sysInfo);
+    P = Q;
+  }
+  memcpy(physicalAddr(P, data, sysInfo) + at, in, n);
+  physicalModified(P, data, sysInfo);
+  dedupInsert(P, checksumTable(sysInfo)[P - 2]);
+  return 0;
+}
+
+/*
+ * Give the cluster-sized piece of hole N holding *offset a zeroed physical
+ * cluster, splitting what comes before and after it into holes of their own.
+ * Return the node now holding *offset, with *offset made relative to it,
+ * or 0 if the volume ran out of space.
+ */
+static u_int16_t fillHole(u_int16_t N, u_int32_t *offset, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  u_int32_t size = clusterSize(sysInfo);
+  u_int32_t bytes = nodeBytes(N, FAT, sysInfo);
+  u_int32_t before = *offset / size * size;
+  u_int32_t len = bytes - before < size ? bytes - before : size;
+  u_int32_t after = bytes - before - len;
+
+  u_int16_t H = after ? allocHole(FAT, sysInfo, after) : 0;
+  u_int16_t D = before ? allocHole(FAT, sysInfo, len) : N;
+  u_int16_t P = allocData(FAT, sysInfo, 0);
+  if ((after && !H) || !D || !P) {
+    if (H)
+      freeCluster(H, FAT, sysInfo);
+    if (D && D != N)
+      freeCluster(D, FAT, sysInfo);
+    releasePhysical(P, sysInfo);
+    return 0;
+  }
+  if (H) {
+    writeFAT(FAT, sysInfo, H, FAT[N]);
+    writeFAT(FAT, sysInfo, N, H);
+  }
+  if (D != N) {
+    writeFAT(FAT, sysInfo, D, FAT[N]);
+    writeFAT(FAT, sysInfo, N, D);
+    setNodeBytes(N, before, FAT, sysInfo);
+    *offset -= before;
+  }
+  memset(physicalAddr(P, data, sysInfo), 0, size);
+  physicalModified(P, data, sysInfo);
+  writeRemap(FAT, sysInfo, D, P);
+  setNodeBytes(D, FAT[D] == END_OF_FILE ? size : len, FAT, sysInfo);
+  return D;
+}
+
+typedef struct StripeWrite {
+  u_int16_t N;
+  u_int16_t prev; // node in front of N in the chain, 0 if N is the first
+  u_int16_t P;    // physical cluster the bytes go to, 0 if N shares one holding them already
+  int fresh;      // N was added to the chain by this write and has no physical cluster yet
+  u_int32_t at;   // in N's cluster
+  u_int32_t n;
+  const u_int8_t *in;
+  u_int32_t crc;  // of in if it fills the cluster, else of the cluster once written
+  u_int32_t next; // 1 + the previous write placed in the same bucket, 0 if there is none
+} StripeWrite;
+
+typedef struct StripeWriteTask {
+  u_int8_t *data;
+  BootSector *sysInfo;
+  StripeWrite *writes;
+  u_int32_t count;
+  u_int32_t image;
+  u_int32_t images;
+} StripeWriteTask;
+
+//Checksum the bytes of every images-th write that fills its cluster.
+static void* hashStripe(void *arg) {
+  StripeWriteTask *task = (StripeWriteTask*)arg;
+  u_int32_t size = clusterSize(task->sysInfo);
+  for (u_int32_t i = task->image; i < task->count; i += task->images) {
+    if (task->writes[i].n == size)
+      task->writes[i].crc = crc32c(0, task->writes[i].in, size);
+  }
+  return NULL;
+}
+
+//Do the writes going to this image, checksumming the clusters they only partly fill.
+static void* writeStripe(void *arg) {
+  StripeWriteTask *task = (StripeWriteTask*)arg;
+  u_int32_t size = clusterSize(task->sysInfo);
+  for (u_int32_t i = 0; i < task->count; ++i) {
+    StripeWrite *w = &task->writes[i];
+    if (w->P == 0 || stripeOf(w->P, task->sysInfo) != task->image)
+      continue;
+    u_int8_t *cluster = physicalAddr(w->P, task->data, task->sysInfo);
+    memcpy(cluster + w->at, w->in, w->n);
+    if (w->n < size)
+      w->crc = crc32c(0, cluster, size);
+  }
+  return NULL;
+}
+
+static void runStripeTasks(void* (*run)(void*), StripeWriteTask *tasks, u_int32_t images) {
+  pthread_t tids[MAX_STRIPES];
+  for (u_int32_t i = 1; i < images; ++i)
+    pthread_create(&tids[i], NULL, run, &tasks[i]);
+  run(&tasks[0]);
+  for (u_int32_t i = 1; i < images; ++i)
+    pthread_join(tids[i], NULL);
+}
+
+/*
+ * Walk the chain at *first like chainWrite, adding the nodes it needs, and
+ * collect the part of buf that goes to each of them in writes. Nodes added
+ * for bytes to go to are left without a physical cluster until it is known
+ * whether one holding the same bytes exists.
+ * Return 0, or -1 if the volume ran out of nodes; *count writes are collected either way.
+ */
+static int collectWrites(u_int16_t *first, u_int32_t offset, const u_int8_t *in, u_int32_t len,
+                         StripeWrite **writes, u_int32_t *count,
+                         u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  u_int32_t size = clusterSize(sysInfo);
+  u_int32_t capacity = len / size + 2;
+  u_int16_t prev = 0, N = *first;
+  *writes = malloc(capacity * sizeof(StripeWrite));
+  *count = 0;
+  while (len > 0) {
+    int fresh = 0;
+    if (N == 0 || N == END_OF_FILE) {
+      fresh = offset < size;
+      N = fresh ? allocHole(FAT, sysInfo, size) : 0;
+      if (N == 0) {
+        fresh = 0;
+        N = allocCluster(FAT, sysInfo);
+      }
+      if (N == 0)
+        return -1;
+      if (prev == 0)
+        *first = N;
+      else
+        writeFAT(FAT, sysInfo, prev, N);
+    }
+    u_int32_t bytes = nodeBytes(N, FAT, sysInfo);
+    if (!fresh && offset < bytes && isHole(N, FAT, sysInfo)) {
+      N = fillHole(N, &offset, FAT, data, sysInfo);
+      if (N == 0)
+        return -1;
+      bytes = nodeBytes(N, FAT, sysInfo);
+    }
+    if (offset < bytes) {
+      u_int32_t n = bytes - offset < len ? bytes - offset : len;
+      if (*count == capacity) {
+        capacity *= 2;
+        *writes = realloc(*writes, capacity * sizeof(StripeWrite));
+      }
+      StripeWrite *w = &(*writes)[(*count)++];
+      memset(w, 0, sizeof(StripeWrite));
+      w->N = N;
+      w->prev = prev;
+      w->fresh = fresh;
+      w->at = offset;
+      w->n = n;
+      w->in = in;
+      in += n;
+      len -= n;
+      offset = 0;
+    }
+    else {
+      offset -= bytes;
+    }
+    prev = N;
+    N = FAT[N];
+  }
+  return 0;
+}
+
+/*
+ * Decide which physical cluster writes[i] goes to, as writeCluster would:
+ * onto a cluster already holding its bytes, into a private copy of a shared
+ * one, into a new one for a fresh node, or in place. Writes placed before
+ * it count as done, though their bytes are only copied later; the ones
+ * filling a cluster are kept in bucket by checksum for that.
+ * Return 0 on success, -1 if the volume ran out of clusters.
+ */
+static int placeWrite(StripeWrite *writes, u_int32_t i, u_int32_t *bucket, u_int32_t mask,
+                      u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  u_int32_t size = clusterSize(sysInfo);
+  StripeWrite *w = &writes[i];
+  u_int16_t P = physicalCluster(w->N, FAT, sysInfo);
+
+  if (w->n == size) {
+    u_int16_t Q = dedupFind(w->crc, w->in, size, P, data, sysInfo);
+    for (u_int32_t j = bucket[w->crc & mask]; Q == 0 && j != 0; j = writes[j - 1].next) {
+      StripeWrite *v = &writes[j - 1];
+      if (v->crc == w->crc && v->P != P && memcmp(v->in, w->in, size) == 0)
+        Q = v->P;
+    }
+    if (Q != 0) {
+      addReference(Q, sysInfo);
+      writeRemap(FAT, sysInfo, w->N, Q);
+      releasePhysical(P, sysInfo);
+      return 0;
+    }
+  }
+  if (w->fresh || isSharedCluster(w->N, FAT, sysInfo)) {
+    u_int16_t Q = w->fresh ? allocData(FAT, sysInfo, 0) : allocPhysical(FAT, sysInfo);
+    if (Q == 0)
+      return -1;
+    if (!w->fresh && w->n < size)
+      memcpy(physicalAddr(Q, data, sysInfo), physicalAddr(P, data, sysInfo), size);
+    writeRemap(FAT, sysInfo, w->N, Q);
+    releasePhysical(P, sysInfo);
+    P = Q;
+  }
+  else {
+    dedupRemove(P); // what it holds is about to change
+  }
+  w->P = P;
+  if (w->n == size) {
+    w->next = bucket[w->crc & mask];
+    bucket[w->crc & mask] = i + 1;
+  }
+  return 0;
+}
+
+/*
+ * Take the fresh nodes from writes[from] on, which got no physical
+ * cluster, back out of the chain at *first, ending it in front of them.
+ */
+static void dropFresh(u_int16_t *first, u_int16_t start, StripeWrite *writes, u_int32_t from, u_int32_t count,
+                      u_int16_t *FAT, BootSector *sysInfo)
+{
+  while (from < count && !writes[from].fresh)
+    ++from;
+  if (from == count)
+    return;
+  if (writes[from].prev == 0)
+    *first = start;
+  else
+    writeFAT(FAT, sysInfo, writes[from].prev, END_OF_FILE);
+  for (u_int16_t N = writes[from].N; N != END_OF_FILE; ) {
+    u_int16_t next = FAT[N];
+    freeCluster(N, FAT, sysInfo);
+    N = next;
+  }
+}
+
+/*
+ * chainWrite of a range spanning every image of a striped volume. Nodes and
+ * physical clusters are allocated and remapped in order, then the bytes for
+ * each image are copied and checksummed in a thread of its own, as are the
+ * checksums of the input that finding shared clusters needs.
+ */
+static int chainWriteStriped(u_int16_t *first, u_int32_t offset, const u_int8_t *in, u_int32_t len,
+                             u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  u_int16_t start = *first;
+  StripeWrite *writes;
+  u_int32_t count;
+  int err = collectWrites(first, offset, in, len, &writes, &count, FAT, data, sysInfo);
+
+  u_int32_t images = sysInfo->StripeImages;
+  StripeWriteTask tasks[MAX_STRIPES];
+  for (u_int32_t i = 0; i < images; ++i) {
+    tasks[i].data = data;
+    tasks[i].sysInfo = sysInfo;
+    tasks[i].writes = writes;
+    tasks[i].count = count;
+    tasks[i].image = i;
+    tasks[i].images = images;
+  }
+  runStripeTasks(hashStripe, tasks, images);
+
+  u_int32_t buckets = 64;
+  while (buckets < count)
+    buckets *= 2;
+  u_int32_t *bucket = calloc(buckets, sizeof(u_int32_t));
+  u_int32_t placed = 0;
+  while (placed < count && placeWrite(writes, placed, bucket, buckets - 1, FAT, data, sysInfo) == 0)
+    ++placed;
+  free(bucket);
+  if (placed < count) {
+    dropFresh(first, start, writes, placed, count, FAT, sysInfo);
+    err = -1;
+  }
+
+  for (u_int32_t i = 0; i < images; ++i)
+    tasks[i].count = placed;
+  runStripeTasks(writeStripe, tasks, images);
+  for (u_int32_t i = 0; i < placed; ++i) {
+    if (writes[i].P == 0)
+      continue;
+    physicalWritten(writes[i].P, writes[i].crc, sysInfo);
+    dedupInsert(writes[i].P, checksumTable(sysInfo)[writes[i].P - 2]);
+  }
+  free(writes);
+  return err;
+}
+
+/*
+ * Copy len bytes from buf to byte offset of the chain beginning at *first,
+ * extending the chain as needed. *first may be 0 for an empty chain.
+ * Return 0 on success, -1 if the volume ran out of clusters.
+ */
+int chainWrite(u_int16_t *first, u_int32_t offset, const void *buf, u_int32_t len,
+               u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  const u_int8_t *in = (const u_int8_t*)buf;
+  u_int16_t prev = 0, N = *first;
+  if (sysInfo->StripeImages > 1
+      && len >= sysInfo->StripeImages * sysInfo->StripeClusters * clusterSize(sysInfo))
+    return chainWriteStriped(first, offset, in, len, FAT, data, sysInfo);
+  while (len > 0) {
+    if (N == 0 || N == END_OF_FILE) {
+      N = allocCluster(FAT, sysInfo);
+      if (N == 0)
+        return -1;
+      if (prev == 0)
+        *first = N;
+      else
+        writeFAT(FAT, sysInfo, prev, N);
+    }
+    u_int32_t bytes = nodeBytes(N, FAT, sysInfo);
+    if (offset < bytes && isHole(N, FAT, sysInfo)) {
+      N = fillHole(N, &offset, FAT, data, sysInfo);
+      if (N == 0)
+        return -1;
+      bytes = nodeBytes(N, FAT, sysInfo);
+    }
+    if (offset < bytes) {
+      u_int32_t n = bytes - offset < len ? bytes - offset : len;
+      if (writeCluster(N, offset, in, n, FAT, data, sysInfo) != 0)
+        return -1;
+      in += n;
+      len -= n;
+      offset = 0;
+    }
+    else {
+      offset -= bytes;
+    }
+    prev = N;
+    N = FAT[N];
+  }
+  return 0;
+}
+
+/*
+ * Keep the first clusters clusters of the chain at *first and free the rest.
+ */
+void chainTruncate(u_int16_t *first, u_int32_t clusters, u_int16_t *FAT, BootSector *sysInfo) {
+  u_int16_t N = *first;
+  if (N == 0)
+    return;
+  if (clusters == 0) {
+    *first = 0;
+  }
+  else {
+    for (u_int32_t i = 1; i < clusters; ++i) {
+      N = FAT[N];
+      if (N == END_OF_FILE)
+        return;
+    }
+    u_int16_t next = FAT[N];
+    if (next == END_OF_FILE)
+      return;
+    writeFAT(FAT, sysInfo, N, END_OF_FILE);
+    if (!isHole(N, FAT, sysInfo))
+      writeFill(FAT, sysInfo, N, 0); // the size of the last cluster follows the file size
+    N = next;
+  }
+  while (N != END_OF_FILE) {
+    u_int16_t next = FAT[N];
+    freeCluster(N, FAT, sysInfo);
+    N = next;
+  }
+}
+
+//Return how many nodes of the chain at first hold its first len bytes.
+static u_int32_t chainNodes(u_int16_t first, u_int32_t len, u_int16_t *FAT, BootSector *sysInfo) {
+  u_int32_t count = 0;
+  for (u_int16_t N = first; len > 0 && N != 0 && N != END_OF_FILE; N = FAT[N]) {
+    u_int32_t bytes = nodeBytes(N, FAT, sysInfo);
+    len -= bytes < len ? bytes : len;
+    ++count;
+  }
+  return count;
+}
+
+/*
+ * Cut len bytes at byte offset out of the chain at *first, which holds
+ * total bytes. Clusters wholly inside the range are unlinked and freed;
+ * only the clusters holding the ends of the range are rewritten, with
+ * their remaining bytes moved to the front and their fill updated.
+ * Return 0 on success, -1 if the volume ran out of clusters.
+ */
+int chainRemove(u_int16_t *first, u_int32_t offset, u_int32_t len, u_int32_t total,
+                u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  u_int8_t tail[clusterSize(sysInfo)];
+  u_int16_t prev = 0, N = *first;
+  u_int32_t rest = total; // bytes from the start of N to the end of the chain
+  while (len > 0 && N != 0 && N != END_OF_FILE) {
+    u_int16_t next = FAT[N];
+    u_int32_t used = next == END_OF_FILE ? rest : nodeBytes(N, FAT, sysInfo);
+    if (offset >= used) {
+      offset -= used;
+    }
+    else {
+      u_int32_t cut = used - offset < len ? used - offset : len;
+      u_int32_t keep = used - cut;
+      if (keep == 0 && !(prev == 0 && next == END_OF_FILE)) {
+        if (prev == 0)
+          *first = next;
+        else
+          writeFAT(FAT, sysInfo, prev, next);
+        if (next == END_OF_FILE && !isHole(prev, FAT, sysInfo))
+          writeFill(FAT, sysInfo, prev, 0);
+        freeCluster(N, FAT, sysInfo);
+        N = prev;
       }
-      begin += FILE_ENTRY_SIZE;
+      else {
+        u_int32_t moved = used - offset - cut;
+        if (isHole(N, FAT, sysInfo)) {
+          setNodeBytes(N, keep, FAT, sysInfo);
+        }
+        else {
+          if (moved > 0) {
+            memcpy(tail, clusterAddr(N, FAT, data, sysInfo) + offset + cut, moved);
+            if (writeCluster(N, offset, tail, moved, FAT, data, sysInfo) != 0)
+              return -1;
+          }
+          if (next != END_OF_FILE)
+            setNodeBytes(N, keep, FAT, sysInfo);
+        }
+      }
+      len -= cut;
+      offset = 0;
     }
-    clustNo = FAT[clustNo]; // search in next cluster
-  } while (clustNo != END_OF_FILE);
+    rest -= used;
+    prev = N;
+    N = next;
+  }
+  return 0;
+}
+
+//Mark every cluster of a chain as deleted, keeping the links for undelete.
+void deleteChain(u_int16_t cluster, u_int16_t *FAT, BootSector *sysInfo) {
+  if (cluster == 0)
+    return;
+  do {
+    u_int16_t next = FAT[cluster];
+    writeFAT(FAT, sysInfo, cluster, FAT[cluster] ^ DELETED_CLUSTER);
+    cluster = next;
+  } while (cluster != END_OF_FILE);
+}
+
+//Return 1 if every link of the chain starting at cluster is still marked deleted.
+int chainDeleted(u_int16_t cluster, u_int16_t *FAT, BootSector *sysInfo) {
+  while (cluster != 0 && cluster != END_OF_FILE) {
+    if (!isDeletedLink(FAT[cluster], sysInfo))
+      return 0;
+    cluster = FAT[cluster] ^ DELETED_CLUSTER;
+  }
   return 1;
 }
 
+void restoreChain(u_int16_t cluster, u_int16_t *FAT, BootSector *sysInfo) {
+  if (cluster == 0)
+    return;
+  dirIndexForget(cluster);
+  do {
+    writeFAT(FAT, sysInfo, cluster, FAT[cluster] ^ DELETED_CLUSTER);
+    cluster = FAT[cluster];
+  } while (cluster != END_OF_FILE);
+}
+
+/*
+ * Set up a freshly allocated directory cluster: the first two entries are
+ * reserved and every other one is free.
+ */
+static void initDirectoryCluster(u_int16_t N, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo) {
+  u_int8_t *begin = clusterAddr(N, FAT, data, sysInfo);
+  u_int8_t *end = begin + clusterSize(sysInfo);
+  memset(begin, 0, clusterSize(sysInfo));
+  for (begin += RESERVED_DIRECTORY_REGION_SIZE; begin != end; begin += FILE_ENTRY_SIZE)
+    ((FILE_t*)begin)->Filename[0] = DIRECTORY_NOT_USED;
+  clusterModified(N, FAT, data, sysInfo);
+}
+
 /*
- * return file entry with filename
+ * return file entry with filename, preferring a live entry to a deleted one
  * if file not found, return first empty entry
+ * Directories of the live volume are looked up in the directory index.
  */
 FILE_t* searchFile(FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo, char *filename) {
-  if (isRootDirectory(working_dir)) {
-    u_int8_t *begin = (u_int8_t*)(working_dir + 1); // skip the reserved entry in Root
-    u_int8_t *end = data;
-    while (begin != end) {
-      FILE_t *f = (FILE_t*)begin;
-      begin += FILE_ENTRY_SIZE;
-      if (f->Filename[0] == DIRECTORY_NOT_USED)
-        return f;
-      if (strcmp(f->Filename, filename) == 0) {
-        return f;
-      }
-    }
-    return NULL;
+  static FILE_t notFound; // stands in for the empty entry of a full directory
+  if (FAT == fatCopy(sysInfo, 0) && filename[0] != '\0') {
+    FILE_t *f = dirIndexSearch(working_dir, filename, FAT, data, sysInfo);
+    if (f != NULL)
+      return f;
   }
   else {
+    FILE_t *deleted = NULL;
     u_int16_t clusterNo = working_dir->FirstClusterNo;
     do {
-      u_int8_t *begin = data + (clusterNo - 2) * sysInfo->SectorsPerCluster * sysInfo->BytesPerSector
+      u_int8_t *begin = clusterAddr(clusterNo, FAT, data, sysInfo)
                         + RESERVED_DIRECTORY_REGION_SIZE;
-      u_int8_t *end = begin + sysInfo->SectorsPerCluster * sysInfo->BytesPerSector;
+      u_int8_t *end = clusterAddr(clusterNo, FAT, data, sysInfo) + clusterSize(sysInfo);
       while (begin != end) {
         FILE_t *f = (FILE_t *) begin;
         begin += FILE_ENTRY_SIZE;
         if (f->Filename[0] == DIRECTORY_NOT_USED)
-          return f;
-        if (strcmp(f->Filename, filename) == 0)
-          return f;
+          return deleted ? deleted : f;
+        if (strcmp(f->Filename, filename) == 0) {
+          if (!(f->Attr & ATTR_DELETED))
+            return f;
+          if (deleted == NULL)
+            deleted = f;
+        }
       }
       clusterNo = FAT[clusterNo]; // search in next cluster
     } while (clusterNo != END_OF_FILE);
-    return NULL;
+    if (deleted)
+      return deleted;
   }
+  memset(&notFound, 0, sizeof(notFound));
+  notFound.Filename[0] = DIRECTORY_NOT_USED;
+  return &notFound;
+}
+
+//Number of directory entries filename takes: its LFN entries and the SFN.
+int entriesForName(char *filename) {
+  int len = strlen(filename);
+  if (len <= MAX_LEN_OF_SFN)
+    return 1;
+  return ((len % 10 == 0) ? len / 10 : len / 10 + 1) + 1;
 }
 
 /*
- * Initialize fields in File_t
- * Note: Assume the remaining memory region in current cluster can hold all LFN entries
- * 1. Find a free cluster
- * 2. Initialize that cluster
- * 3. Bind cluster number to File_t->FirstClusterNo
+ * Return the first of count free entries in one cluster of dir, past every
+ * entry in use, and set *node to the node of that cluster. Free entries
+ * mark the end of a directory, so the ones left at the end of a cluster
+ * too short for count are padded with deleted entries, and the chain grows
+ * by a cluster when dir is full. The directory index says where to start.
+ * Return NULL if the volume ran out of space.
  */
-void initFileEntry(u_int8_t *working_dir,
-                   u_int8_t *fp,
-                   char *filename,
-                   u_int16_t *FAT,
-                   u_int8_t *dataRegion,
-                   BootSector *sysInfo,
-                   int isDir)
+static FILE_t* dirFreeEntry(FILE_t *dir, int count, u_int16_t *node, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo) {
+  u_int16_t clusterNo, last;
+  dirIndexEnd(dir, &clusterNo, &last, FAT, data, sysInfo);
+  if (clusterNo == 0)
+    clusterNo = END_OF_FILE;
+  for (; clusterNo != END_OF_FILE; last = clusterNo, clusterNo = FAT[clusterNo]) {
+    u_int8_t *begin = clusterAddr(clusterNo, FAT, data, sysInfo) + RESERVED_DIRECTORY_REGION_SIZE;
+    u_int8_t *end = clusterAddr(clusterNo, FAT, data, sysInfo) + clusterSize(sysInfo);
+    while (begin != end && ((FILE_t*)begin)->Filename[0] != DIRECTORY_NOT_USED)
+      begin += FILE_ENTRY_SIZE;
+    if (begin == end)
+      continue;
+    if (begin + count * FILE_ENTRY_SIZE <= end) {
+      *node = clusterNo;
+      return (FILE_t*)begin;
+    }
+    u_int32_t slot = (FILE_t*)begin - (FILE_t*)clusterAddr(clusterNo, FAT, data, sysInfo);
+    for (; begin != end; begin += FILE_ENTRY_SIZE) {
+      memset(begin, 0, FILE_ENTRY_SIZE);
+      ((FILE_t*)begin)->Attr = ATTR_DELETED;
+    }
+    clusterModified(clusterNo, FAT, data, sysInfo);
+    dirIndexAdd(dir, clusterNo, slot, clusterSize(sysInfo) / FILE_ENTRY_SIZE - slot, FAT, data, sysInfo);
+  }
+
+  u_int16_t N = allocDirCluster(FAT, sysInfo);
+  if (N == 0)
+    return NULL;
+  initDirectoryCluster(N, FAT, data, sysInfo);
+  writeFAT(FAT, sysInfo, last, N);
+  *node = N;
+  return (FILE_t*)(clusterAddr(N, FAT, data, sysInfo) + RESERVED_DIRECTORY_REGION_SIZE);
+}
+
+/*
+ * Write the entries naming filename at fp, which must have room for
+ * entriesForName(filename) of them: its LFN entries, if the name is too
+ * long for a short entry, then the short entry, which is returned.
+ */
+FILE_t* nameEntries(u_int8_t *fp, char *filename)
 {
   FILE_t *f = NULL;
 
+  memset(fp, 0, entriesForName(filename) * FILE_ENTRY_SIZE);
+
   if (strlen(filename) > MAX_LEN_OF_SFN) {
     //Each LFN can represent up to 13 chars.
-    int len = strlen(filename);
-    int counts = (len % 10 == 0) ? len / 10 :  len / 10 + 1;
+    int counts = entriesForName(filename) - 1;
 
     f = (FILE_t*)fp + counts;
     f->Attr |= ATTR_ARCHIEVE; // indicate this entry is a SFN associated with LFN
@@ -108,17 +1377,116 @@ void initFileEntry(u_int8_t *working_dir,
     f = (FILE_t*)fp;
     memcpy(f->Filename, filename, strlen(filename));
   }
+  return f;
+}
+
+//Address of byte i of the content of a file with INLINE_SLOTS.
+static u_int8_t* inlineByte(FILE_t *f, u_int32_t i) {
+  InlineSlot *slot = (InlineSlot*)(f + 1) + i / INLINE_SLOT_BYTES;
+  i %= INLINE_SLOT_BYTES;
+  return i < sizeof(slot->Data1) ? slot->Data1 + i : slot->Data2 + (i - sizeof(slot->Data1));
+}
+
+/*
+ * Make len bytes of buf the whole content of f, which must have
+ * INLINE_SLOTS and len at most MAX_INLINE_SIZE. The caller frees any
+ * cluster chain f had.
+ */
+void writeInline(FILE_t *f, const void *buf, u_int32_t len)
+{
+  InlineSlot *slot = (InlineSlot*)(f + 1);
+  memset(slot, 0, MAX_INLINE_SLOTS * sizeof(InlineSlot));
+  for (int i = 0; i < MAX_INLINE_SLOTS; ++i) {
+    slot[i].Marker = INLINE_SLOT_MARKER;
+    slot[i].Attr = ATTR_LONE_FILE_NAME;
+  }
+  for (u_int32_t i = 0; i < len; ++i)
+    *inlineByte(f, i) = ((const u_int8_t*)buf)[i];
+  f->Flags |= INLINE_DATA;
+  f->FirstClusterNo = 0;
+  f->FileSize = len;
+}
+
+static void readInline(FILE_t *f, u_int32_t start, u_int32_t end, u_int8_t *buf) {
+  for (u_int32_t i = start; i < end; ++i)
+    *buf++ = *inlineByte(f, i);
+}
+
+/*
+ * Move the content of an inline file to a cluster chain of its own, so it
+ * can grow past MAX_INLINE_SIZE or take holes. Its slots stay, unused.
+ * Return 0 on success, -1 if the volume ran out of space.
+ */
+static int moveInline(FILE_t *f, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo) {
+  u_int8_t buf[MAX_INLINE_SIZE];
+  u_int16_t N = allocCluster(FAT, sysInfo);
+  if (N == 0)
+    return -1;
+  readInline(f, 0, f->FileSize, buf);
+  if (chainWrite(&N, 0, buf, f->FileSize, FAT, data, sysInfo) != 0) {
+    chainTruncate(&N, 0, FAT, sysInfo);
+    return -1;
+  }
+  f->Flags &= ~INLINE_DATA;
+  f->FirstClusterNo = N;
+  return 0;
+}
+
+/*
+ * Give an inline file the content of bytes [0, size) of its current one
+ * with len bytes of buf written at offset, zero filling any gap, if that
+ * still fits in its slots. Otherwise, and for a file that is not inline,
+ * leave the change to the caller, moving f to a cluster chain first.
+ * Return 0 on success, -1 if the volume ran out of space.
+ */
+static int updateInline(FILE_t *f, u_int32_t size, u_int32_t offset, const void *buf, u_int32_t len,
+                        u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  if (!(f->Flags & INLINE_DATA))
+    return 0;
+  if (offset + len > size)
+    size = offset + len;
+  if (size > MAX_INLINE_SIZE)
+    return moveInline(f, FAT, data, sysInfo);
+  u_int8_t content[MAX_INLINE_SIZE];
+  memset(content, 0, size);
+  readInline(f, 0, f->FileSize < size ? f->FileSize : size, content);
+  if (len > 0)
+    memcpy(content + offset, buf, len);
+  writeInline(f, content, size);
+  return 0;
+}
 
-  u_int16_t N = 2;
-  while (FAT[N] != FREE_CLUSTER)
-    ++N;
-  FAT[N] = END_OF_FILE;
+/*
+ * Initialize fields in File_t
+ * Note: fp must be followed by room for all LFN entries
+ * 1. Find a free cluster
+ * 2. Initialize that cluster
+ * 3. Bind cluster number to File_t->FirstClusterNo
+ * Return the new entry, or NULL if there is no free cluster left.
+ */
+FILE_t* initFileEntry(u_int8_t *working_dir,
+                      u_int8_t *fp,
+                      char *filename,
+                      u_int16_t *FAT,
+                      u_int8_t *dataRegion,
+                      BootSector *sysInfo,
+                      int isDir)
+{
+  FILE_t *f = NULL;
 
+  u_int16_t N = isDir ? allocDirCluster(FAT, sysInfo) : allocCluster(FAT, sysInfo);
+  if (N == 0) {
+    printf("%s: no space left on device\n", filename);
+    return NULL;
+  }
+  f = nameEntries(fp, filename);
   f->FirstClusterNo = N;
 
   if (isDir) {
     f->Attr ^= ATTR_DIRECTORY;
-    u_int8_t *dir = dataRegion + (N - 2) * sysInfo->SectorsPerCluster * sysInfo->BytesPerSector;
+    initDirectoryCluster(N, FAT, dataRegion, sysInfo);
+    u_int8_t *dir = clusterAddr(N, FAT, dataRegion, sysInfo);
 
     SoftLink *point = (SoftLink*)dir;
     strcpy(point->Filename, ".");
@@ -127,101 +1495,107 @@ void initFileEntry(u_int8_t *working_dir,
     SoftLink *point_point = (SoftLink*)(dir + FILE_ENTRY_SIZE);
     strcpy(point_point, "..");
     point_point->fp = (FILE_t*)working_dir;
+    clusterModified(N, FAT, dataRegion, sysInfo);
   }
+  entryModified(f, dataRegion, sysInfo);
+  return f;
 }
 
 
 /*
- * create a file or directory in current working directory
- * @param isDir - 0 file, 1 directory
+ * Create a file or directory in working_dir. With inlined set, the file
+ * gets inline slots and starts out empty with no cluster chain.
  */
-FILE_t* createFile(FILE_t *working_dir,
-                   u_int16_t *FAT,
-                   u_int8_t *data,
-                   BootSector *sysInfo,
-                   char *filename,
-                   int isDir)
+static FILE_t* createEntry(FILE_t *working_dir,
+                           u_int16_t *FAT,
+                           u_int8_t *data,
+                           BootSector *sysInfo,
+                           char *filename,
+                           int isDir,
+                           int inlined)
 {
   if (strlen(filename) > MAX_LEN_OF_LFN || strlen(filename) == 0)
   {
     printf("%s", "Length of filename must be within range from 1 to 255");
     return NULL;
   }
-  if (isRootDirectory(working_dir)) {
-    u_int8_t *begin = (u_int8_t*)(working_dir + 1); // skip the reserved entry in Root
-    u_int8_t *end = data;
-    while (begin != end) {
-      FILE_t *f = (FILE_t*)begin;
-      if (f->Filename[0] == DIRECTORY_NOT_USED) {
-        initFileEntry(working_dir, begin, filename, FAT, data, sysInfo, isDir);
-        return f;
-      }
-      else if (strcmp(f->Filename, filename) == 0 && !(f->Attr & ATTR_DELETED)){
-        printf("File %s Already Exists\n", filename);
-        return NULL;
-      }
-      begin += FILE_ENTRY_SIZE;
-    }
-
+  int count = entriesForName(filename) + (inlined ? MAX_INLINE_SLOTS : 0);
+  if (count * FILE_ENTRY_SIZE > clusterSize(sysInfo) - RESERVED_DIRECTORY_REGION_SIZE) {
+    printf("%s: name does not fit in a directory cluster\n", filename);
     return NULL;
   }
-  else {
-    u_int16_t clusterNo = working_dir->FirstClusterNo;
-    do {
-      u_int8_t *begin = data + (clusterNo - 2) * sysInfo->SectorsPerCluster * sysInfo->BytesPerSector;
-      u_int8_t *end = begin + sysInfo->SectorsPerCluster * sysInfo->BytesPerSector;
-      while (begin != end) {
-        FILE_t *f = (FILE_t *) begin;
-        if (f->Filename[0] == DIRECTORY_NOT_USED) {
-          initFileEntry(working_dir, begin, filename, FAT, data, sysInfo, isDir);
-          return f;
-        }
-        else if (strcmp(f->Filename, filename) == 0) {
-          printf("File %s Already Exists\n", filename);
-          return NULL;
-        }
-        begin += FILE_ENTRY_SIZE;
-      }
-      clusterNo = FAT[clusterNo]; // search in next cluster
-    } while (clusterNo != END_OF_FILE);
-
+  FILE_t *f = searchFile(working_dir, FAT, data, sysInfo, filename);
+  if (f->Filename[0] != DIRECTORY_NOT_USED && !(f->Attr & ATTR_DELETED)) {
+    printf("File %s Already Exists\n", filename);
+    return NULL;
+  }
+  u_int16_t node;
+  f = dirFreeEntry(working_dir, count, &node, FAT, data, sysInfo);
+  if (f == NULL) {
+    printf("%s: no space left on device\n", filename);
     return NULL;
   }
+  u_int32_t slot = f - (FILE_t*)clusterAddr(node, FAT, data, sysInfo);
+  if (!inlined) {
+    f = initFileEntry((u_int8_t*)working_dir, (u_int8_t*)f, filename, FAT, data, sysInfo, isDir);
+    if (f != NULL && isDir)
+      dirIndexForget(f->FirstClusterNo); // in case its cluster last started another directory
+    dirIndexAdd(working_dir, node, slot, f != NULL ? count : 0, FAT, data, sysInfo);
+    return f;
+  }
+  f = nameEntries((u_int8_t*)f, filename);
+  f->Flags = INLINE_SLOTS;
+  writeInline(f, NULL, 0);
+  entryModified(f, data, sysInfo);
+  dirIndexAdd(working_dir, node, slot, count, FAT, data, sysInfo);
+  return f;
+}
+
+/*
+ * create a file or directory in current working directory
+ * @param isDir - 0 file, 1 directory
+ */
+FILE_t* createFile(FILE_t *working_dir,
+                   u_int16_t *FAT,
+                   u_int8_t *data,
+                   BootSector *sysInfo,
+                   char *filename,
+                   int isDir)
+{
+  return createEntry(working_dir, FAT, data, sysInfo, filename, isDir, 0);
+}
+
+//One entry of ls; the long format gives the logical and allocated size.
+static void lsEntry(FILE_t *f, int longFormat, u_int16_t *FAT, BootSector *sysInfo) {
+  if (!longFormat)
+    printf("%s\t", f->Filename);
+  else if (f->Attr & ATTR_DIRECTORY)
+    printf("%-12.11s %10s %10u\n", f->Filename, "<DIR>", allocatedSize(f, FAT, sysInfo));
+  else
+    printf("%-12.11s %10u %10u\n", f->Filename, f->FileSize, allocatedSize(f, FAT, sysInfo));
 }
 
-void ls(FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo) {
-  printf(".\t..\t");
-  if (isRootDirectory(working_dir)) {
-    u_int8_t *begin = (u_int8_t*)(working_dir + 1); // skip the reserved entry in Root
-    u_int8_t *end = data;
+void ls(FILE_t *working_dir, int longFormat, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo) {
+  if (longFormat)
+    printf("%-12s %10s %10s\n", "name", "size", "allocated");
+  else
+    printf(".\t..\t");
+  u_int16_t clusterNo = working_dir->FirstClusterNo;
+  do {
+    u_int8_t *begin = clusterAddr(clusterNo, FAT, data, sysInfo)
+                      + RESERVED_DIRECTORY_REGION_SIZE;
+    u_int8_t *end = clusterAddr(clusterNo, FAT, data, sysInfo) + clusterSize(sysInfo);
     while (begin != end) {
       FILE_t *f = (FILE_t *) begin;
       begin += FILE_ENTRY_SIZE;
-      if (f->Attr & ATTR_DELETED)
-        continue;
       if (f->Filename[0] == DIRECTORY_NOT_USED)
         break;
-      printf("%s\t", f->Filename);
+      if (f->Attr & ATTR_DELETED || (f->Attr & ATTR_LONE_FILE_NAME) == ATTR_LONE_FILE_NAME)
+        continue;
+      lsEntry(f, longFormat, FAT, sysInfo);
     }
-  }
-  else {
-    u_int16_t clusterNo = working_dir->FirstClusterNo;
-    do {
-      u_int8_t *begin = data + (clusterNo - 2) * sysInfo->SectorsPerCluster * sysInfo->BytesPerSector
-                        + RESERVED_DIRECTORY_REGION_SIZE;
-      u_int8_t *end = begin + sysInfo->SectorsPerCluster * sysInfo->BytesPerSector;
-      while (begin != end) {
-        FILE_t *f = (FILE_t *) begin;
-        begin += FILE_ENTRY_SIZE;
-        if (f->Attr & ATTR_DELETED)
-          continue;
-        if (f->Filename[0] == DIRECTORY_NOT_USED)
-          break;
-        printf("%s\t", f->Filename);
-      }
-      clusterNo = FAT[clusterNo]; // find in next sector
-    } while (clusterNo != END_OF_FILE);
-  }
+    clusterNo = FAT[clusterNo]; // find in next sector
+  } while (clusterNo != END_OF_FILE);
 }
 
 FILE_t* cd(FILE_t *working_dir,
@@ -230,20 +1604,9 @@ FILE_t* cd(FILE_t *working_dir,
              BootSector *sysInfo,
              char *dir_name)
 {
-  if (isRootDirectory(working_dir)) {
-    if (strcmp(dir_name, ".") == 0 || strcmp(dir_name, "..") == 0)
-      return working_dir;
-  }
-  else {
-    u_int16_t clusterNo = working_dir->FirstClusterNo;
-    if (strcmp(dir_name, ".") == 0)
-      return working_dir;
-    if (strcmp(dir_name, "..") == 0) {
-      FILE_t *dir_content = (FILE_t*)(data + (clusterNo - 2) * sysInfo->SectorsPerCluster * sysInfo->BytesPerSector);
-      ++dir_content;
-      return ((SoftLink*)dir_content)->fp;
-    }
-  }
+  // ".." is resolved by the caller, which keeps the path from the root
+  if (strcmp(dir_name, ".") == 0 || strcmp(dir_name, "..") == 0)
+    return working_dir;
 
   FILE_t *dir = searchFile(working_dir, FAT, data, sysInfo, dir_name);
   if (dir == NULL || dir->Attr & ATTR_DELETED) {
@@ -257,61 +1620,50 @@ FILE_t* cd(FILE_t *working_dir,
   return dir;
 }
 
-void pwd(FILE_t *working_dir, u_int8_t *data, BootSector *sysInfo)
+/*
+ * path[0] is the root directory and path[depth] the working directory.
+ */
+void pwd(FILE_t **path, int depth)
 {
-  if (isRootDirectory(working_dir)) {
-    printf("/");
-    return;
-  }
-  FILE_t *dir_content = (FILE_t*)(data + (working_dir->FirstClusterNo - 2) * sysInfo->SectorsPerCluster * sysInfo->BytesPerSector);
-  ++dir_content;
-  pwd(((SoftLink*)dir_content)->fp, data, sysInfo);
-  printf("%s/", working_dir->Filename);
+  printf("/");
+  for (int i = 1; i <= depth; ++i)
+    printf("%s/", path[i]->Filename);
+}
+
+static void deleteFileChains(FILE_t *f, u_int16_t *FAT, BootSector *sysInfo) {
+  deleteChain(f->FirstClusterNo, FAT, sysInfo);
+  if (f->Attr & ATTR_COMPRESSED)
+    deleteChain(f->FstCLusHI, FAT, sysInfo);
 }
 
+static void rmEnter(WalkTask *task, void *ctx) {
+  walkDeleteChain(task, task->dir->FirstClusterNo, ((TreeWalk*)ctx)->FAT);
+}
+
+static void rmVisit(FILE_t *f, WalkTask *task, void *ctx) {
+  u_int16_t *FAT = ((TreeWalk*)ctx)->FAT;
+  if (f->Attr & ATTR_DIRECTORY)
+    return; // its own task deletes its chain
+  walkDeleteChain(task, f->FirstClusterNo, FAT);
+  if (f->Attr & ATTR_COMPRESSED)
+    walkDeleteChain(task, f->FstCLusHI, FAT);
+}
 
+/*
+ * "rm -rf": Mark file deleted along with the chains of everything below
+ * it. The entries below keep their state, so only file itself needs to be
+ * undeleted to find them again. Directories are walked in parallel and
+ * their chains deleted in one batch afterwards.
+ */
 void rm_rf(FILE_t *file, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo) {
   file->Attr ^= ATTR_DELETED;
-  u_int16_t clusterNo = file->FirstClusterNo;
-  do {
-    if (file->Attr & ATTR_DIRECTORY) {
-      u_int8_t *begin = data + (clusterNo - 2) * sysInfo->SectorsPerCluster * sysInfo->BytesPerSector
-                        + RESERVED_DIRECTORY_REGION_SIZE;
-      u_int8_t *end = data + (clusterNo - 1) * sysInfo->SectorsPerCluster * sysInfo->BytesPerSector;
-      while (begin != end) {
-        FILE_t *f = (FILE_t *) begin;
-        begin += FILE_ENTRY_SIZE;
-        if (f->Filename[0] == DIRECTORY_NOT_USED)
-          return;
-        if (f->Attr & ATTR_HIDDEN || f->Attr & ATTR_DELETED)
-          continue;
-        if (!(f->Attr & ATTR_DIRECTORY)) { // remove file
-          u_int16_t cluster = f->FirstClusterNo;
-          do {
-            u_int16_t next = FAT[cluster];
-            FAT[cluster] ^= DELETED_CLUSTER;
-            cluster = next;
-          } while (cluster != END_OF_FILE);
-        }
-        else { // remove directory
-          if (isEmpty(f, FAT, data, sysInfo)) {
-            u_int16_t cluster = f->FirstClusterNo;
-            do {
-              u_int16_t next = FAT[cluster];
-              FAT[cluster] ^= DELETED_CLUSTER;
-              cluster = next;
-            } while (cluster != END_OF_FILE);
-          } else {
-            rm_rf(f, FAT, data, sysInfo);
-            f->Attr ^= ATTR_DELETED;
-          }
-        }
-      }
-    }
-    u_int16_t next = FAT[clusterNo];
-    FAT[clusterNo] ^= DELETED_CLUSTER;
-    clusterNo = next;
-  } while (clusterNo != END_OF_FILE);
+  entryModified(file, data, sysInfo);
+  if (!(file->Attr & ATTR_DIRECTORY)) {
+    deleteFileChains(file, FAT, sysInfo);
+    return;
+  }
+  TreeWalk walk = { FAT, data, sysInfo, rmEnter, rmVisit, NULL, &walk };
+  treeWalk(file, "", &walk);
 }
 
 void rm_dir(FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo, char *dir_name) {
@@ -329,12 +1681,33 @@ void rm_dir(FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sys
     return;
   }
   dir->Attr ^= ATTR_DELETED;
-  u_int16_t cluster = dir->FirstClusterNo;
-  do {
-    u_int16_t next = FAT[cluster];
-    FAT[cluster] ^= DELETED_CLUSTER;
-    cluster = next;
-  } while(cluster != END_OF_FILE);
+  entryModified(dir, data, sysInfo);
+  deleteChain(dir->FirstClusterNo, FAT, sysInfo);
+}
+
+typedef struct RestoreWalk {
+  u_int16_t *FAT;
+  u_int8_t *data;
+  BootSector *sysInfo;
+} RestoreWalk;
+
+/*
+ * Restore the chains rm -rf deleted below an undeleted directory. An entry
+ * whose space has been reused since is marked deleted instead.
+ */
+static void restoreEntry(FILE_t *f, void *arg) {
+  RestoreWalk *walk = (RestoreWalk*)arg;
+  if (!chainDeleted(f->FirstClusterNo, walk->FAT, walk->sysInfo)
+      || ((f->Attr & ATTR_COMPRESSED) && !chainDeleted(f->FstCLusHI, walk->FAT, walk->sysInfo))) {
+    f->Attr ^= ATTR_DELETED;
+    entryModified(f, walk->data, walk->sysInfo);
+    return;
+  }
+  restoreChain(f->FirstClusterNo, walk->FAT, walk->sysInfo);
+  if (f->Attr & ATTR_COMPRESSED)
+    restoreChain(f->FstCLusHI, walk->FAT, walk->sysInfo);
+  if (f->Attr & ATTR_DIRECTORY && privatizeDirectory(f, 0, walk->FAT, walk->data, walk->sysInfo) == 0)
+    forEachEntry(f, walk->FAT, walk->data, walk->sysInfo, restoreEntry, walk);
 }
 
 void undeleteFile(FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo, char *filename) {
@@ -347,12 +1720,118 @@ void undeleteFile(FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSecto
     printf("undelete: %s have not been deleted yet.\n", filename);
     return;
   }
-  f->Attr ^= ATTR_DELETED;
-  u_int16_t clusterNo = f->FirstClusterNo;
-  do {
-    FAT[clusterNo] ^= DELETED_CLUSTER;
-    clusterNo = FAT[clusterNo];
-  } while (clusterNo != END_OF_FILE);
+  if (!chainDeleted(f->FirstClusterNo, FAT, sysInfo)
+      || ((f->Attr & ATTR_COMPRESSED) && !chainDeleted(f->FstCLusHI, FAT, sysInfo))) {
+    printf("undelete: %s can not be recovered, its space has been reused.\n", filename);
+    return;
+  }
+  f->Attr ^= ATTR_DELETED;
+  entryModified(f, data, sysInfo);
+  restoreChain(f->FirstClusterNo, FAT, sysInfo);
+  if (f->Attr & ATTR_COMPRESSED)
+    restoreChain(f->FstCLusHI, FAT, sysInfo);
+  if (f->Attr & ATTR_DIRECTORY && privatizeDirectory(f, 0, FAT, data, sysInfo) == 0) {
+    RestoreWalk walk = { FAT, data, sysInfo };
+    forEachEntry(f, FAT, data, sysInfo, restoreEntry, &walk);
+  }
+}
+
+static int readCompressed(FILE_t *f, u_int32_t start, u_int32_t end, u_int8_t *buf,
+                          u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  u_int8_t raw[COMPRESSION_CHUNK_SIZE], packed[COMPRESSION_CHUNK_SIZE];
+  for (u_int32_t k = start / COMPRESSION_CHUNK_SIZE; k * COMPRESSION_CHUNK_SIZE < end; ++k) {
+    ChunkEntry e;
+    int bad = chainRead(f->FstCLusHI, k * sizeof(e), &e, sizeof(e), FAT, data, sysInfo);
+    if (bad == 0)
+      bad = chainRead(f->FirstClusterNo, e.Offset, packed, e.Length, FAT, data, sysInfo);
+    if (bad != 0)
+      return bad;
+
+    u_int8_t *chunk = packed;
+    int n = e.Length;
+    if (!e.Stored) {
+      n = lzDecompress(packed, e.Length, raw, COMPRESSION_CHUNK_SIZE);
+      if (n < 0)
+        return -1;
+      chunk = raw;
+    }
+    u_int32_t base = k * COMPRESSION_CHUNK_SIZE;
+    u_int32_t from = start > base ? start : base;
+    u_int32_t to = end < base + n ? end : base + n;
+    if (from < to)
+      memcpy(buf + (from - start), chunk + (from - base), to - from);
+  }
+  return 0;
+}
+
+/*
+ * Rewrite a compressed file from chunk k onwards with len bytes of logical
+ * content, then drop whatever the old file had past the new end.
+ */
+static int writeCompressed(FILE_t *f, u_int32_t k, const u_int8_t *buf, u_int32_t len,
+                           u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  u_int32_t size = clusterSize(sysInfo);
+  u_int32_t first = k, offset = 0;
+  if (k > 0) {
+    ChunkEntry prev;
+    if (chainRead(f->FstCLusHI, (k - 1) * sizeof(prev), &prev, sizeof(prev), FAT, data, sysInfo) != 0)
+      return -1;
+    offset = prev.Offset + (prev.Length + size - 1) / size * size;
+  }
+
+  u_int8_t packed[COMPRESSION_CHUNK_SIZE];
+  for (u_int32_t done = 0; done < len; done += COMPRESSION_CHUNK_SIZE, ++k) {
+    u_int32_t n = len - done < COMPRESSION_CHUNK_SIZE ? len - done : COMPRESSION_CHUNK_SIZE;
+    int packedLen = lzCompress(buf + done, n, packed, n - 1);
+    ChunkEntry e;
+    e.Offset = offset;
+    e.Length = packedLen ? packedLen : n;
+    e.Stored = packedLen ? 0 : 1;
+    if (chainWrite(&f->FirstClusterNo, offset, packedLen ? packed : buf + done, e.Length, FAT, data, sysInfo) != 0
+        || chainWrite(&f->FstCLusHI, k * sizeof(e), &e, sizeof(e), FAT, data, sysInfo) != 0)
+      return -1;
+    offset += (e.Length + size - 1) / size * size;
+  }
+
+  f->FileSize = first * COMPRESSION_CHUNK_SIZE + len;
+  chainTruncate(&f->FirstClusterNo, offset / size ? offset / size : 1, FAT, sysInfo);
+  chainTruncate(&f->FstCLusHI, (k * sizeof(ChunkEntry) + size - 1) / size, FAT, sysInfo);
+  return 0;
+}
+
+static int writePlain(FILE_t *f, const u_int8_t *buf, u_int32_t len,
+                      u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  if (chainWrite(&f->FirstClusterNo, 0, buf, len, FAT, data, sysInfo) != 0)
+    return -1;
+  chainTruncate(&f->FirstClusterNo, len ? chainNodes(f->FirstClusterNo, len, FAT, sysInfo) : 1, FAT, sysInfo);
+  f->FileSize = len;
+  return 0;
+}
+
+/*
+ * Copy bytes [start, end) of a file's logical content into buf.
+ * Return 0 on success and non-zero if the data could not be read back intact.
+ */
+int readFileData(FILE_t *f, u_int32_t start, u_int32_t end, u_int8_t *buf,
+                 u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  if (end > f->FileSize)
+    end = f->FileSize;
+  if (start >= end)
+    return 0;
+  if (f->Flags & INLINE_DATA) {
+    u_int16_t P = physicalAt((u_int8_t*)f, data, sysInfo);
+    if (P != 0 && !verifyPhysical(P, data, sysInfo))
+      return -1;
+    readInline(f, start, end, buf);
+    return 0;
+  }
+  if (f->Attr & ATTR_COMPRESSED)
+    return readCompressed(f, start, end, buf, FAT, data, sysInfo);
+  return chainRead(f->FirstClusterNo, start, buf, end - start, FAT, data, sysInfo);
 }
 
 //cat: Outputs a file to the console. If used on a directory, say so and reject. If the file does not exist, say so and reject.
@@ -366,28 +1845,121 @@ void cat(char* filename, FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data,Boo
     printf("cat: %s is not a file.\n", filename);
     return;
   }
-  u_int8_t *begin = data + (f->FirstClusterNo -2) * sysInfo->SectorsPerCluster * sysInfo-> BytesPerSector;
-  printf("%s\n", begin);
+  u_int8_t *buf = malloc(f->FileSize + 1);
+  if (readFileData(f, 0, f->FileSize, buf, FAT, data, sysInfo) != 0) {
+    printf("cat: %s is damaged, checksum verification failed.\n", filename);
+    free(buf);
+    return;
+  }
+  fwrite(buf, 1, f->FileSize, stdout);
+  printf("\n");
+  free(buf);
 }
 
 //Write <amt> bytes of <data> into the specified <file> in the current directory. This overwrites the file if it already exists.
 //This creates the file if it did not exist. The data is given as a stream of hex digits.
 void writeFile(char* filename, size_t amt, char *input, FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo){
-  int found = 0; //false
   FILE_t *f = searchFile(working_dir, FAT, data, sysInfo, filename);
   if (f->Attr & ATTR_DIRECTORY) {
     printf("writeFile: %s is not a file.\n", filename);
     return;
   }
-  if (f->Attr & ATTR_DELETED)
-    f->Attr ^= ATTR_DELETED;
+  size_t len = strlen(input);
+  int inlined = len <= MAX_INLINE_SIZE;
   if (f->Filename[0] == DIRECTORY_NOT_USED) {
     printf("writeFile: create a new file\n");
-    initFileEntry((u_int8_t*)working_dir, (u_int8_t*)f, filename, FAT, data, sysInfo, 0);
+    f = createEntry(working_dir, FAT, data, sysInfo, filename, 0, inlined);
+    if (f == NULL)
+      return;
+  }
+  else if (f->Attr & ATTR_DELETED) {
+    // the old chain still belongs to the deleted file, so start a new one
+    u_int16_t N = 0;
+    if (!(inlined && f->Flags & INLINE_SLOTS) && (N = allocCluster(FAT, sysInfo)) == 0) {
+      printf("writeFile: no space left on device\n");
+      return;
+    }
+    f->Attr &= ~(ATTR_DELETED | ATTR_COMPRESSED);
+    f->Flags &= ~INLINE_DATA;
+    f->FirstClusterNo = N;
+    f->FstCLusHI = 0;
+    f->FileSize = 0;
+  }
+  int err = 0;
+  if (inlined && f->Flags & INLINE_SLOTS && !(f->Attr & ATTR_COMPRESSED)) {
+    // the whole content is replaced, so a file that outgrew its slots moves back
+    chainTruncate(&f->FirstClusterNo, 0, FAT, sysInfo);
+    writeInline(f, input, len);
+  }
+  else {
+    err = updateInline(f, 0, 0, input, len, FAT, data, sysInfo);
+    if (err == 0 && f->Attr & ATTR_COMPRESSED)
+      err = writeCompressed(f, 0, (u_int8_t*)input, len, FAT, data, sysInfo);
+    else if (err == 0)
+      err = writePlain(f, (u_int8_t*)input, len, FAT, data, sysInfo);
+  }
+  entryModified(f, data, sysInfo);
+  if (err != 0)
+    printf("writeFile: no space left on device\n");
+}
+
+/*
+ * Append len bytes to a plain file. Every cluster the append needs past
+ * the end of the chain is allocated up front as one extent.
+ */
+static int appendPlain(FILE_t *f, const void *buf, u_int32_t len, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  u_int32_t size = clusterSize(sysInfo);
+  u_int16_t N = f->FirstClusterNo;
+  u_int32_t start = 0, end = 0;
+  if (N != 0) {
+    while (FAT[N] != END_OF_FILE) {
+      start += nodeBytes(N, FAT, sysInfo);
+      N = FAT[N];
+    }
+    end = start + nodeBytes(N, FAT, sysInfo);
+  }
+  if (f->FileSize + len > end) {
+    u_int16_t extent = allocExtent((f->FileSize + len - end + size - 1) / size, FAT, sysInfo);
+    if (extent != 0 && N == 0)
+      f->FirstClusterNo = extent;
+    else if (extent != 0)
+      writeFAT(FAT, sysInfo, N, extent);
+  }
+  int err = N == 0 || f->FileSize < start ? chainWrite(&f->FirstClusterNo, f->FileSize, buf, len, FAT, data, sysInfo)
+                                          : chainWrite(&N, f->FileSize - start, buf, len, FAT, data, sysInfo);
+  if (err == 0)
+    f->FileSize += len;
+  return err;
+}
+
+/*
+ * Add len bytes of buf to the end of file f, whatever way it is stored.
+ * The caller refreshes the checksum of f's directory cluster.
+ * Return 0 on success, -1 otherwise.
+ */
+int appendFile(FILE_t *f, const void *buf, u_int32_t len, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  int err = updateInline(f, f->FileSize, f->FileSize, buf, len, FAT, data, sysInfo);
+  if (err != 0 || f->Flags & INLINE_DATA) {
+    // appended in place, or no room to move the file out of its slots
   }
-  u_int8_t * dest = data + (f->FirstClusterNo -2) * sysInfo->SectorsPerCluster * sysInfo-> BytesPerSector;
-  memcpy(dest, input, strlen(input)+1);
-  f->FileSize = strlen(input);
+  else if (f->Attr & ATTR_COMPRESSED) {
+    // recompress from the last partial chunk onwards
+    u_int32_t k = f->FileSize / COMPRESSION_CHUNK_SIZE;
+    u_int32_t tail = f->FileSize % COMPRESSION_CHUNK_SIZE;
+    u_int8_t *chunk = malloc(tail + len);
+    err = readCompressed(f, k * COMPRESSION_CHUNK_SIZE, f->FileSize, chunk, FAT, data, sysInfo);
+    if (err == 0) {
+      memcpy(chunk + tail, buf, len);
+      err = writeCompressed(f, k, chunk, tail + len, FAT, data, sysInfo);
+    }
+    free(chunk);
+  }
+  else {
+    err = appendPlain(f, buf, len, FAT, data, sysInfo);
+  }
+  return err;
 }
 
 //Append <amt> bytes of <data> onto the specified <file> in the current directory.
@@ -403,10 +1975,215 @@ void append(char*filename, size_t amt, char *input, FILE_t *working_dir, u_int16
     printf("append: %s does not exist.\n", filename);
     return;
   }
-  u_int8_t *appendStart = data + (f->FirstClusterNo - 2) * sysInfo->SectorsPerCluster * sysInfo->BytesPerSector
-                          + f->FileSize;
-  memcpy(appendStart, input, strlen(input)+1);
-  f-> FileSize += strlen(input);
+  int err = appendFile(f, input, strlen(input), FAT, data, sysInfo);
+  entryModified(f, data, sysInfo);
+  if (err != 0)
+    printf("append: could not append to %s.\n", filename);
+}
+
+/*
+ * Grow a plain file to size bytes. The rest of its last cluster is zeroed
+ * and everything past that becomes holes, which take no clusters.
+ * Return 0 on success, -1 if the volume ran out of space.
+ */
+static int extendFile(FILE_t *f, u_int32_t size, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  u_int32_t maxHole = 0xFFFF / clusterSize(sysInfo) * clusterSize(sysInfo);
+  u_int16_t N = f->FirstClusterNo;
+  u_int32_t end = 0;
+  while (FAT[N] != END_OF_FILE) {
+    end += nodeBytes(N, FAT, sysInfo);
+    N = FAT[N];
+  }
+  end += nodeBytes(N, FAT, sysInfo);
+  if (!isHole(N, FAT, sysInfo) && f->FileSize < end) {
+    u_int32_t n = (size < end ? size : end) - f->FileSize;
+    u_int8_t zeros[clusterSize(sysInfo)];
+    memset(zeros, 0, n);
+    if (chainWrite(&f->FirstClusterNo, f->FileSize, zeros, n, FAT, data, sysInfo) != 0)
+      return -1;
+  }
+  while (end < size) {
+    u_int32_t bytes = size - end < maxHole ? size - end : maxHole;
+    u_int16_t H = allocHole(FAT, sysInfo, bytes);
+    if (H == 0)
+      return -1;
+    writeFAT(FAT, sysInfo, N, H);
+    N = H;
+    end += bytes;
+  }
+  f->FileSize = size;
+  return 0;
+}
+
+/*
+ * Replace the logical content of a compressed file from offset on with len
+ * bytes of buf, zero filling any gap past the old end, and keep the file
+ * at least size bytes long.
+ */
+static int rewriteCompressed(FILE_t *f, u_int32_t offset, const u_int8_t *buf, u_int32_t len, u_int32_t size,
+                             u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  u_int32_t k = (offset < f->FileSize ? offset : f->FileSize) / COMPRESSION_CHUNK_SIZE;
+  u_int32_t base = k * COMPRESSION_CHUNK_SIZE;
+  if (size < offset + len)
+    size = offset + len;
+  u_int8_t *tail = calloc(size - base, 1);
+  int err = readCompressed(f, base, f->FileSize < size ? f->FileSize : size, tail, FAT, data, sysInfo);
+  if (err == 0) {
+    if (len > 0)
+      memcpy(tail + (offset - base), buf, len);
+    err = writeCompressed(f, k, tail, size - base, FAT, data, sysInfo);
+  }
+  free(tail);
+  return err;
+}
+
+/*
+ * Move cursor c of plain file f to the node holding byte offset, or to the
+ * last node if the chain ends first. It only walks from FirstClusterNo
+ * when c is unset or already past offset.
+ */
+static void seekCursor(FILE_t *f, ChainCursor *c, u_int32_t offset, u_int16_t *FAT, BootSector *sysInfo)
+{
+  if (c->node == 0 || c->start > offset) {
+    c->node = f->FirstClusterNo;
+    c->start = 0;
+  }
+  while (FAT[c->node] != END_OF_FILE && offset >= c->start + nodeBytes(c->node, FAT, sysInfo)) {
+    c->start += nodeBytes(c->node, FAT, sysInfo);
+    c->node = FAT[c->node];
+  }
+}
+
+/*
+ * Copy up to len bytes of f from offset on into buf, leaving c at the end
+ * of them. Inline and compressed files have no use for a cursor.
+ * Return the number of bytes read, -1 if they could not be read back intact.
+ */
+int fileRead(FILE_t *f, u_int32_t offset, void *buf, u_int32_t len, ChainCursor *c,
+             u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  if (offset >= f->FileSize)
+    return 0;
+  if (len > f->FileSize - offset)
+    len = f->FileSize - offset;
+  if (f->Flags & INLINE_DATA || f->Attr & ATTR_COMPRESSED) {
+    c->node = 0;
+    return readFileData(f, offset, offset + len, buf, FAT, data, sysInfo) == 0 ? (int)len : -1;
+  }
+  seekCursor(f, c, offset, FAT, sysInfo);
+  if (chainRead(c->node, offset - c->start, buf, len, FAT, data, sysInfo) != 0)
+    return -1;
+  seekCursor(f, c, offset + len, FAT, sysInfo);
+  return len;
+}
+
+/*
+ * Write len bytes of buf at offset of f, growing it if needed, and leave c
+ * at the end of them. A gap left past the old end is a hole. The caller
+ * refreshes the checksum of f's directory cluster.
+ * Return 0 on success, -1 if the volume ran out of space.
+ */
+int fileWrite(FILE_t *f, u_int32_t offset, const void *buf, u_int32_t len, ChainCursor *c,
+              u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  int err = updateInline(f, f->FileSize, offset, buf, len, FAT, data, sysInfo);
+  if (err != 0 || f->Flags & INLINE_DATA) {
+    // written in place, or no room to move the file out of its slots
+    c->node = 0;
+  }
+  else if (f->Attr & ATTR_COMPRESSED) {
+    c->node = 0;
+    err = rewriteCompressed(f, offset, buf, len, f->FileSize, FAT, data, sysInfo);
+  }
+  else {
+    err = offset > f->FileSize ? extendFile(f, offset, FAT, data, sysInfo) : 0;
+    if (err == 0) {
+      seekCursor(f, c, offset, FAT, sysInfo);
+      err = chainWrite(&c->node, offset - c->start, buf, len, FAT, data, sysInfo);
+    }
+    if (err == 0 && offset + len > f->FileSize)
+      f->FileSize = offset + len;
+    if (err == 0)
+      seekCursor(f, c, offset + len, FAT, sysInfo);
+  }
+  return err;
+}
+
+// "writeat <file> <offset> <amt> <data>": Write <data> at byte <offset> of <file>, growing it if needed.
+// A gap left past the old end of the file is a hole and takes no clusters.
+void writeAt(char *filename, size_t offset, size_t amt, char *input, FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  FILE_t *f = searchFile(working_dir, FAT, data, sysInfo, filename);
+  if (f->Attr & ATTR_DIRECTORY) {
+    printf("writeat: %s is not a file.\n", filename);
+    return;
+  }
+  if (f->Filename[0] == DIRECTORY_NOT_USED || f->Attr & ATTR_DELETED) {
+    printf("writeat: %s does not exist.\n", filename);
+    return;
+  }
+  ChainCursor c = { 0, 0 };
+  int err = fileWrite(f, offset, input, strlen(input), &c, FAT, data, sysInfo);
+  entryModified(f, data, sysInfo);
+  if (err != 0)
+    printf("writeat: no space left on device\n");
+}
+
+// "truncate <file> <size>": Cut <file> down to <size> bytes, or grow it to
+// <size> bytes with a hole at the end.
+void truncateFile(char *filename, size_t size, FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  FILE_t *f = searchFile(working_dir, FAT, data, sysInfo, filename);
+  if (f->Attr & ATTR_DIRECTORY) {
+    printf("truncate: %s is not a file.\n", filename);
+    return;
+  }
+  if (f->Filename[0] == DIRECTORY_NOT_USED || f->Attr & ATTR_DELETED) {
+    printf("truncate: %s does not exist.\n", filename);
+    return;
+  }
+  int err = updateInline(f, size, size, NULL, 0, FAT, data, sysInfo);
+  if (err != 0 || f->Flags & INLINE_DATA) {
+    // resized in place, or no room to move the file out of its slots
+  }
+  else if (f->Attr & ATTR_COMPRESSED) {
+    if (size < f->FileSize) {
+      u_int32_t k = size / COMPRESSION_CHUNK_SIZE;
+      u_int8_t *tail = malloc(size - k * COMPRESSION_CHUNK_SIZE + 1);
+      err = readCompressed(f, k * COMPRESSION_CHUNK_SIZE, size, tail, FAT, data, sysInfo);
+      if (err == 0)
+        err = writeCompressed(f, k, tail, size - k * COMPRESSION_CHUNK_SIZE, FAT, data, sysInfo);
+      free(tail);
+    }
+    else if (size > f->FileSize) {
+      err = rewriteCompressed(f, f->FileSize, NULL, 0, size, FAT, data, sysInfo);
+    }
+  }
+  else if (size < f->FileSize) {
+    err = chainRemove(&f->FirstClusterNo, size, f->FileSize - size, f->FileSize, FAT, data, sysInfo);
+    if (err == 0)
+      f->FileSize = size;
+  }
+  else if (size > f->FileSize) {
+    err = extendFile(f, size, FAT, data, sysInfo);
+  }
+  entryModified(f, data, sysInfo);
+  if (err != 0)
+    printf("truncate: no space left on device\n");
+}
+
+//Bytes of clusters a file's chains take on disk; holes take none.
+u_int32_t allocatedSize(FILE_t *f, u_int16_t *FAT, BootSector *sysInfo)
+{
+  u_int16_t chains[2] = { f->FirstClusterNo, (f->Attr & ATTR_COMPRESSED) ? f->FstCLusHI : 0 };
+  u_int32_t clusters = 0;
+  for (int i = 0; i < 2; ++i) {
+    for (u_int16_t N = chains[i]; N != 0 && N != END_OF_FILE; N = FAT[N])
+      clusters += !isHole(N, FAT, sysInfo);
+  }
+  return clusters * clusterSize(sysInfo);
 }
 
 // "get <file> <start> <end>": Print to the console the bytes from the file in the range [start,end).
@@ -422,48 +2199,344 @@ void get(char* filename, size_t startByte, size_t endByte, FILE_t *working_dir,
     printf("append: %s does not exist.\n", filename);
     return;
   }
-  int clusterNo = f->FirstClusterNo;
-  u_int8_t *dataRegion = data + (clusterNo - 2) * sysInfo->SectorsPerCluster * sysInfo->BytesPerSector;
-  u_int8_t *b = dataRegion + startByte, *e = dataRegion + endByte;
+  if (endByte > f->FileSize)
+    endByte = f->FileSize;
+  if (startByte >= endByte)
+    return;
+  u_int8_t *buf = malloc(endByte - startByte);
+  if (readFileData(f, startByte, endByte, buf, FAT, data, sysInfo) != 0) {
+    printf("get: %s is damaged, checksum verification failed.\n", filename);
+    free(buf);
+    return;
+  }
+  u_int8_t *b = buf, *e = buf + (endByte - startByte);
   while (b != e) {
-    printf("%c", b++);
+    printf("%c", *b++);
   }
+  free(buf);
 }
 
-void getPages(FILE_t *file, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+// "compress <file>" / "uncompress <file>": Turn transparent compression on or off
+// for a file, converting its current contents.
+void compressFile(char *filename, int enable, FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo) {
+  FILE_t *f = searchFile(working_dir, FAT, data, sysInfo, filename);
+  const char *cmd = enable ? "compress" : "uncompress";
+  if (f == NULL || f->Filename[0] == DIRECTORY_NOT_USED || f->Attr & ATTR_DELETED) {
+    printf("%s: %s does not exist.\n", cmd, filename);
+    return;
+  }
+  if (f->Attr & ATTR_DIRECTORY) {
+    printf("%s: %s is not a file.\n", cmd, filename);
+    return;
+  }
+  if (!(f->Attr & ATTR_COMPRESSED) == !enable)
+    return;
+
+  u_int8_t *buf = malloc(f->FileSize + 1);
+  int err = readFileData(f, 0, f->FileSize, buf, FAT, data, sysInfo);
+  if (err != 0) {
+    printf("%s: %s is damaged, checksum verification failed.\n", cmd, filename);
+    free(buf);
+    return;
+  }
+  if (enable) {
+    // chunks are laid out on whole clusters, so start a fresh data chain
+    u_int16_t N = allocCluster(FAT, sysInfo);
+    if (N == 0) {
+      printf("%s: no space left on device\n", cmd);
+      free(buf);
+      return;
+    }
+    chainTruncate(&f->FirstClusterNo, 0, FAT, sysInfo);
+    f->FirstClusterNo = N;
+    f->Flags &= ~INLINE_DATA;
+    f->Attr |= ATTR_COMPRESSED;
+    f->FstCLusHI = 0;
+    err = writeCompressed(f, 0, buf, f->FileSize, FAT, data, sysInfo);
+  }
+  else {
+    chainTruncate(&f->FstCLusHI, 0, FAT, sysInfo);
+    f->Attr &= ~ATTR_COMPRESSED;
+    err = writePlain(f, buf, f->FileSize, FAT, data, sysInfo);
+  }
+  entryModified(f, data, sysInfo);
+  if (err != 0)
+    printf("%s: no space left on device\n", cmd);
+  free(buf);
+}
+
+//Call visit on every live file and directory directly in dir.
+void forEachEntry(FILE_t *dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo,
+                  void (*visit)(FILE_t *f, void *ctx), void *ctx)
 {
-  if (file->Attr & ATTR_DIRECTORY) {
-    u_int16_t clusterNo = file->FirstClusterNo;
-    do {
-      printf("%u \n", clusterNo);
-      u_int8_t *begin = data + (clusterNo - 2) * sysInfo->SectorsPerCluster * sysInfo->BytesPerSector
-                        + RESERVED_DIRECTORY_REGION_SIZE;
-      u_int8_t *end = begin + sysInfo->SectorsPerCluster * sysInfo->BytesPerSector;
-      while (begin != end) {
-        FILE_t *f = (FILE_t *) begin;
-        begin += FILE_ENTRY_SIZE;
-        if (f->Filename[0] == DIRECTORY_NOT_USED)
-          return;
-        if(f->Attr & ATTR_DIRECTORY)
-          getPages(f, FAT, data, sysInfo);
-        else {
-          u_int16_t cluster = file->FirstClusterNo;
-          do {
-            printf("%u \n", cluster);
-            cluster = FAT[cluster];
-          } while (cluster != END_OF_FILE);
-        }
-      }
-      clusterNo = FAT[clusterNo]; // search in next cluster
-    } while (clusterNo != END_OF_FILE);
+  u_int32_t size = clusterSize(sysInfo);
+  u_int8_t *begin, *end;
+  u_int16_t clusterNo = dir->FirstClusterNo;
+  begin = clusterAddr(clusterNo, FAT, data, sysInfo) + RESERVED_DIRECTORY_REGION_SIZE;
+  end = clusterAddr(clusterNo, FAT, data, sysInfo) + size;
+  while (1) {
+    for (; begin != end; begin += FILE_ENTRY_SIZE) {
+      FILE_t *f = (FILE_t*)begin;
+      if (f->Filename[0] == DIRECTORY_NOT_USED)
+        return;
+      if (f->Attr & ATTR_DELETED || (f->Attr & ATTR_LONE_FILE_NAME) == ATTR_LONE_FILE_NAME)
+        continue;
+      visit(f, ctx);
+    }
+    clusterNo = FAT[clusterNo];
+    if (clusterNo == END_OF_FILE)
+      return;
+    begin = clusterAddr(clusterNo, FAT, data, sysInfo) + RESERVED_DIRECTORY_REGION_SIZE;
+    end = clusterAddr(clusterNo, FAT, data, sysInfo) + size;
+  }
+}
+
+typedef struct WalkVisit {
+  u_int16_t *FAT;
+  u_int8_t *data;
+  BootSector *sysInfo;
+  void (*visit)(FILE_t *f, void *ctx);
+  void *ctx;
+} WalkVisit;
+
+static void walkEntry(FILE_t *f, void *arg) {
+  WalkVisit *walk = (WalkVisit*)arg;
+  walk->visit(f, walk->ctx);
+  if (f->Attr & ATTR_DIRECTORY)
+    forEachEntry(f, walk->FAT, walk->data, walk->sysInfo, walkEntry, walk);
+}
+
+/*
+ * Call visit on every live file and directory below dir, depth first.
+ * Directories are visited before their contents.
+ */
+void walkFiles(FILE_t *dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo,
+               void (*visit)(FILE_t *f, void *ctx), void *ctx)
+{
+  WalkVisit walk = { FAT, data, sysInfo, visit, ctx };
+  forEachEntry(dir, FAT, data, sysInfo, walkEntry, &walk);
+}
+
+static DirUsage *dirUsage = NULL; // indexed by the first cluster of a directory
+
+DirUsage* directoryUsage(u_int16_t dir) {
+  return &dirUsage[dir];
+}
+
+/*
+ * What entry f adds to the usage of its directory: its file size and the
+ * clusters its chains take, plus everything below it for a directory.
+ * Nothing for an entry that is not live.
+ */
+void entryUsage(FILE_t *f, u_int16_t *FAT, BootSector *sysInfo, u_int64_t *bytes, u_int32_t *clusters) {
+  *bytes = 0;
+  *clusters = 0;
+  if (f->Filename[0] == DIRECTORY_NOT_USED || f->Attr & ATTR_DELETED)
+    return;
+  *clusters = allocatedSize(f, FAT, sysInfo) / clusterSize(sysInfo);
+  if (f->Attr & ATTR_DIRECTORY) {
+    *bytes = dirUsage[f->FirstClusterNo].bytes;
+    *clusters += dirUsage[f->FirstClusterNo].clusters;
   }
   else {
-    u_int16_t clusterNo = file->FirstClusterNo;
-    do {
-      printf("%u \n", clusterNo);
-      clusterNo = FAT[clusterNo];
-    } while (clusterNo != END_OF_FILE);
+    *bytes = f->FileSize;
+  }
+}
+
+typedef struct DirSum {
+  u_int16_t *FAT;
+  u_int8_t *data;
+  BootSector *sysInfo;
+  u_int16_t dir;
+} DirSum;
+
+static void sumEntry(FILE_t *f, void *arg) {
+  DirSum *sum = (DirSum*)arg;
+  if (f->Attr & ATTR_DIRECTORY)
+    sumDirectory(f, sum->dir, sum->FAT, sum->data, sum->sysInfo);
+  u_int64_t bytes;
+  u_int32_t clusters;
+  entryUsage(f, sum->FAT, sum->sysInfo, &bytes, &clusters);
+  dirUsage[sum->dir].bytes += bytes;
+  dirUsage[sum->dir].clusters += clusters;
+}
+
+/*
+ * Recompute the cached usage of dir and every directory below it from
+ * scratch. parent is the first cluster of dir's parent, 0 for the root.
+ */
+void sumDirectory(FILE_t *dir, u_int16_t parent, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo) {
+  if (dirUsage == NULL)
+    dirUsage = calloc(fatEntries(sysInfo), sizeof(DirUsage));
+  DirSum sum = { FAT, data, sysInfo, dir->FirstClusterNo };
+  DirUsage *u = &dirUsage[dir->FirstClusterNo];
+  u->bytes = 0;
+  u->clusters = 0;
+  u->parent = parent;
+  forEachEntry(dir, FAT, data, sysInfo, sumEntry, &sum);
+}
+
+//Add to the usage of dir and of every directory above it.
+void addDirUsage(u_int16_t dir, int64_t bytes, int64_t clusters) {
+  for (; dir != 0; dir = dirUsage[dir].parent) {
+    dirUsage[dir].bytes += bytes;
+    dirUsage[dir].clusters += clusters;
+  }
+}
+
+typedef struct WalkContext {
+  u_int16_t *FAT;
+  u_int8_t *data;
+  BootSector *sysInfo;
+  UsageInfo *usage;
+  u_int8_t *seen;     // physical clusters already counted
+  u_int32_t remapped; // nodes moved onto a shared cluster by dedup
+} WalkContext;
+
+static void countChain(u_int16_t N, WalkContext *ctx) {
+  if (N == 0)
+    return;
+  do {
+    u_int16_t P = physicalCluster(N, ctx->FAT, ctx->sysInfo);
+    if (P == 0) { // holes take no space
+      N = ctx->FAT[N];
+      continue;
+    }
+    ++ctx->usage->clusters;
+    if (!ctx->seen[P]) {
+      ctx->seen[P] = 1;
+      ++ctx->usage->physical;
+    }
+    N = ctx->FAT[N];
+  } while (N != END_OF_FILE);
+}
+
+static void countUsage(FILE_t *f, void *arg) {
+  WalkContext *ctx = (WalkContext*)arg;
+  countChain(f->FirstClusterNo, ctx);
+  if (f->Attr & ATTR_DIRECTORY)
+    return;
+  ctx->usage->logical += f->FileSize;
+  if (f->Attr & ATTR_COMPRESSED)
+    countChain(f->FstCLusHI, ctx);
+}
+
+/*
+ * Add up the logical size of every live file, the clusters their chains
+ * (and those of directories) use, and how many distinct physical clusters
+ * hold them.
+ */
+void fileUsage(FILE_t *root_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo, UsageInfo *info) {
+  WalkContext ctx = { FAT, data, sysInfo, info, calloc(sysInfo->ClusterCount + 2, 1), 0 };
+  memset(info, 0, sizeof(UsageInfo));
+  walkFiles(root_dir, FAT, data, sysInfo, countUsage, &ctx);
+  free(ctx.seen);
+}
+
+static void forEachDataCluster(FILE_t *f, WalkContext *ctx, void (*fn)(u_int16_t N, WalkContext *ctx)) {
+  if (f->Attr & ATTR_DIRECTORY)
+    return;
+  u_int16_t chains[2] = { f->FirstClusterNo, (f->Attr & ATTR_COMPRESSED) ? f->FstCLusHI : 0 };
+  for (int i = 0; i < 2; ++i) {
+    for (u_int16_t N = chains[i]; N != 0 && N != END_OF_FILE; N = ctx->FAT[N]) {
+      if (!isHole(N, ctx->FAT, ctx->sysInfo))
+        fn(N, ctx);
+    }
+  }
+}
+
+static void indexCluster(u_int16_t N, WalkContext *ctx) {
+  u_int16_t P = physicalCluster(N, ctx->FAT, ctx->sysInfo);
+  dedupInsert(P, checksumTable(ctx->sysInfo)[P - 2]);
+}
+
+static void indexFile(FILE_t *f, void *arg) {
+  forEachDataCluster(f, (WalkContext*)arg, indexCluster);
+}
+
+/*
+ * Rebuild the fingerprint index from the checksums of every cluster
+ * holding file data. Directory clusters are written in place and are
+ * never shared, so they stay out of the index.
+ */
+void buildDedupIndex(FILE_t *root_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo) {
+  WalkContext ctx = { FAT, data, sysInfo, NULL, NULL, 0 };
+  dedupInit(sysInfo->ClusterCount);
+  walkFiles(root_dir, FAT, data, sysInfo, indexFile, &ctx);
+}
+
+static void dedupCluster(u_int16_t N, WalkContext *ctx) {
+  u_int16_t P = physicalCluster(N, ctx->FAT, ctx->sysInfo);
+  u_int16_t Q = dedupFind(checksumTable(ctx->sysInfo)[P - 2], physicalAddr(P, ctx->data, ctx->sysInfo),
+                          clusterSize(ctx->sysInfo), P, ctx->data, ctx->sysInfo);
+  if (Q == 0)
+    return;
+  addReference(Q, ctx->sysInfo);
+  writeRemap(ctx->FAT, ctx->sysInfo, N, Q);
+  releasePhysical(P, ctx->sysInfo);
+  ++ctx->remapped;
+}
+
+static void dedupFile(FILE_t *f, void *arg) {
+  forEachDataCluster(f, (WalkContext*)arg, dedupCluster);
+}
+
+// "dedup": Share every file cluster whose contents already exist in
+// another physical cluster, freeing the duplicates.
+void dedup(FILE_t *root_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo) {
+  u_int16_t *refcount = refcountTable(sysInfo);
+  u_int32_t before = 0, after = 0;
+  for (u_int32_t P = 0; P < sysInfo->ClusterCount; ++P)
+    before += refcount[P] != 0;
+
+  WalkContext ctx = { FAT, data, sysInfo, NULL, NULL, 0 };
+  walkFiles(root_dir, FAT, data, sysInfo, dedupFile, &ctx);
+
+  for (u_int32_t P = 0; P < sysInfo->ClusterCount; ++P)
+    after += refcount[P] != 0;
+  printf("dedup: %u clusters shared, %u physical clusters freed\n", ctx.remapped, before - after);
+}
+
+static void printChain(WalkTask *task, u_int16_t cluster, u_int16_t *FAT) {
+  for (; cluster != 0 && cluster != END_OF_FILE; cluster = FAT[cluster])
+    walkPrintf(task, "%u \n", cluster);
+}
+
+static void pagesEnter(WalkTask *task, void *ctx) {
+  printChain(task, task->dir->FirstClusterNo, ((TreeWalk*)ctx)->FAT);
+}
+
+static void pagesVisit(FILE_t *f, WalkTask *task, void *ctx) {
+  if (!(f->Attr & ATTR_DIRECTORY))
+    printChain(task, f->FirstClusterNo, ((TreeWalk*)ctx)->FAT);
+}
+
+// "getpages <file>": Print the clusters of file, or of a directory and
+// everything below it, each directory's before its entries'.
+void getPages(FILE_t *file, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  if (!(file->Attr & ATTR_DIRECTORY)) {
+    for (u_int16_t N = file->FirstClusterNo; N != 0 && N != END_OF_FILE; N = FAT[N])
+      printf("%u \n", N);
+    return;
   }
+  TreeWalk walk = { FAT, data, sysInfo, pagesEnter, pagesVisit, NULL, &walk };
+  treeWalk(file, "", &walk);
+}
+
+static void findVisit(FILE_t *f, WalkTask *task, void *ctx) {
+  char name[MAX_LEN_OF_SFN + 1];
+  snprintf(name, sizeof(name), "%.*s", (int)strnlen((char*)f->Filename, MAX_LEN_OF_SFN), f->Filename);
+  if (fnmatch((char*)ctx, name, 0) == 0)
+    walkPrintf(task, "%s/%s\n", task->path, name);
+}
+
+// "find <dir> <pattern>": Print the path of every file and directory below
+// dir whose name matches the shell wildcard pattern, in directory order.
+void find(FILE_t *dir, char *path, char *pattern, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo)
+{
+  TreeWalk walk = { FAT, data, sysInfo, NULL, findVisit, NULL, pattern };
+  treeWalk(dir, path, &walk);
 }
 
 //Remove the bytes in the range [start,end) from the specified <file> in the current directory.
@@ -472,16 +2545,47 @@ void removeRange(char* filename, int start, int end, FILE_t *working_dir, u_int1
 {
   FILE_t *f = searchFile(working_dir, FAT, data, sysInfo, filename);
   if (f->Attr & ATTR_DIRECTORY) {
-    printf("append: %s is not a file.\n", filename);
+    printf("remove: %s is not a file.\n", filename);
     return;
   }
   if (f->Filename[0] == DIRECTORY_NOT_USED || f->Attr & ATTR_DELETED) {
-    printf("append: %s does not exist.\n", filename);
+    printf("remove: %s does not exist.\n", filename);
     return;
   }
-  u_int8_t *appendStart = data + (f->FirstClusterNo - 2) * sysInfo->SectorsPerCluster * sysInfo->BytesPerSector
-      + f->FileSize;
-  //TODO: remove bytes in range [start, end)
+  if (start < 0)
+    start = 0;
+  if (end > f->FileSize)
+    end = f->FileSize;
+  if (start >= end)
+    return;
+
+  int err = 0;
+  if (f->Flags & INLINE_DATA) {
+    u_int8_t content[MAX_INLINE_SIZE];
+    readInline(f, 0, f->FileSize, content);
+    memmove(content + start, content + end, f->FileSize - end);
+    writeInline(f, content, f->FileSize - (end - start));
+  }
+  else if (f->Attr & ATTR_COMPRESSED) {
+    // recompress from the chunk holding start onwards
+    u_int32_t k = start / COMPRESSION_CHUNK_SIZE;
+    u_int32_t base = k * COMPRESSION_CHUNK_SIZE;
+    u_int8_t *buf = malloc(f->FileSize - base);
+    err = readCompressed(f, base, f->FileSize, buf, FAT, data, sysInfo);
+    if (err == 0) {
+      memmove(buf + (start - base), buf + (end - base), f->FileSize - end);
+      err = writeCompressed(f, k, buf, f->FileSize - base - (end - start), FAT, data, sysInfo);
+    }
+    free(buf);
+  }
+  else {
+    err = chainRemove(&f->FirstClusterNo, start, end - start, f->FileSize, FAT, data, sysInfo);
+    if (err == 0)
+      f->FileSize -= end - start;
+  }
+  entryModified(f, data, sysInfo);
+  if (err != 0)
+    printf("remove: could not remove bytes from %s.\n", filename);
 }
 
 //Removes a file and recovers the pages. Report, but do not terminate, if the file is a directory.
@@ -496,12 +2600,8 @@ void rm(char* filename, FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, Boo
     return;
   }
   f->Attr ^= ATTR_DELETED;
-  u_int16_t cluster = f->FirstClusterNo;
-  do {
-    u_int16_t next = FAT[cluster];
-    FAT[cluster] ^= DELETED_CLUSTER;
-    cluster = next;
-  } while (cluster != END_OF_FILE);
+  entryModified(f, data, sysInfo);
+  deleteFileChains(f, FAT, sysInfo);
 }
 
 
@@ -521,4 +2621,102 @@ void dump(u_int16_t pageNumber, u_int16_t *FAT, u_int8_t *data, BootSector *sysI
 
 void dumpBinary(u_int16_t pageNumber, char *filename, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo) {
 
-}
\ No newline at end of file
+}
+typedef struct ScrubTask {
+  u_int16_t *FAT;
+  u_int8_t *data;
+  BootSector *sysInfo;
+  u_int32_t first, last; // physical clusters [first, last)
+  u_int32_t checked;
+  u_int32_t badCount;
+  u_int16_t *bad;
+} ScrubTask;
+
+static void* scrubClusters(void *arg) {
+  ScrubTask *task = (ScrubTask*)arg;
+  u_int16_t *refcount = refcountTable(task->sysInfo);
+  for (u_int32_t P = task->first; P != task->last; ++P) {
+    if (refcount[P - 2] == 0)
+      continue;
+    ++task->checked;
+    if (!verifyPhysical(P, task->data, task->sysInfo))
+      task->bad[task->badCount++] = P;
+  }
+  return NULL;
+}
+
+/*
+ * "scrub": Verify the checksum of every allocated cluster, splitting the data
+ * region between one thread per CPU, then check each FAT sector against its
+ * checksum and repair it from a mirror copy that still matches.
+ */
+void scrub(u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo) {
+  if (sysInfo->SectorsPerChecksum == 0) {
+    printf("scrub: volume has no checksum table.\n");
+    return;
+  }
+
+  u_int32_t clusters = sysInfo->ClusterCount;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1)
+    threads = 1;
+  if (threads > clusters / 256 + 1)
+    threads = clusters / 256 + 1;
+
+  ScrubTask *tasks = calloc(threads, sizeof(ScrubTask));
+  pthread_t *tids = calloc(threads, sizeof(pthread_t));
+  for (long i = 0; i < threads; ++i) {
+    tasks[i].FAT = FAT;
+    tasks[i].data = data;
+    tasks[i].sysInfo = sysInfo;
+    tasks[i].first = 2 + clusters * i / threads;
+    tasks[i].last = 2 + clusters * (i + 1) / threads;
+    tasks[i].bad = malloc((tasks[i].last - tasks[i].first) * sizeof(u_int16_t));
+    if (i > 0)
+      pthread_create(&tids[i], NULL, scrubClusters, &tasks[i]);
+  }
+  scrubClusters(&tasks[0]);
+
+  u_int32_t checked = 0, bad = 0;
+  for (long i = 0; i < threads; ++i) {
+    if (i > 0)
+      pthread_join(tids[i], NULL);
+    for (u_int32_t k = 0; k < tasks[i].badCount; ++k)
+      printf("scrub: checksum mismatch in physical cluster %u\n", tasks[i].bad[k]);
+    checked += tasks[i].checked;
+    bad += tasks[i].badCount;
+    free(tasks[i].bad);
+  }
+  free(tasks);
+  free(tids);
+
+  u_int32_t repaired = 0;
+  u_int32_t *checksums = checksumTable(sysInfo) + clusters;
+  u_int32_t entriesPerSector = sysInfo->BytesPerSector / sizeof(u_int16_t);
+  for (u_int32_t s = 0; s < fatCopySectors(sysInfo); ++s) {
+    u_int16_t *primary = fatCopy(sysInfo, 0) + s * entriesPerSector;
+    int good = -1;
+    for (int i = 0; i < sysInfo->FATCopies && good < 0; ++i) {
+      if (crc32c(0, fatCopy(sysInfo, i) + s * entriesPerSector, sysInfo->BytesPerSector) == checksums[s])
+        good = i;
+    }
+    if (good < 0) {
+      printf("scrub: FAT sector %u does not match its checksum in any copy\n", s);
+      continue;
+    }
+    u_int16_t *source = fatCopy(sysInfo, good) + s * entriesPerSector;
+    for (int i = 0; i < sysInfo->FATCopies; ++i) {
+      u_int16_t *copy = fatCopy(sysInfo, i) + s * entriesPerSector;
+      if (copy != source && memcmp(copy, source, sysInfo->BytesPerSector) != 0) {
+        memcpy(copy, source, sysInfo->BytesPerSector);
+        metadataModified(copy, sysInfo->BytesPerSector, sysInfo);
+        if (copy == primary)
+          printf("scrub: FAT sector %u repaired from copy %d\n", s, good);
+        ++repaired;
+      }
+    }
+  }
+  if (repaired)
+    countClusters(fatCopy(sysInfo, 0), sysInfo);
+  printf("scrub: %u clusters checked, %u bad, %u FAT sectors repaired\n", checked, bad, repaired);
+}
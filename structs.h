@@ -24,6 +24,8 @@
 #define RESERVED_CLUSTER  0xFF00
 #define DELETED_CLUSTER   0xF000
 #define CHECK_CLUSTER 0xFF11
+#define DELETED_END_OF_FILE (END_OF_FILE ^ DELETED_CLUSTER) // never handed out as a cluster number
+#define FAT_COPIES 2
 
 #define MAX_LEN_OF_SFN 11
 #define MAX_LEN_OF_LFN 255
@@ -48,7 +50,18 @@ typedef struct BootSector {
   u_int32_t VolumeSerialNumber; // Volume Serial Number
   u_int8_t VolumeLable[11]; // Volume Label - Should be the same as in the root directory
   u_int8_t FileSystemType[8]; // File System Type, should be "FAT16"
-  u_int8_t BootstrapCode[448]; // Bootstrap Code
+  u_int8_t Reserved1;
+  u_int16_t ClusterCount; // Number of clusters in the data region
+  u_int16_t SectorsPerChecksum; // Sectors of the CRC32C checksum table
+  u_int16_t SectorsPerRemap; // Sectors of the cluster remap table following each FAT
+  u_int16_t SectorsPerRefcount; // Sectors of the physical cluster reference counts
+  u_int16_t SectorsPerSnapshotTable; // Sectors of the snapshot table, 0 if there is none
+  u_int16_t SectorsPerFill; // Sectors of the cluster fill table following each remap table
+  u_int16_t RootCluster; // First cluster of the root directory chain
+  u_int16_t StripeImages; // Images the data region is striped over, 0 if it is not striped
+  u_int16_t StripeClusters; // Clusters per stripe unit
+  u_int16_t SectorsPerCheckpointTable; // Sectors of the checkpoint table and its bitmaps, 0 if there is none
+  u_int8_t BootstrapCode[428]; // Bootstrap Code
   u_int16_t BootSectorSignature; // Boot Sector Signature
 } BootSector;
 
@@ -60,6 +73,7 @@ typedef struct BootSector {
 #define ATTR_ARCHIEVE       0x20
 #define ATTR_LONE_FILE_NAME 0x0F
 #define ATTR_DELETED        0x40
+#define ATTR_COMPRESSED     0x80
 
 #define DIRECTORY_NOT_USED          0xE5
 #define DIRECTORY_NOT_USED_AND_LAST 0x00
@@ -67,7 +81,7 @@ typedef struct BootSector {
 typedef struct FileEntry {
   u_int8_t Filename[11]; // 8.3 format, Filename[0] indicates status
   u_int8_t Attr; // Attribute Byte
-  u_int8_t ReservedWinNT; // reserved for WindowsNT
+  u_int8_t Flags; // INLINE_* flags, in the byte WindowsNT reserves
   u_int8_t Creation;
   u_int16_t CreationTime;
   u_int16_t CreationDate;
@@ -96,6 +110,44 @@ typedef struct LongFileName
   u_int8_t fileName_Part3[4];
 } LFN;
 
+/*
+ * Tiny files keep their content in the directory. A file created small
+ * enough has MAX_INLINE_SLOTS InlineSlot entries right after its short
+ * entry (INLINE_SLOTS), and while its content fits there (INLINE_DATA) it
+ * has no cluster chain: FirstClusterNo is 0. Like LFN entries, the slots
+ * carry ATTR_LONE_FILE_NAME, so directory scans step over them. A file
+ * that outgrows its slots moves to a cluster chain and leaves them unused.
+ */
+#define INLINE_SLOTS 0x01
+#define INLINE_DATA  0x02
+
+#define INLINE_SLOT_MARKER 0x01
+#define INLINE_SLOT_BYTES  30
+#define MAX_INLINE_SLOTS   3
+#define MAX_INLINE_SIZE    (MAX_INLINE_SLOTS * INLINE_SLOT_BYTES)
+
+typedef struct InlineSlot {
+  u_int8_t Marker;   // INLINE_SLOT_MARKER, never a free entry
+  u_int8_t Data1[10];
+  u_int8_t Attr;     // ATTR_LONE_FILE_NAME
+  u_int8_t Data2[20];
+} InlineSlot;
+
+/*
+ * Compressed files (ATTR_COMPRESSED) store fixed-size logical chunks, each
+ * compressed on its own and starting on a cluster boundary of the data chain
+ * at FirstClusterNo. FstCLusHI holds the first cluster of a second chain
+ * with one ChunkEntry per chunk, so a read only decompresses the chunks
+ * its range touches. FileSize is the logical size.
+ */
+#define COMPRESSION_CHUNK_SIZE 4096
+
+typedef struct ChunkEntry {
+  u_int32_t Offset; // byte offset of the chunk in the data chain
+  u_int16_t Length; // bytes the chunk occupies in the data chain
+  u_int16_t Stored; // 1 if the chunk did not compress and is stored raw
+} ChunkEntry;
+
 typedef struct SoftLink {
   u_int8_t Filename[11];
   u_int8_t Attr;
@@ -104,18 +156,185 @@ typedef struct SoftLink {
 } SoftLink;
 
 
-void initFileEntry(u_int8_t *working_dir, u_int8_t *fp, char *filename, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo, int isDir);
+/*
+ * Volume layout, in sectors from the start of the image:
+ *
+ *   boot sector | (FAT, remap, fill) copy 0 .. FATCopies-1 | checksum table
+ *               | reference counts | snapshot table | checkpoint table | data
+ *
+ * The root directory is an ordinary directory chain in the data region
+ * starting at RootCluster, so it grows like any other directory.
+ *
+ * Cluster numbers in the FAT name chain nodes. The remap table that follows
+ * each FAT gives the physical data cluster holding a node's contents, so
+ * several nodes can share one physical cluster. Physical clusters are
+ * numbered from 2 like nodes, and each carries a reference count of the
+ * nodes mapped onto it.
+ *
+ * The fill table gives the number of bytes a node's cluster holds, so
+ * bytes can be cut out of the middle of a chain without shifting the rest.
+ * 0 means a full cluster. The last node of a chain always reads as full;
+ * how much of it is used follows from the file size.
+ *
+ * A node with no physical cluster (remap 0) is a hole: it takes no space
+ * and reads as zeros. Its fill gives its length, which may exceed a cluster.
+ *
+ * The checksum table holds one CRC32C per physical cluster (indexed by P-2)
+ * followed by one per sector of the primary (FAT, remap, fill) copy.
+ *
+ * A striped volume spreads its physical clusters over StripeImages image
+ * files in units of StripeClusters clusters, round-robin: unit u is unit
+ * u / StripeImages of image u % StripeImages. Image 0 is the metadata
+ * image above and keeps the directories; the others are stripe images, a
+ * StripeHeader padded to a unit followed by their units.
+ */
+#define MAX_STRIPES 16
+#define STRIPE_MAGIC "SFSTRIPE"
+
+typedef struct StripeHeader {
+  u_int8_t Magic[8]; // STRIPE_MAGIC
+  u_int32_t VolumeSerialNumber; // of the metadata image
+  u_int16_t Index; // position of this image in the stripe set
+  u_int16_t Count; // number of images in the stripe set
+} StripeHeader;
+
+u_int32_t clusterSize(BootSector *sysInfo);
+u_int32_t volumeSectors(BootSector *sysInfo);
+u_int32_t fatEntries(BootSector *sysInfo);
+u_int32_t fatCopySectors(BootSector *sysInfo);
+u_int16_t* fatCopy(BootSector *sysInfo, int copy);
+u_int16_t* remapTable(u_int16_t *FAT, BootSector *sysInfo);
+u_int16_t* fillTable(u_int16_t *FAT, BootSector *sysInfo);
+u_int32_t* checksumTable(BootSector *sysInfo);
+u_int16_t* refcountTable(BootSector *sysInfo);
+u_int8_t* snapshotTable(BootSector *sysInfo);
+u_int8_t* checkpointTable(BootSector *sysInfo);
+u_int8_t* dataRegion(BootSector *sysInfo);
+void sizeTables(BootSector *sysInfo, u_int32_t clusters);
+int checkGeometry(BootSector *sysInfo);
+void rootEntry(FILE_t *root, BootSector *sysInfo);
+u_int16_t physicalCluster(u_int16_t N, u_int16_t *FAT, BootSector *sysInfo);
+int isHole(u_int16_t N, u_int16_t *FAT, BootSector *sysInfo);
+void setStripes(u_int8_t **data, u_int32_t count);
+u_int32_t stripeOf(u_int16_t P, BootSector *sysInfo);
+u_int32_t stripeUnits(u_int32_t image, BootSector *sysInfo);
+u_int8_t* physicalAddr(u_int16_t P, u_int8_t *data, BootSector *sysInfo);
+u_int8_t* clusterAddr(u_int16_t N, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+u_int32_t nodeBytes(u_int16_t N, u_int16_t *FAT, BootSector *sysInfo);
+int isDeletedLink(u_int16_t value, BootSector *sysInfo);
+
+typedef struct ClusterCounts {
+  u_int32_t used;     // nodes in live chains
+  u_int32_t deleted;  // nodes held by deleted files
+  u_int32_t physical; // physical clusters in use
+  u_int32_t reserved; // free physical clusters promised to data not placed yet
+} ClusterCounts;
+
+void countClusters(u_int16_t *FAT, BootSector *sysInfo);
+const ClusterCounts* clusterCounts(void);
+int reserveClusters(u_int32_t clusters, BootSector *sysInfo);
+void unreserveClusters(u_int32_t clusters);
+
+void writeFAT(u_int16_t *FAT, BootSector *sysInfo, u_int16_t N, u_int16_t value);
+void writeFATBatch(u_int16_t *FAT, BootSector *sysInfo, const u_int16_t *nodes, const u_int16_t *values,
+                   u_int32_t count);
+void writeRemap(u_int16_t *FAT, BootSector *sysInfo, u_int16_t N, u_int16_t P);
+void writeFill(u_int16_t *FAT, BootSector *sysInfo, u_int16_t N, u_int16_t bytes);
+void setNodeBytes(u_int16_t N, u_int32_t bytes, u_int16_t *FAT, BootSector *sysInfo);
+void refreshFATChecksums(BootSector *sysInfo);
+u_int16_t allocPhysical(u_int16_t *FAT, BootSector *sysInfo);
+u_int16_t allocMetaPhysical(u_int16_t *FAT, BootSector *sysInfo);
+void addReference(u_int16_t P, BootSector *sysInfo);
+int isSharedCluster(u_int16_t N, u_int16_t *FAT, BootSector *sysInfo);
+void releasePhysical(u_int16_t P, BootSector *sysInfo);
+u_int16_t allocCluster(u_int16_t *FAT, BootSector *sysInfo);
+u_int16_t allocDirCluster(u_int16_t *FAT, BootSector *sysInfo);
+u_int16_t allocHole(u_int16_t *FAT, BootSector *sysInfo, u_int32_t bytes);
+void freeCluster(u_int16_t N, u_int16_t *FAT, BootSector *sysInfo);
+void physicalModified(u_int16_t P, u_int8_t *data, BootSector *sysInfo);
+void clusterModified(u_int16_t N, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+void entryModified(void *entry, u_int8_t *data, BootSector *sysInfo);
+int verifyPhysical(u_int16_t P, u_int8_t *data, BootSector *sysInfo);
+int verifyCluster(u_int16_t N, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+
+u_int32_t chainLength(u_int16_t cluster, u_int16_t *FAT);
+int chainRead(u_int16_t first, u_int32_t offset, void *buf, u_int32_t len, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+int chainWrite(u_int16_t *first, u_int32_t offset, const void *buf, u_int32_t len, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+void chainTruncate(u_int16_t *first, u_int32_t clusters, u_int16_t *FAT, BootSector *sysInfo);
+int chainRemove(u_int16_t *first, u_int32_t offset, u_int32_t len, u_int32_t total,
+                u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+void deleteChain(u_int16_t cluster, u_int16_t *FAT, BootSector *sysInfo);
+int chainDeleted(u_int16_t cluster, u_int16_t *FAT, BootSector *sysInfo);
+void restoreChain(u_int16_t cluster, u_int16_t *FAT, BootSector *sysInfo);
+
+u_int32_t allocatedSize(FILE_t *f, u_int16_t *FAT, BootSector *sysInfo);
+int readFileData(FILE_t *f, u_int32_t start, u_int32_t end, u_int8_t *buf, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+
+/*
+ * A position in the chain of a plain file: node holds its logical bytes
+ * from start on. Passing the same cursor to consecutive fileRead and
+ * fileWrite calls carries on from where the last one stopped instead of
+ * walking the chain from FirstClusterNo. node 0 means unset.
+ */
+typedef struct ChainCursor {
+  u_int16_t node;
+  u_int32_t start;
+} ChainCursor;
+
+int fileRead(FILE_t *f, u_int32_t offset, void *buf, u_int32_t len, ChainCursor *c,
+             u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+int fileWrite(FILE_t *f, u_int32_t offset, const void *buf, u_int32_t len, ChainCursor *c,
+              u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+void compressFile(char *filename, int enable, FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+
+typedef struct UsageInfo {
+  u_int64_t logical;  // bytes of file content
+  u_int32_t clusters; // clusters in file and directory chains
+  u_int32_t physical; // distinct physical clusters behind those chains
+} UsageInfo;
+
+void forEachEntry(FILE_t *dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo,
+                  void (*visit)(FILE_t *f, void *ctx), void *ctx);
+void walkFiles(FILE_t *dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo,
+               void (*visit)(FILE_t *f, void *ctx), void *ctx);
+void fileUsage(FILE_t *root_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo, UsageInfo *info);
+/*
+ * Cached recursive usage of a directory: the size of every live file below
+ * it and the clusters their chains and those of the directories below it
+ * take. A directory's own clusters count toward its parent.
+ */
+typedef struct DirUsage {
+  u_int64_t bytes;
+  u_int32_t clusters;
+  u_int16_t parent; // first cluster of the parent directory, 0 for the root
+} DirUsage;
+
+DirUsage* directoryUsage(u_int16_t dir);
+void entryUsage(FILE_t *f, u_int16_t *FAT, BootSector *sysInfo, u_int64_t *bytes, u_int32_t *clusters);
+void sumDirectory(FILE_t *dir, u_int16_t parent, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+void addDirUsage(u_int16_t dir, int64_t bytes, int64_t clusters);
+void buildDedupIndex(FILE_t *root_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+void dedup(FILE_t *root_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+
+int isRootDirectory(FILE_t *working_dir);
+int entriesForName(char *filename);
+FILE_t* nameEntries(u_int8_t *fp, char *filename);
+void writeInline(FILE_t *f, const void *buf, u_int32_t len);
+FILE_t* initFileEntry(u_int8_t *working_dir, u_int8_t *fp, char *filename, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo, int isDir);
 FILE_t* createFile(FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo, char *filename, int isDir);
 FILE_t* cd(FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo, char *filename);
 FILE_t* searchFile(FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo, char *filename);
 
-void ls(FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
-void pwd(FILE_t *working_dir, u_int8_t *data, BootSector *sysInfo);
+void ls(FILE_t *working_dir, int longFormat, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+void pwd(FILE_t **path, int depth);
 void undeleteFile(FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo, char *filename);
 
 void cat(char* filename, FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data,BootSector *sysInfo);
 void writeFile(char* filename, size_t amt, char *input, FILE_t *working_dir, u_int16_t *FAT,u_int8_t *data, BootSector *sysInfo);
+int appendFile(FILE_t *f, const void *buf, u_int32_t len, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
 void append(char* filename, size_t amt, char *input, FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+void writeAt(char *filename, size_t offset, size_t amt, char *input, FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+void truncateFile(char *filename, size_t size, FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
 void rm(char* filename, FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
 void removeRange(char* filename, int start, int end, FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
 void rm_dir(FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo, char *dir_name);
@@ -123,10 +342,12 @@ void rm_rf(FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysI
 
 void get(char* filename, size_t startByte, size_t endByte, FILE_t *working_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
 void getPages(FILE_t *file, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+void find(FILE_t *dir, char *path, char *pattern, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
 
 int isEmpty(FILE_t *f, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
 
 void scandisk(FILE_t *root_dir, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
+void scrub(u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
 
 void dump(u_int16_t pageNumber, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
 void dumpBinary(u_int16_t pageNumber, char *filename, u_int16_t *FAT, u_int8_t *data, BootSector *sysInfo);
@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+
+u_int64_t traceClock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (u_int64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void putVarint(FILE *fp, u_int64_t v)
+{
+  while (v >= 0x80) {
+    fputc((v & 0x7F) | 0x80, fp);
+    v >>= 7;
+  }
+  fputc(v, fp);
+}
+
+static int getVarint(FILE *fp, u_int64_t *v)
+{
+  *v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = fgetc(fp);
+    if (c == EOF)
+      return -1;
+    *v |= (u_int64_t)(c & 0x7F) << shift;
+    if (!(c & 0x80))
+      return 0;
+  }
+  return -1;
+}
+
+int traceOpen(Trace *trace, char *file, int write)
+{
+  trace->last = 0;
+  trace->fp = fopen(file, write ? "wb" : "rb");
+  if (trace->fp == NULL)
+    return -1;
+  if (write) {
+    fwrite(TRACE_MAGIC, 1, 4, trace->fp);
+    fputc(TRACE_VERSION, trace->fp);
+    return 0;
+  }
+
+  char magic[4];
+  if (fread(magic, 1, 4, trace->fp) != 4 || memcmp(magic, TRACE_MAGIC, 4) != 0
+      || fgetc(trace->fp) != TRACE_VERSION) {
+    fclose(trace->fp);
+    trace->fp = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+void traceClose(Trace *trace)
+{
+  if (trace->fp != NULL)
+    fclose(trace->fp);
+  trace->fp = NULL;
+}
+
+void traceWrite(Trace *trace, u_int64_t start, u_int64_t latency, const char *command)
+{
+  size_t len = strlen(command);
+  putVarint(trace->fp, start - trace->last);
+  putVarint(trace->fp, latency);
+  putVarint(trace->fp, len);
+  fwrite(command, 1, len, trace->fp);
+  trace->last = start;
+}
+
+int traceRead(Trace *trace, u_int64_t *start, u_int64_t *latency, char **command, size_t *size)
+{
+  u_int64_t delta, len;
+  if (getVarint(trace->fp, &delta) != 0 || getVarint(trace->fp, latency) != 0
+      || getVarint(trace->fp, &len) != 0)
+    return -1;
+  if (*command == NULL || *size < len + 1) {
+    char *grown = realloc(*command, len + 1);
+    if (grown == NULL)
+      return -1;
+    *command = grown;
+    *size = len + 1;
+  }
+  if (fread(*command, 1, len, trace->fp) != len)
+    return -1;
+  (*command)[len] = '\0';
+  *start = trace->last += delta;
+  return 0;
+}
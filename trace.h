@@ -0,0 +1,46 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Workload traces: every command run against a volume, in order, with
+ * when it started and how long it took.
+ *
+ * A trace file starts with the 4 byte magic "SFTR" and a version byte,
+ * followed by one record per command:
+ *
+ *   delta | latency | length | command
+ *
+ * delta is the start of the command in nanoseconds after the start of the
+ * previous one (after the start of the recording for the first), latency
+ * is in nanoseconds and length is the number of command bytes that follow.
+ * The three numbers are unsigned LEB128 varints, so a typical record takes
+ * about 8 bytes besides the command text.
+ */
+#define TRACE_MAGIC   "SFTR"
+#define TRACE_VERSION 1
+
+typedef struct Trace {
+  FILE *fp;
+  u_int64_t last; // start of the previous record
+} Trace;
+
+//Nanoseconds on a monotonic clock.
+u_int64_t traceClock(void);
+
+//Open file to record to, or to replay from if write is 0.
+//Return 0 on success, -1 otherwise.
+int traceOpen(Trace *trace, char *file, int write);
+void traceClose(Trace *trace);
+
+//start is in nanoseconds since the start of the recording.
+void traceWrite(Trace *trace, u_int64_t start, u_int64_t latency, const char *command);
+
+//Read the next record into start, latency and the malloc'd *command, which
+//is grown as needed like getline's. Return 0 on success, -1 at the end of
+//the trace or on a truncated record.
+int traceRead(Trace *trace, u_int64_t *start, u_int64_t *latency, char **command, size_t *size);
+
+#endif
@@ -0,0 +1,232 @@
+#include <stdarg.h>
+#include <sched.h>
+#include <pthread.h>
+#include "walk.h"
+
+struct WalkChild {
+  WalkTask *task;
+  size_t at; // offset in the parent's output where the child's goes
+};
+
+typedef struct WalkDeque {
+  pthread_mutex_t lock;
+  WalkTask **tasks; // tasks[top, bottom) are queued
+  u_int32_t top, bottom, size;
+} WalkDeque;
+
+typedef struct WalkPool {
+  TreeWalk *walk;
+  WalkDeque *deques;
+  long threads;
+  long pending; // tasks queued or running
+} WalkPool;
+
+typedef struct WalkWorker {
+  WalkPool *pool;
+  long self;
+  WalkTask *task; // the one being listed
+} WalkWorker;
+
+static void push(WalkDeque *d, WalkTask *task) {
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom == d->size) {
+    if (d->top > 0) {
+      memmove(d->tasks, d->tasks + d->top, (d->bottom - d->top) * sizeof(WalkTask*));
+      d->bottom -= d->top;
+      d->top = 0;
+    }
+    else {
+      d->size = d->size ? 2 * d->size : 64;
+      d->tasks = realloc(d->tasks, d->size * sizeof(WalkTask*));
+    }
+  }
+  d->tasks[d->bottom++] = task;
+  pthread_mutex_unlock(&d->lock);
+}
+
+//The owner takes the task it queued last.
+static WalkTask* pop(WalkDeque *d) {
+  WalkTask *task = NULL;
+  pthread_mutex_lock(&d->lock);
+  if (d->top != d->bottom)
+    task = d->tasks[--d->bottom];
+  pthread_mutex_unlock(&d->lock);
+  return task;
+}
+
+//Thieves take the oldest task.
+static WalkTask* steal(WalkDeque *d) {
+  WalkTask *task = NULL;
+  pthread_mutex_lock(&d->lock);
+  if (d->top != d->bottom)
+    task = d->tasks[d->top++];
+  pthread_mutex_unlock(&d->lock);
+  return task;
+}
+
+static WalkTask* newTask(FILE_t *dir, WalkTask *parent, const char *path) {
+  WalkTask *task = calloc(1, sizeof(WalkTask));
+  task->dir = dir;
+  task->parent = parent;
+  task->path = strdup(path);
+  return task;
+}
+
+void walkPrintf(WalkTask *task, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(task->out + task->outLen, task->outSize - task->outLen, format, args);
+  va_end(args);
+  if (n < 0)
+    return;
+  if (task->outLen + n >= task->outSize) {
+    while (task->outLen + n >= task->outSize)
+      task->outSize = task->outSize ? 2 * task->outSize : 256;
+    task->out = realloc(task->out, task->outSize);
+    va_start(args, format);
+    vsnprintf(task->out + task->outLen, task->outSize - task->outLen, format, args);
+    va_end(args);
+  }
+  task->outLen += n;
+}
+
+void walkDeleteChain(WalkTask *task, u_int16_t cluster, u_int16_t *FAT) {
+  for (; cluster != 0 && cluster != END_OF_FILE; cluster = FAT[cluster]) {
+    if (task->writes == task->writeSize) {
+      task->writeSize = task->writeSize ? 2 * task->writeSize : 64;
+      task->nodes = realloc(task->nodes, task->writeSize * sizeof(u_int16_t));
+      task->values = realloc(task->values, task->writeSize * sizeof(u_int16_t));
+    }
+    task->nodes[task->writes] = cluster;
+    task->values[task->writes++] = FAT[cluster] ^ DELETED_CLUSTER;
+  }
+}
+
+static void visitEntry(FILE_t *f, void *arg) {
+  WalkWorker *worker = (WalkWorker*)arg;
+  WalkPool *pool = worker->pool;
+  WalkTask *task = worker->task;
+  pool->walk->visit(f, task, pool->walk->ctx);
+  if (!(f->Attr & ATTR_DIRECTORY))
+    return;
+
+  size_t len = strlen(task->path);
+  char *path = malloc(len + MAX_LEN_OF_SFN + 2);
+  sprintf(path, "%s/%.*s", task->path, (int)strnlen((char*)f->Filename, MAX_LEN_OF_SFN), f->Filename);
+  WalkTask *child = newTask(f, task, path);
+  free(path);
+  if (task->childCount == task->childSize) {
+    task->childSize = task->childSize ? 2 * task->childSize : 8;
+    task->children = realloc(task->children, task->childSize * sizeof(WalkChild));
+  }
+  task->children[task->childCount].task = child;
+  task->children[task->childCount++].at = task->outLen;
+  __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+  push(&pool->deques[worker->self], child);
+}
+
+static void runTask(WalkWorker *worker, WalkTask *task) {
+  TreeWalk *walk = worker->pool->walk;
+  worker->task = task;
+  if (walk->enter != NULL)
+    walk->enter(task, walk->ctx);
+  forEachEntry(task->dir, walk->FAT, walk->data, walk->sysInfo, visitEntry, worker);
+  __atomic_sub_fetch(&worker->pool->pending, 1, __ATOMIC_SEQ_CST);
+}
+
+static void* walkWorker(void *arg) {
+  WalkWorker *worker = (WalkWorker*)arg;
+  WalkPool *pool = worker->pool;
+  while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) != 0) {
+    WalkTask *task = pop(&pool->deques[worker->self]);
+    for (long i = 1; task == NULL && i < pool->threads; ++i)
+      task = steal(&pool->deques[(worker->self + i) % pool->threads]);
+    if (task != NULL)
+      runTask(worker, task);
+    else
+      sched_yield();
+  }
+  return NULL;
+}
+
+static void countWrites(WalkTask *task, u_int32_t *writes) {
+  *writes += task->writes;
+  for (u_int32_t i = 0; i < task->childCount; ++i)
+    countWrites(task->children[i].task, writes);
+}
+
+/*
+ * Write the output of task with that of its subdirectories spliced in,
+ * gather its FAT writes into nodes and values, then free it.
+ */
+static void finishTask(WalkTask *task, TreeWalk *walk, u_int16_t *nodes, u_int16_t *values, u_int32_t *writes) {
+  if (task->writes) {
+    memcpy(nodes + *writes, task->nodes, task->writes * sizeof(u_int16_t));
+    memcpy(values + *writes, task->values, task->writes * sizeof(u_int16_t));
+    *writes += task->writes;
+  }
+  size_t written = 0;
+  for (u_int32_t i = 0; i < task->childCount; ++i) {
+    WalkChild *c = &task->children[i];
+    if (c->at != written)
+      fwrite(task->out + written, 1, c->at - written, stdout);
+    written = c->at;
+    finishTask(c->task, walk, nodes, values, writes);
+  }
+  if (task->outLen != written)
+    fwrite(task->out + written, 1, task->outLen - written, stdout);
+  if (walk->leave != NULL)
+    walk->leave(task, walk->ctx);
+  free(task->out);
+  free(task->children);
+  free(task->nodes);
+  free(task->values);
+  free(task->path);
+  free(task);
+}
+
+/*
+ * The calling thread lists dir itself and only starts one worker per
+ * other CPU if dir has subdirectories.
+ */
+void treeWalk(FILE_t *dir, const char *path, TreeWalk *walk) {
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1)
+    threads = 1;
+  WalkPool pool = { walk, calloc(threads, sizeof(WalkDeque)), threads, 1 };
+  WalkWorker *workers = calloc(threads, sizeof(WalkWorker));
+  pthread_t *tids = calloc(threads, sizeof(pthread_t));
+  for (long i = 0; i < threads; ++i) {
+    pthread_mutex_init(&pool.deques[i].lock, NULL);
+    workers[i].pool = &pool;
+    workers[i].self = i;
+  }
+
+  WalkTask *root = newTask(dir, NULL, path);
+  runTask(&workers[0], root);
+  long started = root->childCount ? threads : 1;
+  for (long i = 1; i < started; ++i)
+    pthread_create(&tids[i], NULL, walkWorker, &workers[i]);
+  walkWorker(&workers[0]);
+  for (long i = 1; i < started; ++i)
+    pthread_join(tids[i], NULL);
+
+  u_int32_t writes = 0;
+  countWrites(root, &writes);
+  u_int16_t *nodes = malloc(writes * sizeof(u_int16_t) + 1);
+  u_int16_t *values = malloc(writes * sizeof(u_int16_t) + 1);
+  writes = 0;
+  finishTask(root, walk, nodes, values, &writes);
+  if (writes)
+    writeFATBatch(walk->FAT, walk->sysInfo, nodes, values, writes);
+  free(nodes);
+  free(values);
+
+  for (long i = 0; i < threads; ++i) {
+    pthread_mutex_destroy(&pool.deques[i].lock);
+    free(pool.deques[i].tasks);
+  }
+  free(pool.deques);
+  free(workers);
+  free(tids);
+}
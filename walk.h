@@ -0,0 +1,60 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include <sys/types.h>
+#include "structs.h"
+
+/*
+ * Parallel walk over a directory tree.
+ *
+ * Every directory is a task. Each worker thread keeps a deque of tasks:
+ * it pushes the subdirectories it finds and pops them back from the same
+ * end, while idle workers steal from the other end, where the tasks
+ * nearest the top of the tree and so the largest subtrees are.
+ *
+ * Workers only read the volume. What they print and the FAT writes they
+ * want are buffered in their task, and once every directory has been
+ * listed the calling thread writes the output in tree order, as a
+ * depth-first walk would have printed it, and applies the FAT writes in
+ * one batch.
+ */
+typedef struct WalkChild WalkChild;
+
+typedef struct WalkTask {
+  FILE_t *dir;             // the directory this task lists
+  struct WalkTask *parent; // NULL for the directory the walk started at
+  char *path;              // of dir, starting with the path the walk was given
+  u_int64_t sums[2];       // for the callbacks, 0 to begin with
+
+  char *out; // buffered output
+  size_t outLen, outSize;
+  WalkChild *children; // subdirectories, in entry order
+  u_int32_t childCount, childSize;
+  u_int16_t *nodes, *values; // buffered FAT writes
+  u_int32_t writes, writeSize;
+} WalkTask;
+
+typedef struct TreeWalk {
+  u_int16_t *FAT;
+  u_int8_t *data;
+  BootSector *sysInfo;
+  //On a worker thread, before the entries of a directory. May be NULL.
+  void (*enter)(WalkTask *task, void *ctx);
+  //On a worker thread, for every live entry of a directory in order.
+  void (*visit)(FILE_t *f, WalkTask *task, void *ctx);
+  //On the calling thread after the walk, once the output of a directory
+  //and everything below it has been written. May be NULL.
+  void (*leave)(WalkTask *task, void *ctx);
+  void *ctx;
+} TreeWalk;
+
+//Walk dir and every directory below it. path names dir in the output.
+void treeWalk(FILE_t *dir, const char *path, TreeWalk *walk);
+
+//Buffer output of task, written to stdout in tree order after the walk.
+void walkPrintf(WalkTask *task, const char *format, ...);
+
+//Mark every cluster of the chain starting at cluster as deleted after the walk.
+void walkDeleteChain(WalkTask *task, u_int16_t cluster, u_int16_t *FAT);
+
+#endif